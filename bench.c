@@ -0,0 +1,479 @@
+#include <assert.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "kamby.h"
+
+#define ITEMS 1000000
+#define VARS 1000
+#define LOOKUPS 1000000
+#define APPENDS 100000
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+size_t heap_used()
+{
+    return mallinfo2().uordblks;
+}
+
+void bench_nodes()
+{
+    size_t before = heap_used();
+    KaNode *list = ka_new(KA_LIST), **last = &list->children;
+
+    for (int i = 0; i < ITEMS; i++) {
+        *last = ka_number(i);
+        last = &(*last)->next;
+    }
+
+    size_t used = heap_used() - before;
+    printf("%-28s %10.0f nodes/MB\n", "number list", ITEMS / (used / 1e6));
+    ka_free(list);
+}
+
+void bench_keyed_nodes()
+{
+    size_t before = heap_used();
+    KaNode *list = ka_new(KA_LIST), **last = &list->children;
+
+    for (int i = 0; i < ITEMS; i++) {
+        *last = ka_key(NULL, ka_chain(ka_symbol("item"), ka_number(i), NULL));
+        last = &(*last)->next;
+    }
+
+    size_t used = heap_used() - before;
+    printf("%-28s %10.0f nodes/MB\n", "keyed number list",
+        ITEMS / (used / 1e6));
+    ka_free(list);
+}
+
+void bench_lookup()
+{
+    KaNode *ctx = ka_init();
+    char name[32];
+
+    for (int i = 0; i < VARS; i++) {
+        snprintf(name, sizeof(name), "var%d", i);
+        ka_free(ka_def(&ctx, ka_chain(ka_symbol(name), ka_number(i), NULL)));
+    }
+
+    double start = now();
+
+    for (int i = 0; i < LOOKUPS; i++) {
+        ka_free(ka_get(&ctx, ka_symbol(i % 2 ? "var0" : "var500")));
+    }
+
+    double elapsed = now() - start;
+    printf("%-28s %10.0f lookups/s\n", "variable lookup", LOOKUPS / elapsed);
+    ka_free(ctx);
+}
+
+void bench_format()
+{
+    KaNode *ctx = ka_init();
+    double start = now();
+
+    for (int i = 0; i < ITEMS; i++) {
+        ka_free(ka_cat(&ctx, ka_chain(
+            ka_string("total: "), ka_number(i % 2 ? i : i + 0.25), NULL
+        )));
+    }
+
+    double elapsed = now() - start;
+    printf("%-28s %10.0f concats/s\n", "number concatenation", ITEMS / elapsed);
+    ka_free(ctx);
+}
+
+void bench_split()
+{
+    KaNode *ctx = ka_init();
+    char *text = (char *)malloc(ITEMS);
+
+    for (int i = 0; i < ITEMS; i++) {
+        text[i] = 'a' + i % 26;
+    }
+
+    size_t before = heap_used();
+    double start = now();
+    KaNode *list = ka_split(&ctx, ka_chain(
+        ka_stringn(text, ITEMS), ka_string(""), NULL
+    ));
+    double elapsed = now() - start;
+    size_t used = heap_used() - before;
+
+    printf("%-28s %10.0f chars/s\n", "character split", ITEMS / elapsed);
+    printf("%-28s %10.0f chars/MB\n", "character split memory",
+        ITEMS / (used / 1e6));
+    ka_free(list);
+    ka_free(ctx);
+    free(text);
+}
+
+void bench_append()
+{
+    KaNode *ctx = ka_init();
+    ka_free(ka_def(&ctx, ka_chain(ka_symbol("s"), ka_string(""), NULL)));
+
+    double start = now();
+
+    for (int i = 0; i < APPENDS; i++) {
+        KaNode *value = ka_get(&ctx, ka_symbol("s"));
+        value->key = ctx->key;
+        ka_free(ka_addset(&ctx, ka_chain(value, ka_string("x"), NULL)));
+    }
+
+    double elapsed = now() - start;
+    printf("%-28s %10.0f appends/s\n", "string append", APPENDS / elapsed);
+    ka_free(ctx);
+}
+
+void bench_join()
+{
+    for (int items = 10000; items <= ITEMS; items *= 10) {
+        KaNode *list = ka_new(KA_LIST), **last = &list->children;
+
+        for (int i = 0; i < items; i++) {
+            *last = i % 4 ? ka_string("item") : ka_number(i);
+            last = &(*last)->next;
+        }
+
+        double start = now();
+        KaNode *result = ka_join(NULL, ka_chain(list, ka_string(", "), NULL));
+        double elapsed = now() - start;
+
+        char name[32];
+        snprintf(name, sizeof(name), "join %d items", items);
+        printf("%-28s %10.1f ns/item\n", name, elapsed / items * 1e9);
+        ka_free(result);
+    }
+}
+
+void bench_split_fields()
+{
+    KaNode *line = ka_string(
+        "2024-01-01T00:00:00.000Z INFO [worker-12] request completed "
+        "path=/api/v1/items/12345?expand=owner,tags status=200 took=12ms"
+    );
+    double start = now();
+
+    for (int i = 0; i < LOOKUPS; i++) {
+        ka_free(ka_split(NULL, ka_chain(ka_copy(line), ka_string(" "), NULL)));
+    }
+
+    double elapsed = now() - start;
+    printf("%-28s %10.0f lines/s\n", "log line split", LOOKUPS / elapsed);
+    ka_free(line);
+}
+
+void bench_replace()
+{
+    char *text = (char *)malloc(ITEMS);
+
+    for (int i = 0; i < ITEMS; i++) {
+        text[i] = (i % 64 == 63) ? '\n' : 'a' + i % 26;
+    }
+
+    KaNode *source = ka_stringn(text, ITEMS);
+    double start = now();
+
+    for (int i = 0; i < 10; i++) {
+        ka_free(ka_replace(NULL, ka_chain(
+            ka_copy(source), ka_string("\n"), ka_string("\r\n"), NULL
+        )));
+    }
+
+    double elapsed = now() - start;
+    printf("%-28s %10.0f MB/s\n", "replace", 10 * ITEMS / elapsed / 1e6);
+    ka_free(source);
+    free(text);
+}
+
+void bench_find_long()
+{
+    char pattern[256];
+
+    memset(pattern, 'a', sizeof(pattern));
+    pattern[sizeof(pattern) / 2] = 'b';
+
+    KaNode *source = ka_new(KA_STRING);
+    source->string = ka_buf_new(ITEMS + 1);
+    source->length = ITEMS;
+    memset(source->string, 'a', ITEMS);
+    source->string[ITEMS] = '\0';
+
+    double start = now();
+
+    for (int i = 0; i < 10; i++) {
+        ka_free(ka_find(NULL, ka_chain(
+            ka_copy(source), ka_stringn(pattern, sizeof(pattern)), NULL
+        )));
+    }
+
+    double elapsed = now() - start;
+    printf("%-28s %10.0f MB/s\n", "find long pattern, no match",
+           10 * ITEMS / elapsed / 1e6);
+    ka_free(source);
+}
+
+void bench_upper()
+{
+    char *text = (char *)malloc(ITEMS);
+
+    for (int i = 0; i < ITEMS; i++) {
+        text[i] = 'a' + i % 26;
+    }
+
+    KaNode *source = ka_stringn(text, ITEMS);
+    double start = now();
+
+    for (int i = 0; i < 10; i++) {
+        ka_free(ka_upper(NULL, ka_copy(source)));
+    }
+
+    double elapsed = now() - start;
+    printf("%-28s %10.0f MB/s\n", "upper", 10 * ITEMS / elapsed / 1e6);
+    ka_free(source);
+    free(text);
+}
+
+void bench_match()
+{
+    KaNode *line = ka_string(
+        "2024-01-01T00:00:00.000Z INFO [worker-12] request completed "
+        "path=/api/v1/items/12345?expand=owner,tags status=200 took=12ms"
+    );
+    double start = now();
+
+    for (int i = 0; i < LOOKUPS; i++) {
+        ka_free(ka_match(NULL, ka_chain(
+            ka_copy(line), ka_string("status=(\\d+) took=(\\d+)ms"), NULL
+        )));
+    }
+
+    double elapsed = now() - start;
+    printf("%-28s %10.0f lines/s\n", "log line match", LOOKUPS / elapsed);
+    ka_free(line);
+}
+
+void bench_parse()
+{
+    const char *line =
+        "total = (price * 2 + tax) // line comment\n"
+        "items = [1, 2.5, 'item', { x = x + 1; print x }]\n";
+    size_t size = strlen(line);
+
+    for (int mb = 1; mb <= 4; mb *= 4) {
+        size_t lines = mb * (1 << 20) / size, length = lines * size, pos = 0;
+        char *text = (char *)malloc(length + 1);
+
+        for (size_t i = 0; i < lines; i++) {
+            memcpy(text + i * size, line, size);
+        }
+
+        text[length] = '\0';
+
+        double start = now();
+        KaNode *expr = ka_parse(text, length, &pos);
+        double elapsed = now() - start;
+
+        char name[32];
+        snprintf(name, sizeof(name), "parse %d MB script", mb);
+        printf("%-28s %10.1f MB/s\n", name, length / elapsed / 1e6);
+        ka_free(expr);
+        free(text);
+    }
+}
+
+// Generated data file: a large list literal of numbers and quoted records,
+// indented and commented
+
+void bench_parse_data()
+{
+    const char *lines[] = {
+        "    # Record with a long description and an escaped quote\n",
+        "    [1024, 3.25, 'sensor-12', \"temperature reading taken at the "
+        "north gate, \\\"calibrated\\\" weekly\"],\n",
+        "    [2048, 7.5, 'sensor-13', 'humidity reading taken at the south "
+        "gate after the morning shift'],\n",
+    };
+    size_t length = 0, cap = 4 << 20, pos = 0;
+    char *text = (char *)malloc(cap + 256);
+
+    length += sprintf(text, "data = [\n");
+
+    for (int i = 0; length < cap; i++) {
+        const char *line = lines[i % 3];
+        memcpy(text + length, line, strlen(line));
+        length += strlen(line);
+    }
+
+    length += sprintf(text + length, "]\n");
+
+    KaLexer lex = { text, length, 0, '\0' };
+    double start = now();
+    while (ka_token(&lex).type != KA_TOKEN_END);
+    double elapsed = now() - start;
+
+    printf("%-28s %10.1f MB/s\n", "lex 4 MB data file",
+        length / elapsed / 1e6);
+
+    start = now();
+    KaNode *expr = ka_parse(text, length, &pos);
+    elapsed = now() - start;
+
+    printf("%-28s %10.1f MB/s\n", "parse 4 MB data file",
+        length / elapsed / 1e6);
+
+    ka_cache_save("bench.kac", expr, text, length);
+    start = now();
+    KaNode *tree = ka_cache_load("bench.kac", text, length);
+    elapsed = now() - start;
+
+    printf("%-28s %10.1f MB/s\n", "map 4 MB data file",
+        length / elapsed / 1e6);
+    assert(tree);
+    remove("bench.kac");
+    ka_free(expr);
+    free(text);
+}
+
+void bench_read()
+{
+    size_t length = 64 << 20;
+    char *text = (char *)malloc(length);
+
+    for (size_t i = 0; i < length; i++) {
+        text[i] = (i % 64 == 63) ? '\n' : 'a' + i % 26;
+    }
+
+    FILE *file = fopen("bench.out", "wb");
+    fwrite(text, 1, length, file);
+    fclose(file);
+
+    // Count lines too, mapped pages are only read when touched
+    size_t lines = 0;
+    double start = now();
+    KaNode *data = ka_read(NULL, ka_string("bench.out"));
+
+    const char *c = data->string, *end = c + data->length;
+
+    while ((c = (const char *)memchr(c, '\n', end - c))) {
+        lines++;
+        c++;
+    }
+
+    double elapsed = now() - start;
+
+    printf("%-28s %10.1f MB/s\n", "read 64 MB file", length / elapsed / 1e6);
+    assert(data->length == length && lines == length / 64);
+    remove("bench.out");
+    ka_free(data);
+    free(text);
+}
+
+void bench_init()
+{
+    double start = now();
+
+    for (int i = 0; i < APPENDS; i++) {
+        ka_free(ka_init());
+    }
+
+    double elapsed = now() - start;
+    printf("%-28s %10.0f contexts/s\n", "context init", APPENDS / elapsed);
+
+    KaNode *base = ka_init();
+    size_t pos = 0;
+    const char *prelude = "def twice { $0 * 2 }; total := 10; name := 'x'";
+    KaNode *expr = ka_parse(prelude, strlen(prelude), &pos);
+    ka_free(ka_eval(&base, expr));
+    ka_free(expr);
+
+    start = now();
+
+    for (int i = 0; i < APPENDS; i++) {
+        ka_free(ka_clone(base));
+    }
+
+    elapsed = now() - start;
+    printf("%-28s %10.0f contexts/s\n", "context clone", APPENDS / elapsed);
+
+    // A request defines and changes a few variables, then is rolled back
+    const char *request = "x := total + 1; total = 2; name += 'y'";
+    pos = 0;
+    expr = ka_parse(request, strlen(request), &pos);
+    KaCheckpoint *cp = ka_checkpoint(base);
+    start = now();
+
+    for (int i = 0; i < APPENDS; i++) {
+        ka_free(ka_eval(&base, expr));
+        ka_rollback(&base, cp);
+    }
+
+    elapsed = now() - start;
+    printf("%-28s %10.0f requests/s\n", "request and rollback",
+        APPENDS / elapsed);
+    ka_checkpoint_free(base, cp);
+    ka_free(expr);
+    ka_free(base);
+}
+
+void bench_context_image()
+{
+    KaNode *ctx = ka_init();
+    KaNode *table = ka_new(KA_LIST), **last = &table->children;
+
+    for (int i = 0; i < ITEMS / 10; i++) {
+        *last = ka_list(
+            ka_key(NULL, ka_chain(ka_symbol("id"), ka_number(i), NULL)),
+            ka_key(NULL, ka_chain(
+                ka_symbol("name"), ka_string("a record name of some length"),
+                NULL
+            )),
+            NULL
+        );
+        last = &(*last)->next;
+    }
+
+    ka_free(ka_def(&ctx, ka_chain(ka_symbol("table"), table, NULL)));
+    ka_context_save("bench.img", ctx);
+
+    double start = now();
+    KaNode *restored = ka_context_load("bench.img");
+    double elapsed = now() - start;
+
+    printf("%-28s %10.0f records/s\n", "context restore",
+        ITEMS / 10 / elapsed);
+    assert(restored);
+    remove("bench.img");
+    ka_free(restored);
+    ka_free(ctx);
+}
+
+int main()
+{
+    bench_nodes();
+    bench_keyed_nodes();
+    bench_lookup();
+    bench_init();
+    bench_context_image();
+    bench_format();
+    bench_split();
+    bench_split_fields();
+    bench_append();
+    bench_join();
+    bench_replace();
+    bench_find_long();
+    bench_upper();
+    bench_match();
+    bench_parse();
+    bench_parse_data();
+    bench_read();
+    return 0;
+}
@@ -4,104 +4,1129 @@
 
 #define VER "0.2.0"
 
-void transpile_tree(KaNode *nodes, int *level)
+// Compiler. A program is lowered to C that takes the steps ka_eval would
+// take on it: the elements of each list are evaluated in order into an array
+// of temporaries, up to a returned value, and then applied. Names of builtins
+// are resolved at compile time and called directly, and while, if and for
+// with literal blocks become C loops and branches. Variables that only
+// compiled code at the top scope uses live in C locals. Blocks kept as
+// values, such as function bodies, run on the interpreter from trees built at
+// startup, and so does a whole program that rebinds a builtin or loads code.
+// Values that turn into def, set, while or bind at run time, and keys of for
+// elements that shadow a builtin, are not followed.
+
+typedef struct {
+    char *name;
+    int defs, def_seq, def_loop, set_seq, escaped, local;
+    int unboxed, stored;
+} CompilerName;
+
+typedef struct {
+    FILE *out, *init;
+    int pass, indent, temps, consts, scope, loop, seq;
+    int dynamic, computed;
+    CompilerName *names;
+    size_t count;
+    KaNode *strings;
+} Compiler;
+
+void emit(Compiler *c, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    fprintf(c->out, "%*s", c->indent * 4, "");
+    vfprintf(c->out, format, args);
+    fputc('\n', c->out);
+    va_end(args);
+}
+
+// C literal of a string, escaped byte by byte. Octal escapes take three
+// digits so a digit after them is never joined. The result must be freed.
+
+char *quote(const char *str, size_t length)
+{
+    char *result = (char *)malloc(length * 4 + 3), *out = result;
+
+    *out++ = '"';
+
+    for (size_t i = 0; i < length; i++) {
+        unsigned char byte = str[i];
+
+        if (byte == '"' || byte == '\\') {
+            *out++ = '\\';
+            *out++ = byte;
+        } else if (byte < ' ' || byte > '~' || (byte == '?' && i &&
+                   str[i - 1] == '?')) {
+            out += sprintf(out, "\\%03o", byte);
+        } else {
+            *out++ = byte;
+        }
+    }
+
+    *out++ = '"';
+    *out = '\0';
+    return result;
+}
+
+// Numbers are written exactly, integers in decimal and others in hex
+
+void write_number(FILE *out, long double number)
+{
+    if (number > -1e15 && number < 1e15 && number == (long long)number) {
+        fprintf(out, "ka_number(%lld)", (long long)number);
+    } else {
+        fprintf(out, "ka_number(%LaL)", number);
+    }
+}
+
+void write_tree(FILE *out, KaNode *node, int level)
+{
+    const char *types[] = { "list", "expr", "block" };
+    char *text;
+
+    if (node->type == KA_NUMBER) {
+        write_number(out, *node->number);
+    } else if (node->type == KA_STRING || node->type == KA_SYMBOL) {
+        text = quote(node->string, node->length);
+        fprintf(out, "ka_%sn(%s, %u)", node->type == KA_STRING
+            ? "string" : "symbol", text, node->length);
+        free(text);
+    } else if (node->type >= KA_LIST) {
+        fprintf(out, "ka_%s(\n", types[node->type - KA_LIST]);
+
+        for (KaNode *curr = node->children; curr; curr = curr->next) {
+            fprintf(out, "%*s", (level + 1) * 4, "");
+            write_tree(out, curr, level + 1);
+            fprintf(out, ",\n");
+        }
+
+        fprintf(out, "%*sNULL)", level * 4, "");
+    } else {
+        fprintf(out, "ka_new(%d)", node->type);
+    }
+}
+
+// Builtin function a symbol names, with the name of its C function
+
+KaFunc builtin(KaNode *node, const char **name)
+{
+    for (size_t i = 0; node->type == KA_SYMBOL && i < KA_BUILTINS; i++) {
+        if (ka_builtins[i].func && !strcmp(ka_builtins[i].key, node->symbol)) {
+            if (name) *name = ka_builtins[i].name;
+            return ka_builtins[i].func;
+        }
+    }
+
+    return NULL;
+}
+
+int reserved(const char *name)
+{
+    for (size_t i = 0; i < KA_BUILTINS; i++) {
+        if (!strcmp(ka_builtins[i].key, name)) return 1;
+    }
+
+    return 0;
+}
+
+int assigns(KaFunc func)
+{
+    return func == ka_addset || func == ka_subset || func == ka_mulset ||
+           func == ka_divset || func == ka_modset;
+}
+
+CompilerName *lookup(Compiler *c, const char *symbol)
+{
+    char *name = ka_intern(symbol);
+
+    for (size_t i = 0; i < c->count; i++) {
+        if (c->names[i].name == name) return &c->names[i];
+    }
+
+    c->names = (CompilerName *)realloc(c->names,
+        (c->count + 1) * sizeof(CompilerName));
+    memset(&c->names[c->count], 0, sizeof(CompilerName));
+    c->names[c->count].name = name;
+    return &c->names[c->count++];
+}
+
+// C variable of a local, and of its interned key
+
+void local_name(CompilerName *n, char *buf, char prefix)
+{
+    size_t i = 0;
+
+    while (n->name[i] && (isalnum((unsigned char)n->name[i]) ||
+           n->name[i] == '_')) {
+        i++;
+    }
+
+    if (n->name[i] || i > 32) {
+        sprintf(buf, "%c%d", prefix, n->local);
+    } else {
+        sprintf(buf, "%c_%s", prefix, n->name);
+    }
+}
+
+// Look for what makes names dynamic: code that is loaded, builtins that are
+// rebound, and names that are computed or read by key
+
+void prescan(Compiler *c, KaNode *nodes)
+{
+    for (KaNode *curr = nodes; curr; curr = curr->next) {
+        KaFunc func = builtin(curr, NULL);
+        KaNode *next = curr->next;
+
+        if (curr->type == KA_STRING) {
+            c->strings = ka_chain(ka_copy(curr), c->strings, NULL);
+        } else if (curr->type == KA_SYMBOL && !strcmp(curr->symbol, "load")) {
+            c->dynamic = 1;
+        } else if (curr->type >= KA_LIST) {
+            prescan(c, curr->children);
+        }
+
+        if (!next) continue;
+
+        if (func == ka_def || func == ka_set || func == ka_del) {
+            if (next->type != KA_SYMBOL) {
+                c->computed = 1;
+            } else if (reserved(next->symbol)) {
+                c->dynamic = 1;
+            } else if (func == ka_del) {
+                lookup(c, next->symbol)->escaped = 1;
+            }
+        } else if (func == ka_get && next->type != KA_NUMBER) {
+            c->computed = 1;
+        } else if (func == ka_bind || assigns(func)) {
+            if (next->type == KA_SYMBOL) {
+                lookup(c, next->symbol)->escaped = 1;
+            } else if (next->type == KA_EXPR) {
+                c->computed = 1;
+            }
+        }
+    }
+}
+
+// Names in a tree run by the interpreter can not be locals. Positions read
+// with $ are only safe in a block that gets a context of its own.
+
+void escape(Compiler *c, KaNode *node, int frame)
+{
+    if (node->type == KA_SYMBOL) {
+        lookup(c, node->symbol)->escaped = 1;
+    }
+
+    if (node->type < KA_LIST) return;
+
+    for (KaNode *curr = node->children; curr; curr = curr->next) {
+        if (builtin(curr, NULL) == ka_get && !frame) c->computed = 1;
+        escape(c, curr, frame);
+    }
+}
+
+int constant(Compiler *c, KaNode *node, int frame)
+{
+    if (c->pass == 1) escape(c, node, frame);
+
+    fprintf(c->init, "    k[%d] = ", c->consts);
+    write_tree(c->init, node, 1);
+    fprintf(c->init, ";\n    KA_ROOT(&k[%d]);\n", c->consts);
+    return c->consts++;
+}
+
+void compile_eval(Compiler *c, KaNode *nodes, const char *dest,
+                  const char *ctx);
+
+// One element of a list. Literal ones are taken as they are, as ka_eval does
+// with the node after def, set, while or bind.
+
+void compile_node(Compiler *c, KaNode *node, const char *dest,
+                  const char *ctx, int literal, int frame)
+{
+    char *text, buf[48];
+
+    if (literal && node->type == KA_SYMBOL) {
+        text = quote(node->symbol, node->length);
+        emit(c, "%s = ka_symboln(%s, %u);", dest, text, node->length);
+        free(text);
+    } else if (node->type == KA_SYMBOL) {
+        CompilerName *n = lookup(c, node->symbol);
+
+        if (c->scope) n->escaped = 1;
+
+        if (n->local) {
+            local_name(n, buf, 'v');
+            emit(c, "%s = ka_copy(%s);", dest, buf);
+        } else {
+            text = quote(node->symbol, node->length);
+            emit(c, "%s = ka_get(&%s, ka_symbol(%s));", dest, ctx, text);
+            free(text);
+        }
+    } else if (node->type == KA_NUMBER) {
+        fprintf(c->out, "%*s%s = ", c->indent * 4, "", dest);
+        write_number(c->out, *node->number);
+        fprintf(c->out, ";\n");
+    } else if (node->type == KA_STRING) {
+        text = quote(node->string, node->length);
+        emit(c, "%s = ka_stringn(%s, %u);", dest, text, node->length);
+        free(text);
+    } else if (node->type == KA_LIST && !literal) {
+        emit(c, "%s = ka_new(KA_LIST);", dest);
+        snprintf(buf, sizeof(buf), "%s->children", dest);
+        compile_eval(c, node->children, buf, ctx);
+    } else if (node->type == KA_EXPR && !literal) {
+        compile_eval(c, node->children, dest, ctx);
+    } else {
+        emit(c, "%s = ka_copy(k[%d]);", dest, constant(c, node, frame));
+    }
+}
+
+// Elements from start on, into temporaries t<id>. After an expression that
+// returned, the rest are left out.
+
+void compile_elements(Compiler *c, KaNode *nodes, int id, int start,
+                      const char *ctx)
 {
-    (*level)++;
+    KaFunc op = builtin(nodes, NULL);
+    KaNode *skip = NULL;
+    int guard = 0, i = 0;
+    char dest[32];
+
+    for (KaNode *curr = nodes; curr; curr = curr->next, i++) {
+        int literal = (curr == skip);
+        KaFunc func = literal ? NULL : builtin(curr, NULL);
+
+        // A block given to def or set is a function body, called with a
+        // context of its own
+        int frame = i == 2 && (op == ka_def || op == ka_set) &&
+                    nodes->next->type == KA_SYMBOL;
 
-    for (KaNode *node = nodes; node; node = node->next) {
-        const char *types[] = {
-            "none", "ctx", "false", "true", "number", "string",
-            "symbol", "func", "list", "expr", "block"
-        };
+        snprintf(dest, sizeof(dest), "t%d[%d]", id, i);
 
-        for (int i = 0; i < *level; i++) {
-            printf("    ");
+        if (i >= start) {
+            if (guard) emit(c, "if (!r%d) {", id), c->indent++;
+
+            compile_node(c, curr, dest, ctx, literal, frame);
+
+            if (!literal && curr->type == KA_EXPR) {
+                emit(c, "r%d = ka_returned(%s);", id, dest);
+            }
+
+            if (guard) c->indent--, emit(c, "}");
+            guard |= !literal && curr->type == KA_EXPR;
         }
 
-        printf("ka_%s(", types[node->type]);
+        if (curr->next && curr->next->type == KA_SYMBOL &&
+            (func == ka_key || func == ka_def || func == ka_set ||
+             func == ka_del)) {
+            skip = curr->next;
+
+            // Only a name defined or set by the statement itself may be a
+            // local, in which case the statement is compiled by assign()
+            CompilerName *n = lookup(c, skip->symbol);
 
-        if (node->type == KA_NUMBER) {
-            printf("%.2Lf),\n", *node->number);
-        } else if (node->type == KA_STRING) {
-            printf("\"%s\"),\n", node->string);
-        } else if (node->type == KA_SYMBOL) {
-            printf("\"%s\"),\n", node->symbol);
-        } else if (node->type >= KA_LIST) {
-            printf("\n");
-            transpile_tree(node->children, level);
+            if (func == ka_key) {
+                // A key, not a variable
+            } else if (c->scope || curr != nodes || func == ka_del) {
+                n->escaped = 1;
+            } else if (func == ka_def) {
+                n->defs++;
+                n->def_seq = ++c->seq;
+                n->def_loop |= c->loop > 0;
+            } else if (!n->set_seq) {
+                n->set_seq = ++c->seq;
+            }
+        } else if (func == ka_while) {
+            skip = curr->next;
+        } else if (curr->next && func == ka_bind) {
+            skip = curr->next->next;
 
-            for (int i = 0; i < *level; i++) {
-                printf("    ");
+            if (skip && skip->type == KA_SYMBOL) {
+                lookup(c, skip->symbol)->escaped = 1;
             }
+        }
+    }
+}
+
+// Open a C block with an array of count rooted temporaries
+
+int open_temps(Compiler *c, KaNode *nodes, int count)
+{
+    int id = c->temps++, exprs = 0;
+
+    for (KaNode *curr = nodes; curr; curr = curr->next) {
+        exprs |= curr->type == KA_EXPR;
+    }
+
+    emit(c, "{");
+    c->indent++;
+    emit(c, "KaNode *t%d[%d] = { NULL };", id, count);
+    if (exprs) emit(c, "int r%d = 0;", id);
+    emit(c, "ka_root_all(t%d, %d);", id, count);
+    return id;
+}
+
+void close_temps(Compiler *c, int count)
+{
+    emit(c, "KA_UNROOT(%d);", count);
+    c->indent--;
+    emit(c, "}");
+}
+
+// Whether ka_eval would take the node after this one as it is
+
+int skips(KaNode *node)
+{
+    KaFunc func = builtin(node, NULL);
+
+    return func == ka_key || func == ka_def || func == ka_set ||
+           func == ka_del || func == ka_while || func == ka_bind;
+}
+
+// := or = on a variable kept in a local
+
+int compile_assign(Compiler *c, KaNode *nodes, const char *dest,
+                   const char *ctx, int count)
+{
+    KaFunc op = builtin(nodes, NULL);
+    char var[48], key[48];
+
+    if ((op != ka_def && op != ka_set) || !nodes->next ||
+        nodes->next->type != KA_SYMBOL) {
+        return 0;
+    }
+
+    CompilerName *n = lookup(c, nodes->next->symbol);
+
+    if (!n->local) return 0;
+
+    local_name(n, var, 'v');
+    local_name(n, key, 'n');
+
+    int id = open_temps(c, nodes, count);
+    compile_elements(c, nodes, id, 2, ctx);
+    emit(c, "t%d[0] = ka_args(t%d + 2, %d);", id, id, count - 2);
+    emit(c, "%s = ka_local_%s(&%s, %s, t%d[0]);", dest,
+         op == ka_def ? "def" : "set", var, key, id);
+    close_temps(c, count);
+    return 1;
+}
+
+// Numeric loops. A while loop that only computes with numbers held in locals,
+// and assigns numbers to them, also gets a version on unboxed long doubles,
+// the type of numbers in nodes, so its results are the same. It runs when
+// the locals it uses hold numbers on entry, and they are boxed back on exit.
+
+enum { NUMBER_NONE, NUMBER_VALUE, NUMBER_TEST };
+
+static const struct {
+    KaFunc func;
+    const char *op;
+    int kind;
+} number_ops[] = {
+    { ka_add, "+",  NUMBER_VALUE },
+    { ka_sub, "-",  NUMBER_VALUE },
+    { ka_mul, "*",  NUMBER_VALUE },
+    { ka_div, "/",  NUMBER_VALUE },
+    { ka_mod, "%",  NUMBER_VALUE },
+    { ka_eq,  "==", NUMBER_TEST  },
+    { ka_neq, "!=", NUMBER_TEST  },
+    { ka_gt,  ">",  NUMBER_TEST  },
+    { ka_lt,  "<",  NUMBER_TEST  },
+    { ka_gte, ">=", NUMBER_TEST  },
+    { ka_lte, "<=", NUMBER_TEST  },
+};
+
+int number_expr(Compiler *c, KaNode *node, FILE *out);
+
+// Operator on two numbers, written as C when out is given. % works on ints,
+// as in ka_mod.
+
+int number_op(Compiler *c, KaNode *nodes, FILE *out)
+{
+    KaFunc func = builtin(nodes, NULL);
+    KaNode *left = nodes->next, *right = left ? left->next : NULL;
+
+    if (!right || right->next) return NUMBER_NONE;
+
+    for (size_t i = 0; i < sizeof(number_ops) / sizeof(number_ops[0]); i++) {
+        int mod = number_ops[i].func == ka_mod;
+
+        if (number_ops[i].func != func) continue;
+
+        if (out) fprintf(out, mod ? "(long double)((int)" : "(");
+        if (number_expr(c, left, out) != NUMBER_VALUE) return NUMBER_NONE;
+        if (out) fprintf(out, mod ? " %% (int)" : " %s ", number_ops[i].op);
+        if (number_expr(c, right, out) != NUMBER_VALUE) return NUMBER_NONE;
+        if (out) fprintf(out, ")");
+
+        return number_ops[i].kind;
+    }
+
+    return NUMBER_NONE;
+}
+
+// A list of nodes, as ka_eval takes it
+
+int number_list(Compiler *c, KaNode *nodes, FILE *out)
+{
+    if (!nodes) return NUMBER_NONE;
+
+    return nodes->next ? number_op(c, nodes, out) : number_expr(c, nodes, out);
+}
+
+int number_expr(Compiler *c, KaNode *node, FILE *out)
+{
+    if (node->type == KA_NUMBER) {
+        long double number = *node->number;
 
-            printf("NULL),\n");
+        if (!out) {
+        } else if (number > -1e15 && number < 1e15 &&
+                   number == (long long)number) {
+            fprintf(out, "%lld.0L", (long long)number);
         } else {
-            printf("\n");
+            fprintf(out, "%LaL", number);
         }
+
+        return NUMBER_VALUE;
+    } else if (node->type == KA_EXPR) {
+        return number_list(c, node->children, out);
+    } else if (node->type != KA_SYMBOL || builtin(node, NULL)) {
+        return NUMBER_NONE;
+    }
+
+    // true and else can not be rebound in a compiled program
+    if (reserved(node->symbol)) {
+        if (out) fprintf(out, strcmp(node->symbol, "false") ? "1" : "0");
+        return NUMBER_TEST;
+    }
+
+    CompilerName *n = lookup(c, node->symbol);
+    char var[48];
+
+    if (!n->local) return NUMBER_NONE;
+
+    n->unboxed = 1;
+    local_name(n, var, 'u');
+    if (out) fprintf(out, "%s", var);
+    return NUMBER_VALUE;
+}
+
+// Text of a condition. Any number is true.
+
+char *number_test(Compiler *c, KaNode *nodes, int list)
+{
+    char *text;
+    size_t size;
+    FILE *out = open_memstream(&text, &size);
+    int kind = list ? number_list(c, nodes, NULL) : number_expr(c, nodes, NULL);
+
+    if (kind == NUMBER_TEST) {
+        list ? number_list(c, nodes, out) : number_expr(c, nodes, out);
+    } else {
+        fprintf(out, "1");
     }
 
-    (*level)--;
+    fclose(out);
+    return text;
+}
+
+int number_block(Compiler *c, KaNode *nodes, int write);
+
+// Statements of a numeric loop: = on a local, and while and if on numbers
+
+int number_stmt(Compiler *c, KaNode *nodes, int write)
+{
+    KaFunc func = builtin(nodes, NULL);
+    KaNode *first = nodes->next, *second = first ? first->next : NULL;
+    char var[48], *text;
+    size_t size;
+    int count = 0;
+
+    if (!nodes->next && nodes->type == KA_EXPR) {
+        return number_stmt(c, nodes->children, write);
+    } else if (!first) {
+        return 0;
+    } else if (func == ka_set && first->type == KA_SYMBOL && second &&
+               !second->next) {
+        CompilerName *n = lookup(c, first->symbol);
+
+        if (!n->local || number_expr(c, second, NULL) != NUMBER_VALUE) {
+            return 0;
+        }
+
+        n->unboxed = n->stored = 1;
+
+        if (write) {
+            FILE *out = open_memstream(&text, &size);
+            number_expr(c, second, out);
+            fclose(out);
+            local_name(n, var, 'u');
+            emit(c, "%s = %s;", var, text);
+            free(text);
+        }
+
+        return 1;
+    } else if (func == ka_while) {
+        if (!second || second->next || second->type != KA_BLOCK ||
+            (first->type != KA_EXPR && first->type != KA_BLOCK) ||
+            !number_list(c, first->children, NULL) ||
+            !number_block(c, second->children, 0)) {
+            return 0;
+        }
+
+        if (write) {
+            text = number_test(c, first->children, 1);
+            emit(c, "while (%s) {", text);
+            free(text);
+            c->indent++;
+            number_block(c, second->children, 1);
+            c->indent--;
+            emit(c, "}");
+        }
+
+        return 1;
+    } else if (func != ka_if || !second) {
+        return 0;
+    }
+
+    for (KaNode *curr = first; curr; curr = curr->next) {
+        int block = ++count % 2 == 0 || !curr->next;
+
+        if (block ? curr->type != KA_BLOCK ||
+                    !number_block(c, curr->children, 0)
+                  : !number_expr(c, curr, NULL)) {
+            return 0;
+        }
+    }
+
+    for (KaNode *curr = first; write && curr; curr = curr->next->next) {
+        if (!curr->next) {
+            emit(c, "} else {");
+        } else {
+            text = number_test(c, curr, 0);
+            emit(c, curr == first ? "if (%s) {" : "} else if (%s) {", text);
+            free(text);
+        }
+
+        c->indent++;
+        number_block(c, curr->next ? curr->next->children : curr->children,
+                     1);
+        c->indent--;
+
+        if (!curr->next || !curr->next->next) {
+            emit(c, "}");
+            break;
+        }
+    }
+
+    return 1;
+}
+
+int number_block(Compiler *c, KaNode *nodes, int write)
+{
+    for (KaNode *curr = nodes; curr; curr = curr->next) {
+        if (curr->type != KA_EXPR || !number_stmt(c, curr->children, write)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// The unboxed version of a while loop, if it has one, run when its locals
+// hold numbers. The boxed loop that follows goes in the else branch.
+
+int number_loop(Compiler *c, KaNode *nodes, const char *dest)
+{
+    char var[48];
+    int first = 1;
+
+    if (c->pass != 2) return 0;
+
+    for (size_t i = 0; i < c->count; i++) {
+        c->names[i].unboxed = c->names[i].stored = 0;
+    }
+
+    if (!number_stmt(c, nodes, 0)) return 0;
+
+    for (size_t i = 0; i < c->count; i++) {
+        if (!c->names[i].unboxed) continue;
+
+        local_name(&c->names[i], var, 'v');
+        emit(c, first ? "if (%s && %s->type == KA_NUMBER" :
+                        "    && %s && %s->type == KA_NUMBER", var, var);
+        first = 0;
+    }
+
+    emit(c, first ? "if (1) {" : ") {");
+    c->indent++;
+
+    for (size_t i = 0; i < c->count; i++) {
+        if (!c->names[i].unboxed) continue;
+
+        local_name(&c->names[i], var, 'u');
+        fprintf(c->out, "%*slong double %s = ", c->indent * 4, "", var);
+        local_name(&c->names[i], var, 'v');
+        fprintf(c->out, "*%s->number;\n", var);
+    }
+
+    number_stmt(c, nodes, 1);
+
+    for (size_t i = 0; i < c->count; i++) {
+        if (!c->names[i].stored) continue;
+
+        local_name(&c->names[i], var, 'v');
+        fprintf(c->out, "%*s*%s->number = ", c->indent * 4, "", var);
+        local_name(&c->names[i], var, 'u');
+        fprintf(c->out, "%s;\n", var);
+    }
+
+    emit(c, "%s = ka_new(KA_NONE);", dest);
+    c->indent--;
+    emit(c, "} else {");
+    c->indent++;
+    return 1;
+}
+
+// while (cond) {block}, evaluating both in place on each turn
+
+int compile_while(Compiler *c, KaNode *nodes, const char *dest,
+                  const char *ctx)
+{
+    KaNode *cond = nodes->next, *body = cond ? cond->next : NULL;
+    char buf[32];
+
+    if (builtin(nodes, NULL) != ka_while || !body || body->next ||
+        body->type != KA_BLOCK ||
+        (cond->type != KA_EXPR && cond->type != KA_BLOCK)) {
+        return 0;
+    }
+
+    int id = c->temps++, unboxed = number_loop(c, nodes, dest);
+
+    c->loop++;
+    emit(c, "for (;;) {");
+    c->indent++;
+    emit(c, "KaNode *c%d, *b%d;", id, id);
+    snprintf(buf, sizeof(buf), "c%d", id);
+    compile_eval(c, cond->children, buf, ctx);
+    emit(c, "if (c%d->type < KA_TRUE) {", id);
+    emit(c, "    ka_free(c%d);", id);
+    emit(c, "    break;");
+    emit(c, "}");
+    emit(c, "ka_free(c%d);", id);
+    snprintf(buf, sizeof(buf), "b%d", id);
+    compile_eval(c, body->children, buf, ctx);
+    emit(c, "ka_free(b%d);", id);
+    emit(c, "ka_gc_poll(%s);", ctx);
+    c->indent--;
+    emit(c, "}");
+    emit(c, "%s = ka_new(KA_NONE);", dest);
+    c->loop--;
+
+    if (unboxed) {
+        c->indent--;
+        emit(c, "}");
+    }
+
+    return 1;
+}
+
+// if c1 {b1} c2 {b2} ... [else] {b}. Conditions are all evaluated first, as
+// they are arguments of if. One that returns ends them, and is what if gets
+// last.
+
+int compile_if(Compiler *c, KaNode *nodes, const char *dest, const char *ctx)
+{
+    const char *branch = "if";
+    char buf[32];
+    int count = 0, guard = 0;
+
+    if (builtin(nodes, NULL) != ka_if || !nodes->next ||
+        !nodes->next->next) {
+        return 0;
+    }
+
+    for (KaNode *curr = nodes->next; curr; curr = curr->next) {
+        int block = ++count % 2 == 0 || !curr->next;
+
+        if ((block && curr->type != KA_BLOCK) || (!block && skips(curr))) {
+            return 0;
+        }
+    }
+
+    int id = open_temps(c, nodes, count + 1), size = count + 1;
+
+    count = 0;
+
+    for (KaNode *curr = nodes->next; curr && curr->next;
+         curr = curr->next->next) {
+        count += 2;
+        snprintf(buf, sizeof(buf), "t%d[%d]", id, count - 1);
+
+        if (guard) emit(c, "if (!r%d) {", id), c->indent++;
+
+        compile_node(c, curr, buf, ctx, 0, 0);
+
+        if (curr->type == KA_EXPR) {
+            emit(c, "r%d = ka_returned(%s);", id, buf);
+        }
+
+        if (guard) c->indent--, emit(c, "}");
+        guard |= curr->type == KA_EXPR;
+    }
+
+    count = 0;
+
+    for (KaNode *curr = nodes->next; curr; curr = curr->next->next) {
+        count += 2;
+
+        if (!curr->next) {
+            emit(c, "} else {");
+            c->indent++;
+            compile_eval(c, curr->children, dest, ctx);
+            c->indent--;
+            emit(c, "}");
+            break;
+        }
+
+        if (curr->type == KA_EXPR) {
+            emit(c, "%s (r%d && ka_returned(t%d[%d])) {", branch, id, id,
+                 count - 1);
+
+            if (count == 2) {
+                emit(c, "    %s = ka_new(KA_NONE);", dest);
+            } else {
+                emit(c, "    %s = ka_eval(&%s, t%d[%d]);", dest, ctx, id,
+                     count - 1);
+            }
+
+            branch = "} else if";
+        }
+
+        emit(c, "%s (t%d[%d]->type > KA_FALSE) {", branch, id, count - 1);
+        c->indent++;
+        compile_eval(c, curr->next->children, dest, ctx);
+        c->indent--;
+        branch = "} else if";
+
+        if (!curr->next->next) {
+            emit(c, "} else {");
+            emit(c, "    %s = ka_new(KA_NONE);", dest);
+            emit(c, "}");
+            break;
+        }
+    }
+
+    emit(c, "ka_free(ka_args(t%d, %d));", id, size);
+    close_temps(c, size);
+    return 1;
+}
+// for list {block}, running the block in a context of its own for each
+// element and collecting what it gives back
+
+int compile_for(Compiler *c, KaNode *nodes, const char *dest, const char *ctx)
+{
+    KaNode *list = nodes->next, *body = list ? list->next : NULL;
+    char buf[32], scope[32];
+
+    if (builtin(nodes, NULL) != ka_for || !body || body->next ||
+        body->type != KA_BLOCK || skips(list)) {
+        return 0;
+    }
+
+    int id = open_temps(c, nodes, 2);
+
+    snprintf(buf, sizeof(buf), "t%d[0]", id);
+    compile_node(c, list, buf, ctx, 0, 0);
+
+    if (list->type == KA_EXPR) {
+        emit(c, "if (ka_returned(t%d[0])) {", id);
+        emit(c, "    %s = ka_new(KA_NONE);", dest);
+        emit(c, "} else {");
+        c->indent++;
+    }
+
+    emit(c, "t%d[1] = ka_new(KA_LIST);", id);
+    emit(c, "KaNode **l%d = &t%d[1]->children;", id, id);
+    emit(c, "KaNode *e%d = t%d[0]->type >= KA_LIST ? t%d[0]->children : NULL;",
+         id, id, id);
+    emit(c, "for (; e%d; e%d = e%d->next) {", id, id, id);
+    c->indent++;
+    emit(c, "KaNode *s%d = ka_chain(ka_copy(e%d), ka_new(KA_CTX), %s, NULL);",
+         id, id, ctx);
+    emit(c, "KaNode *b%d;", id);
+    emit(c, "KA_ROOT(&s%d);", id);
+    snprintf(buf, sizeof(buf), "b%d", id);
+    snprintf(scope, sizeof(scope), "s%d", id);
+    c->scope++;
+    c->loop++;
+    compile_eval(c, body->children, buf, scope);
+    c->scope--;
+    c->loop--;
+    emit(c, "KA_UNROOT(1);");
+    emit(c, "b%d->key = e%d->key;", id, id);
+    emit(c, "if (b%d->type) {", id);
+    emit(c, "    *l%d = ka_copy(b%d);", id, id);
+    emit(c, "    l%d = &(*l%d)->next;", id, id);
+    emit(c, "}");
+    emit(c, "ka_free(b%d);", id);
+    emit(c, "ka_free(s%d);", id);
+    c->indent--;
+    emit(c, "}");
+    emit(c, "%s = t%d[1];", dest, id);
+    emit(c, "t%d[1] = NULL;", id);
+
+    if (list->type == KA_EXPR) {
+        c->indent--;
+        emit(c, "}");
+    }
+
+    emit(c, "ka_free(t%d[0]);", id);
+    close_temps(c, 2);
+    return 1;
+}
+
+// A list of nodes, as ka_eval takes it. A builtin at its head is called
+// directly, anything else is applied once known.
+
+void compile_eval(Compiler *c, KaNode *nodes, const char *dest,
+                  const char *ctx)
+{
+    const char *name = NULL;
+    int count = 0;
+
+    if (!nodes) {
+        emit(c, "%s = ka_new(KA_NONE);", dest);
+        return;
+    }
+
+    for (KaNode *curr = nodes; curr; curr = curr->next) {
+        count++;
+    }
+
+    if (compile_assign(c, nodes, dest, ctx, count) ||
+        compile_while(c, nodes, dest, ctx) ||
+        compile_if(c, nodes, dest, ctx) ||
+        compile_for(c, nodes, dest, ctx)) {
+        return;
+    }
+
+    KaFunc func = builtin(nodes, &name);
+    int id = open_temps(c, nodes, count);
+
+    compile_elements(c, nodes, id, func ? 1 : 0, ctx);
+
+    if (func) {
+        emit(c, "t%d[0] = ka_args(t%d + 1, %d);", id, id, count - 1);
+        emit(c, "%s = %s(&%s, t%d[0]);", dest, name, ctx, id);
+    } else {
+        emit(c, "t%d[0] = ka_args(t%d, %d);", id, id, count);
+        emit(c, "%s = ka_apply(&%s, t%d[0]);", dest, ctx, id);
+    }
+
+    close_temps(c, count);
+}
+
+// Variables that can live in locals: defined by the top scope at most once
+// and not in a loop, never set before that, and never reached by name
+// otherwise
+
+int choose_locals(Compiler *c)
+{
+    int count = 0;
+
+    for (KaNode *str = c->strings; str; str = str->next) {
+        lookup(c, str->string)->escaped = 1;
+    }
+
+    for (size_t i = 0; i < c->count && !c->computed; i++) {
+        CompilerName *n = &c->names[i];
+
+        if (n->escaped || reserved(n->name) || (!n->defs && !n->set_seq) ||
+            n->defs > 1 || n->def_loop ||
+            (n->defs && n->set_seq && n->set_seq < n->def_seq)) {
+            continue;
+        }
+
+        n->local = ++count;
+    }
+
+    return count;
 }
 
 void transpile(KaNode **ctx, char *path)
 {
-    int pos = 0, level = 1;
+    size_t pos = 0, body_size, init_size;
+    char *body, *init, var[48];
     KaNode *source = ka_read(ctx, ka_string(path));
-    KaNode *nodes = ka_parser(source->string, &pos);
+    Compiler c = { 0 };
+    int locals = 0;
+
+    if (source->type != KA_STRING) {
+        fprintf(stderr, "Can't read %s\n", path);
+        ka_free(source);
+        return;
+    }
+
+    KaNode *nodes = ka_parse(source->string, source->length, &pos);
+    KaNode *program = ka_new(KA_BLOCK);
+    program->children = nodes;
+    prescan(&c, nodes);
+
+    // The first pass finds out which variables can be locals
+    for (c.pass = 1; c.pass <= 2; c.pass++) {
+        c.out = open_memstream(&body, &body_size);
+        c.init = open_memstream(&init, &init_size);
+        c.indent = 1;
+        c.temps = c.consts = c.seq = 0;
+
+        if (c.dynamic) {
+            emit(&c, "result = ka_eval(&ctx, k[%d]->children);",
+                 constant(&c, program, 0));
+        } else {
+            compile_eval(&c, nodes, "result", "ctx");
+        }
+
+        fclose(c.out);
+        fclose(c.init);
+
+        if (c.pass == 1) {
+            locals = choose_locals(&c);
+            free(body);
+            free(init);
+        }
+    }
 
     printf("#include \"kamby.h\"\n\n");
-    printf("int main() {\n");
-    printf("    KaNode *nodes = ka_expr(\n");
 
-    transpile_tree(nodes, &level);
+    if (c.consts) {
+        printf("static KaNode *k[%d];\n\n", c.consts);
+        printf("static void constants()\n{\n%s}\n\n", init);
+    }
+
+    printf("int main()\n{\n");
+    printf("    KaNode *ctx = ka_init(), *result = NULL;\n");
+
+    for (size_t i = 0; i < c.count; i++) {
+        if (!c.names[i].local) continue;
+
+        char *text = quote(c.names[i].name, strlen(c.names[i].name));
+        local_name(&c.names[i], var, 'v');
+        printf("    KaNode *%s = NULL;\n", var);
+        local_name(&c.names[i], var, 'n');
+        printf("    char *%s = ka_intern(%s);\n", var, text);
+        free(text);
+    }
+
+    for (size_t i = 0; i < c.count; i++) {
+        if (!c.names[i].local) continue;
+
+        local_name(&c.names[i], var, 'v');
+        printf("    KA_ROOT(&%s);\n", var);
+    }
+
+    if (c.consts) printf("    constants();\n");
+
+    printf("\n%s\n", body);
+    printf("    KA_UNROOT(%d);\n", locals + c.consts);
+    printf("    ka_free(result);\n");
+
+    for (size_t i = 0; i < c.count; i++) {
+        if (!c.names[i].local) continue;
+
+        local_name(&c.names[i], var, 'v');
+        printf("    ka_free(%s);\n", var);
+    }
+
+    if (c.consts) {
+        printf("    for (int i = 0; i < %d; i++) ka_free(k[i]);\n", c.consts);
+    }
 
-    printf("    NULL);\n\n");
-    printf("    KaNode *ctx = ka_init();\n");
-    printf("    ka_free(ka_eval(&ctx, nodes));\n");
-    printf("    ka_free(nodes), ka_free(ctx);\n");
+    printf("    ka_free(ctx);\n");
+    printf("    ka_module_clear();\n");
     printf("    return 0;\n");
     printf("}\n");
 
+    free(body);
+    free(init);
+    free(c.names);
+    ka_free(c.strings);
+    ka_free(program);
+    ka_free(source);
+}
+
+void precompile(KaNode **ctx, char *path)
+{
+    size_t pos = 0;
+    KaNode *source = ka_read(ctx, ka_string(path));
+    KaNode *output = ka_string(path);
+
+    if (source->type != KA_STRING) {
+        fprintf(stderr, "Can't read %s\n", path);
+        ka_free(output), ka_free(source);
+        return;
+    }
+
+    // script.ka is cached as script.kac, which load picks up by itself
+    if (output->length >= 3 &&
+        !strcmp(output->string + output->length - 3, ".ka")) {
+        ka_append(output, "c", 1);
+    } else {
+        ka_append(output, ".kac", 4);
+    }
+
+    KaNode *nodes = ka_parse(source->string, source->length, &pos);
+
+    if (!ka_cache_save(output->string, nodes, source->string,
+                       source->length)) {
+        fprintf(stderr, "Can't write %s\n", output->string);
+    }
+
     ka_free(nodes);
+    ka_free(output);
     ka_free(source);
 }
 
 void repl(KaNode **ctx)
 {
-    int pos = 0;
-    char buf[1 << 20] = ""; // 1MB
+    KaStream stream = { 0 };
+    char chunk[4096];
+    int tty = isatty(fileno(stdin));
+    size_t got;
 
-    if (isatty(fileno(stdin))) {
+    if (tty) {
         printf("Kamby %s\n> ", VER);
         fflush(stdout);
     }
 
-    while (fgets(buf + strlen(buf), sizeof(buf), stdin)) {
-        int level = 0;
-
-        for (int i = 0; i < strlen(buf) && buf[i] != '\0'; i++) {
-            if (strchr("([{", buf[i])) {
-                level += 1;
-            } else if (strchr("}])", buf[i])) {
-                level -= 1; 
-            }
+    do {
+        // A terminal is read by lines, so statements run once entered
+        if (tty) {
+            got = fgets(chunk, sizeof(chunk), stdin) ? strlen(chunk) : 0;
+        } else {
+            got = fread(chunk, 1, sizeof(chunk), stdin);
         }
 
-        if (level > 0 && isatty(fileno(stdin)))
-            printf("... %*s", level * 2 - 2, "");
+        ka_stream_feed(&stream, chunk, got);
 
-        if (level > 0) continue;
-
-        KaNode *expr = ka_parser(buf, (pos = 0, &pos));
-        ka_free(ka_eval(ctx, expr));
-        ka_free(expr);
-        buf[0] = '\0';
+        for (KaNode *expr; (expr = ka_stream_next(&stream, !got));) {
+            ka_free(ka_eval(ctx, expr));
+            ka_free(expr);
+            ka_gc_poll(*ctx);
+        }
 
-        if (isatty(fileno(stdin))) {
+        if (tty && got && stream.depth > 0) {
+            printf("... %*s", stream.depth * 2 - 2, "");
+            fflush(stdout);
+        } else if (tty && got) {
             printf("> ");
             fflush(stdout);
         }
-    }
+    } while (got);
+
+    ka_stream_free(&stream);
 }
 
 int main(int argc, char *argv[])
@@ -113,11 +1138,14 @@ int main(int argc, char *argv[])
         printf("Options:\n");
         printf("  --help          Display this help message\n");
         printf("  --version       Display version information\n");
-        printf("  -c              Transpile a file to C\n");
+        printf("  -c              Compile a file to C\n");
+        printf("  -b              Precompile a file to a .kac image\n");
     } else if (argc > 1 && !strcmp(argv[1], "--version")) {
         printf("Kamby %s\n", VER);
     } else if (argc > 2 && !strcmp(argv[1], "-c")) {
         transpile(&ctx, argv[2]);
+    } else if (argc > 2 && !strcmp(argv[1], "-b")) {
+        precompile(&ctx, argv[2]);
     } else if (argc > 1) {
         ka_free(ka_load(&ctx, ka_string(argv[1])));
     } else {
@@ -125,5 +1153,6 @@ int main(int argc, char *argv[])
     }
 
     ka_free(ctx);
+    ka_module_clear();
     return 0;
 }
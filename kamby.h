@@ -3,18 +3,63 @@
 
 #include <ctype.h>
 #include <dlfcn.h>
+#include <float.h>
+#include <limits.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// The JIT emits x86-64 code, elsewhere KA_JIT is ignored
+#if defined(KA_JIT) && !defined(__x86_64__)
+#undef KA_JIT
+#endif
 
 typedef enum {
     KA_NONE, KA_CTX, KA_FALSE, KA_TRUE, KA_NUMBER, KA_STRING, KA_SYMBOL,
     KA_FUNC, KA_LIST, KA_EXPR, KA_BLOCK
 } KaType;
 
+// Payload flags. An inline payload lives in the same allocation as its node,
+// right after the node header, and is released together with it.
+// Strings and symbols carry their byte length, so they may hold NUL bytes and
+// are NUL terminated for the C library, except views. A view points into the
+// buffer of another string and keeps a reference to it in its inline slot.
+
+#define KA_INLINE 0x01
+#define KA_VIEW   0x02
+
+// Context flags. Nodes kept by a checkpoint are not freed when deleted, and
+// are marked dirty when their payload changes in place, so a rollback knows
+// which ones to restore.
+
+#define KA_KEEP   0x04
+#define KA_DIRTY  0x08
+
+// Nodes of a mapped image live in the mapping and are never freed
+
+#define KA_STATIC 0x10
+
+// With the collector, lists, expressions and blocks read from a variable share
+// its children. They get their own copy before they are stored or relinked.
+
+#define KA_SHARED 0x20
+#define KA_MARK   0x80
+
 typedef struct KaNode {
-    KaType type;
+    unsigned char type;
+    unsigned char flags;
+    unsigned int length;
     char *key;
     union {
         long double *number;
@@ -25,21 +70,218 @@ typedef struct KaNode {
         void *value;
     };
     struct KaNode *next;
+#ifdef KA_GC
+    struct KaNode *heap;
+#endif
 } KaNode;
 
+typedef KaNode *(*KaFunc)(KaNode **ctx, KaNode *args);
+
+// Strings that are not inline live in a reference counted buffer placed right
+// before their bytes. Copies share the buffer, and a string that owns its
+// buffer alone can grow in place, which makes appending amortized O(1).
+
+typedef struct KaBuf {
+    size_t refs;
+    size_t cap;
+    char data[];
+} KaBuf;
+
+#define KA_BUF(str) ((KaBuf *)((char *)(str) - offsetof(KaBuf, data)))
+#define KA_OWNER(node) (*(char **)KA_PAYLOAD(node))
+#define KA_MAX_LENGTH UINT_MAX
+
+// Buffers of mapped files have this bit set in cap, next to the size of the
+// mapping, which starts one page before their bytes. The bytes are read only.
+#define KA_BUF_MAPPED ((size_t)1 << (sizeof(size_t) * 8 - 1))
+
+// Garbage collected heap. Build with -DKA_GC to track every node in a heap
+// list and reclaim unreachable ones with ka_gc() instead of freeing eagerly.
+// Roots are the context chain given to ka_gc() plus the variables registered
+// with KA_ROOT() by the evaluator and by builtins that call it.
+
+#ifdef KA_GC
+static KaNode *ka_heap = NULL;
+static size_t ka_heap_count = 0;
+static size_t ka_heap_limit = 1 << 16;
+static KaNode ***ka_roots = NULL;
+static size_t ka_roots_count = 0;
+static size_t ka_roots_cap = 0;
+
+#define KA_ROOT(var) ka_root(var)
+#define KA_UNROOT(n) (ka_roots_count -= (n))
+#else
+#define KA_ROOT(var) ((void)0)
+#define KA_UNROOT(n) ((void)0)
+#endif
+
+// Interned keys. The table is global, shared by every context in the process
+// and not thread-safe, so contexts used from several threads need a lock
+// around the interpreter. Any node may point to a key, so keys are never
+// freed, and the table stops taking new ones at KA_MAX_KEYS.
+
+#define KA_MAX_KEYS (1 << 20)
+
+static char **ka_keys = NULL;
+static size_t ka_keys_cap = 0;
+static size_t ka_keys_count = 0;
+
+// Modules loaded so far, found by device and inode and checked against the
+// size and modification time of their file on each load. Their parsed trees
+// live here for reuse, so the collector treats them as roots. A module keeps
+// the image its tree is mapped from, or the library it opened, until it is
+// freed.
+
+typedef struct KaModule {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    KaNode *tree;
+    struct KaImage *image;
+    void *lib;
+    int stale;
+    size_t running;
+    void (*extend)(KaNode **ctx);
+    struct KaModule *next;
+} KaModule;
+
+static KaModule *ka_module_list = NULL;
+static size_t ka_module_hits = 0;
+static size_t ka_module_misses = 0;
+
+// Native functions registered by extensions, so images can save them. The
+// library whose ka_extend is running owns the natives it registers.
+
+typedef struct KaNative {
+    const char *name;
+    KaFunc func;
+    void *lib;
+} KaNative;
+
+static KaNative *ka_natives = NULL;
+static size_t ka_natives_count = 0;
+static void *ka_module_lib = NULL;
+
+// Checkpoints taken on contexts, with the nodes they keep and copies of
+// their payloads at the time
+
+typedef struct KaCheckpoint {
+    KaNode **nodes;
+    KaNode **saved;
+    size_t count;
+    struct KaCheckpoint *next;
+} KaCheckpoint;
+
+static KaCheckpoint *ka_checkpoints = NULL;
+
+// Nodes of mapped images. They are outside the heap, so the collector
+// clears their marks itself. A retired image is unmapped once no string
+// refers to its bytes anymore.
+
+typedef struct KaImage {
+    KaNode *nodes;
+    size_t count;
+    char *base;
+    size_t size;
+    int retired;
+    struct KaImage *next;
+} KaImage;
+
+static KaImage *ka_images = NULL;
+
 // Function prototypes that will be defined later
 
 static inline KaNode *ka_eval(KaNode **ctx, KaNode *nodes);
 
+#ifdef KA_JIT
+#define KA_JIT_THRESHOLD 64
+static inline int ka_jit_while(KaNode **ctx, KaNode *cond, KaNode *block);
+#endif
+static inline const char *ka_native_name(KaNode *node);
+static inline int ka_native(KaNode *node, const char *name);
+static inline void ka_cache_sweep(void);
+
+// Keys are interned. Every key points into a table shared by all nodes, so
+// keyed nodes never allocate nor free their own copy of the key. Returns NULL
+// for a new key once the table is full.
+
+static inline size_t ka_hash(const char *str)
+{
+    size_t hash = 5381;
+
+    for (const char *c = str; *c; c++) {
+        hash = hash * 33 ^ (unsigned char)*c;
+    }
+
+    return hash;
+}
+
+static inline char *ka_intern(const char *key)
+{
+    if (!key) return NULL;
+
+    size_t hash = ka_hash(key), mask = ka_keys_cap - 1;
+
+    for (size_t i = hash & mask; ka_keys_cap && ka_keys[i];
+         i = (i + 1) & mask) {
+        if (ka_keys[i] == key || !strcmp(ka_keys[i], key)) return ka_keys[i];
+    }
+
+    if (ka_keys_count >= KA_MAX_KEYS) return NULL;
+
+    if (ka_keys_count * 2 >= ka_keys_cap) {
+        size_t old_cap = ka_keys_cap;
+        char **old_keys = ka_keys;
+
+        ka_keys_cap = ka_keys_cap ? ka_keys_cap * 2 : 256;
+        ka_keys = (char **)calloc(ka_keys_cap, sizeof(char *));
+        mask = ka_keys_cap - 1;
+
+        for (size_t i = 0; i < old_cap; i++) {
+            if (!old_keys[i]) continue;
+
+            size_t j = ka_hash(old_keys[i]) & mask;
+            while (ka_keys[j]) j = (j + 1) & mask;
+            ka_keys[j] = old_keys[i];
+        }
+
+        free(old_keys);
+    }
+
+    size_t i = hash & mask;
+    while (ka_keys[i]) i = (i + 1) & mask;
+
+    ka_keys_count++;
+    return ka_keys[i] = strdup(key);
+}
+
 // Constructors
 
-static inline KaNode *ka_new(KaType type)
+#define KA_HEADER ((sizeof(KaNode) + 15) & ~(size_t)15)
+#define KA_PAYLOAD(node) ((void *)((char *)(node) + KA_HEADER))
+
+static inline KaNode *ka_alloc(KaType type, size_t payload)
 {
-    KaNode *node = (KaNode *)calloc(1, sizeof(KaNode));
+    KaNode *node = (KaNode *)calloc(1, payload ? KA_HEADER + payload
+                                               : sizeof(KaNode));
     node->type = type;
+
+#ifdef KA_GC
+    node->heap = ka_heap;
+    ka_heap = node;
+    ka_heap_count++;
+#endif
+
     return node;
 }
 
+static inline KaNode *ka_new(KaType type)
+{
+    return ka_alloc(type, 0);
+}
+
 static inline KaNode *ka_true()
 {
     return ka_new(KA_TRUE);
@@ -50,24 +292,279 @@ static inline KaNode *ka_false()
     return ka_new(KA_FALSE);
 }
 
+// String buffers
+
+static inline char *ka_buf_new(size_t cap)
+{
+    KaBuf *buf = (KaBuf *)malloc(sizeof(KaBuf) + cap);
+    buf->refs = 1;
+    buf->cap = cap;
+    return buf->data;
+}
+
+// Make room for at least cap bytes. Only valid for unshared buffers.
+
+static inline char *ka_buf_grow(char *data, size_t cap)
+{
+    KaBuf *buf = KA_BUF(data);
+
+    if (buf->cap >= cap) return data;
+
+    cap = cap > buf->cap * 2 ? cap : buf->cap * 2;
+    buf = (KaBuf *)realloc(buf, sizeof(KaBuf) + cap);
+    buf->cap = cap;
+    return buf->data;
+}
+
+// Live file mappings, kept at the start of their header page so a file can
+// be found by device and inode before it is rewritten
+
+typedef struct KaMap {
+    struct KaMap *next;
+    dev_t dev;
+    ino_t ino;
+    size_t length;
+} KaMap;
+
+static KaMap *ka_maps = NULL;
+
+// Map the bytes of a file, NUL terminated, after a page of their own for the
+// buffer header. Returns NULL if the file can not be mapped.
+
+static inline char *ka_buf_map(int fd, const struct stat *st)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE), length = st->st_size;
+    size_t size = page + length + 1;
+    char *base = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (base == MAP_FAILED) return NULL;
+
+    // The rest of the last page of the file, or the page after it, is zero
+    if (mmap(base + page, length, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd,
+             0) == MAP_FAILED) {
+        munmap(base, size);
+        return NULL;
+    }
+
+    KaMap *map = (KaMap *)base;
+    map->next = ka_maps;
+    map->dev = st->st_dev;
+    map->ino = st->st_ino;
+    map->length = length;
+    ka_maps = map;
+
+    KaBuf *buf = KA_BUF(base + page);
+    buf->refs = 1;
+    buf->cap = size | KA_BUF_MAPPED;
+    return buf->data;
+}
+
+// Move the bytes of every live mapping of a file into anonymous memory at
+// the same address, so strings read from it survive it being truncated
+
+static inline void ka_buf_unmap(const char *path)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    struct stat st;
+
+    if (!ka_maps || stat(path, &st)) return;
+
+    for (KaMap **at = &ka_maps; *at;) {
+        KaMap *map = *at;
+
+        if (map->dev != st.st_dev || map->ino != st.st_ino) {
+            at = &map->next;
+            continue;
+        }
+
+        char *data = (char *)map + page;
+        char *copy = (char *)malloc(map->length);
+        memcpy(copy, data, map->length);
+
+        if (mmap(data, map->length, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1,
+                 0) != MAP_FAILED) {
+            memcpy(data, copy, map->length);
+        }
+
+        free(copy);
+        *at = map->next;
+    }
+}
+
+static inline void ka_buf_release(char *data)
+{
+    if (!data || --KA_BUF(data)->refs) return;
+
+    size_t cap = KA_BUF(data)->cap;
+
+    if (cap & KA_BUF_MAPPED) {
+        char *base = data - sysconf(_SC_PAGESIZE);
+
+        for (KaMap **at = &ka_maps; *at; at = &(*at)->next) {
+            if (*at == (KaMap *)base) {
+                *at = (*at)->next;
+                break;
+            }
+        }
+
+        munmap(base, cap & ~KA_BUF_MAPPED);
+    } else {
+        free(KA_BUF(data));
+    }
+}
+
+// Whether the bytes of a string are those of a mapped file
+
+static inline int ka_buf_mapped(KaNode *node)
+{
+    char *data = (node->flags & KA_VIEW) ? KA_OWNER(node) : node->string;
+
+    return (node->type == KA_STRING || node->type == KA_SYMBOL) && data &&
+           !(node->flags & KA_INLINE) && (KA_BUF(data)->cap & KA_BUF_MAPPED);
+}
+
+// Release the payload owned by a single node. Children are not touched.
+
+static inline void ka_release(KaNode *node)
+{
+    if (node->flags & KA_VIEW) {
+        ka_buf_release(KA_OWNER(node));
+        return;
+    }
+
+    if (node->type >= KA_LIST || node->type == KA_FUNC ||
+        (node->flags & KA_INLINE)) {
+        return;
+    }
+
+    if (node->type == KA_STRING || node->type == KA_SYMBOL) {
+        ka_buf_release(node->string);
+    } else {
+        free(node->value);
+    }
+}
+
 static inline void ka_free(KaNode *node)
 {
+#ifndef KA_GC
     for (KaNode *curr; node; node = curr) {
         KaType type = node->type;
         int has_key = node->key ? 1 : 0;
 
         if (type >= KA_LIST) {
             ka_free((KaNode *)node->value);
-        } else if (type != KA_FUNC) {
-            free(node->value);
+        } else {
+            ka_release(node);
         }
 
         curr = node->next;
-        free(node->key);
-        free(node);
+        if (!(node->flags & KA_STATIC)) free(node);
 
         if (type == KA_CTX && !has_key) break;
     }
+#endif
+}
+
+// Garbage collection
+
+#ifdef KA_GC
+static inline void ka_root(KaNode **var)
+{
+    if (ka_roots_count == ka_roots_cap) {
+        ka_roots_cap = ka_roots_cap ? ka_roots_cap * 2 : 256;
+        ka_roots = (KaNode ***)realloc(ka_roots,
+            ka_roots_cap * sizeof(KaNode **));
+    }
+
+    ka_roots[ka_roots_count++] = var;
+}
+
+static inline void ka_mark(KaNode *node)
+{
+    for (; node && !(node->flags & KA_MARK); node = node->next) {
+        node->flags |= KA_MARK;
+
+        if (node->type >= KA_LIST) {
+            ka_mark(node->children);
+        }
+    }
+}
+#endif
+
+static inline size_t ka_gc(KaNode *root)
+{
+    size_t freed = 0;
+
+#ifdef KA_GC
+    ka_mark(root);
+
+    for (size_t i = 0; i < ka_roots_count; i++) {
+        ka_mark(*ka_roots[i]);
+    }
+
+    for (KaModule *module = ka_module_list; module; module = module->next) {
+        ka_mark(module->tree);
+    }
+
+    for (KaCheckpoint *cp = ka_checkpoints; cp; cp = cp->next) {
+        for (size_t i = 0; i < cp->count; i++) {
+            ka_mark(cp->nodes[i]);
+            ka_mark(cp->saved[i]);
+        }
+    }
+
+    for (KaNode **link = &ka_heap; *link;) {
+        KaNode *node = *link;
+
+        if (node->flags & KA_MARK) {
+            node->flags &= ~KA_MARK;
+            link = &node->heap;
+        } else {
+            *link = node->heap;
+            ka_release(node);
+            free(node);
+            freed++;
+        }
+    }
+
+    // Mapped nodes are not in the heap. Clear the marks of reachable ones
+    // and release what unreachable ones were assigned since they were mapped.
+    for (KaImage *image = ka_images; image; image = image->next) {
+        for (size_t i = 0; i < image->count && !image->retired; i++) {
+            KaNode *node = &image->nodes[i];
+
+            if (node->flags & KA_MARK) {
+                node->flags &= ~KA_MARK;
+            } else if (node->type != KA_NONE) {
+                if (node->type < KA_LIST) ka_release(node);
+                node->type = KA_NONE;
+                node->value = NULL;
+            }
+        }
+    }
+
+    ka_heap_count -= freed;
+    ka_heap_limit = ka_heap_count * 2 > (1 << 16)
+        ? ka_heap_count * 2
+        : (1 << 16);
+
+    ka_cache_sweep();
+#endif
+
+    return freed;
+}
+
+// Collect only when the heap has grown enough since the last collection
+
+static inline size_t ka_gc_poll(KaNode *root)
+{
+#ifdef KA_GC
+    if (ka_heap_count >= ka_heap_limit) return ka_gc(root);
+#endif
+
+    return 0;
 }
 
 static inline KaNode *ka_chain(KaNode *args, ...)
@@ -89,26 +586,98 @@ static inline KaNode *ka_chain(KaNode *args, ...)
 
 static inline KaNode *ka_number(long double value)
 {
-    KaNode *node = ka_new(KA_NUMBER);
-    node->number = (long double *)calloc(1, sizeof(long double));
+    KaNode *node = ka_alloc(KA_NUMBER, sizeof(long double));
+    node->flags = KA_INLINE;
+    node->number = (long double *)KA_PAYLOAD(node);
     *node->number = value;
     return node;
 }
 
-static inline KaNode *ka_string(char *value)
+// Allocate a string or symbol node with room for length bytes. Short ones are
+// stored inline, so most names and single characters take one allocation.
+
+#define KA_SHORT_STRING 16
+
+static inline KaNode *ka_stralloc(KaType type, size_t length)
+{
+    KaNode *node;
+
+    if (length < KA_SHORT_STRING) {
+        node = ka_alloc(type, length + 1);
+        node->flags = KA_INLINE;
+        node->string = (char *)KA_PAYLOAD(node);
+    } else {
+        node = ka_new(type);
+        node->string = ka_buf_new(length + 1);
+    }
+
+    node->length = length;
+    node->string[length] = '\0';
+    return node;
+}
+
+static inline KaNode *ka_stringn(const char *value, size_t length)
 {
-    KaNode *node = ka_new(KA_STRING);
-    node->string = strdup(value);
+    KaNode *node = ka_stralloc(KA_STRING, length);
+    memcpy(node->string, value, length);
     return node;
 }
 
-static inline KaNode *ka_symbol(char *symbol)
+static inline KaNode *ka_string(const char *value)
+{
+    return ka_stringn(value, strlen(value));
+}
+
+static inline KaNode *ka_symboln(const char *symbol, size_t length)
 {
-    KaNode *node = ka_new(KA_SYMBOL);
-    node->symbol = strdup(symbol);
+    KaNode *node = ka_stralloc(KA_SYMBOL, length);
+    memcpy(node->symbol, symbol, length);
     return node;
 }
 
+static inline KaNode *ka_symbol(const char *symbol)
+{
+    return ka_symboln(symbol, strlen(symbol));
+}
+
+// Substring of a string node. Long pieces of a heap string are views that
+// share its buffer, short ones are copied inline.
+
+static inline KaNode *ka_substr(KaNode *node, size_t offset, size_t length)
+{
+    if (!node->string) return ka_stringn("", 0);
+
+    if (length < KA_SHORT_STRING || (node->flags & KA_INLINE)) {
+        return ka_stringn(node->string + offset, length);
+    }
+
+    KaNode *view = ka_alloc(KA_STRING, sizeof(char *));
+    char *owner = (node->flags & KA_VIEW) ? KA_OWNER(node) : node->string;
+
+    KA_BUF(owner)->refs++;
+    KA_OWNER(view) = owner;
+    view->flags = KA_VIEW;
+    view->string = node->string + offset;
+    view->length = length;
+    return view;
+}
+
+// Give a view a NUL terminated buffer of its own, for use as a C string or
+// before changing its bytes.
+
+static inline void ka_own(KaNode *node)
+{
+    if (!node || !(node->flags & KA_VIEW)) return;
+
+    char *data = ka_buf_new(node->length + 1);
+    memcpy(data, node->string, node->length);
+    data[node->length] = '\0';
+
+    ka_release(node);
+    node->flags &= ~KA_VIEW;
+    node->string = data;
+}
+
 static inline KaNode *ka_func(KaNode *(*func)(KaNode **ctx, KaNode *args))
 {
     KaNode *node = ka_new(KA_FUNC);
@@ -120,10 +689,27 @@ static inline KaNode *ka_copy(KaNode *node)
 {
     if (!node) return ka_new(KA_NONE);
 
+    if (node->flags & KA_VIEW) {
+        KaNode *copy = ka_substr(node, 0, node->length);
+        copy->key = node->key;
+        return copy;
+    }
+
+    // Share string buffers instead of copying their bytes
+    if ((node->type == KA_STRING || node->type == KA_SYMBOL) &&
+        node->string && !(node->flags & KA_INLINE)) {
+        KaNode *copy = ka_new(node->type);
+        KA_BUF(node->string)->refs++;
+        copy->string = node->string;
+        copy->length = node->length;
+        copy->key = node->key;
+        return copy;
+    }
+
     KaNode *copy =
         (node->type == KA_NUMBER) ? ka_number(*node->number) :
-        (node->type == KA_STRING) ? ka_string(node->string) :
-        (node->type == KA_SYMBOL) ? ka_symbol(node->symbol) :
+        (node->type == KA_STRING) ? ka_stringn(node->string, node->length) :
+        (node->type == KA_SYMBOL) ? ka_symboln(node->symbol, node->length) :
         (node->type == KA_FUNC) ? ka_func(node->func) :
         ka_new(node->type);
 
@@ -136,11 +722,121 @@ static inline KaNode *ka_copy(KaNode *node)
         }
     }
 
-    if (node->key) {
-        copy->key = strdup(node->key);
+    copy->key = node->key;
+    return copy;
+}
+
+// Read a value. With the collector, lists, expressions and blocks share the
+// children of node instead of copying them.
+
+static inline KaNode *ka_share(KaNode *node)
+{
+#ifdef KA_GC
+    if (node && node->type >= KA_LIST) {
+        KaNode *share = ka_new(node->type);
+        share->children = node->children;
+        share->key = node->key;
+        share->flags = KA_SHARED;
+        return share;
+    }
+#endif
+
+    return ka_copy(node);
+}
+
+// Give a shared node children of its own
+
+static inline void ka_unshare(KaNode *node)
+{
+    if (!(node->flags & KA_SHARED)) return;
+
+    KaNode *copy = ka_copy(node);
+    node->children = copy->children;
+    node->flags &= ~KA_SHARED;
+    copy->children = NULL;
+    ka_free(copy);
+}
+
+// The value a store keeps. Arguments are freed by the caller, so it is a
+// copy, but with the collector the node is taken as it is, once nothing in it
+// is shared. Its next link is left untouched.
+
+static inline KaNode *ka_claim(KaNode *node)
+{
+#ifdef KA_GC
+    if (node && node->flags & KA_SHARED) {
+        ka_unshare(node);
+    } else if (node && node->type >= KA_LIST) {
+        for (KaNode *curr = node->children; curr; curr = curr->next) {
+            ka_claim(curr);
+        }
+    }
+
+    if (node) return node;
+#endif
+
+    return ka_copy(node);
+}
+
+// The last node of a chain, detached from it, the others are freed
+
+static inline KaNode *ka_last(KaNode *nodes)
+{
+    KaNode *prev = NULL, *last = nodes;
+
+    for (; last->next; prev = last, last = last->next);
+
+    if (prev) {
+        prev->next = NULL;
+        ka_free(nodes);
     }
 
-    return copy;
+    return last;
+}
+
+// Replace the payload of a node in place, keeping its key and position in the
+// chain. The data node is consumed. Inline payloads are moved out of it.
+
+static inline void ka_assign(KaNode *node, KaNode *data)
+{
+    ka_own(data);
+
+    int keep = node->flags & (KA_KEEP | KA_STATIC);
+
+    if (node->type == KA_NUMBER && data->type == KA_NUMBER &&
+        (node->flags & KA_INLINE)) {
+        *node->number = *data->number;
+        node->flags |= KA_DIRTY;
+        ka_free(data);
+        return;
+    }
+
+    if (node->type >= KA_LIST) {
+        ka_free((KaNode *)node->value);
+    } else {
+        ka_release(node);
+    }
+
+    node->type = data->type;
+    node->flags = (data->flags & ~(KA_INLINE | KA_KEEP | KA_DIRTY |
+                                   KA_STATIC)) | keep | KA_DIRTY;
+    node->length = data->length;
+    node->value = data->value;
+
+    if (data->flags & KA_INLINE && data->type == KA_NUMBER) {
+        node->number = (long double *)malloc(sizeof(long double));
+        *node->number = *data->number;
+    } else if (data->flags & KA_INLINE) {
+        node->string = ka_buf_new(data->length + 1);
+        memcpy(node->string, data->string, data->length + 1);
+    }
+
+    // The payload now belongs to node, leave an empty shell behind
+    data->type = KA_NONE;
+    data->flags = 0;
+    data->length = 0;
+    data->value = NULL;
+    ka_free(data);
 }
 
 static inline KaNode *ka_children(KaNode *node, va_list vargs, KaNode *args)
@@ -190,23 +886,180 @@ static inline KaNode *ka_block(KaNode *args, ...)
     return result;
 }
 
-// Variables
+// Number conversion. Numbers are formatted with ka_decimals decimal places,
+// or with the shortest text that reads back to the same value if negative.
+// A buffer of KA_NUMBER_SIZE holds the widest fixed output, the largest
+// long double written out in full with KA_MAX_DECIMALS decimals.
+
+#define KA_MAX_DECIMALS 30
+#define KA_NUMBER_SIZE (LDBL_MAX_10_EXP + KA_MAX_DECIMALS + 4)
+
+// Scaled decimals below KA_EXACT_SCALED keep 11 bits for the fraction that
+// decides the rounding
+
+#if LDBL_MANT_DIG >= 64
+#define KA_EXACT_DIGITS 19
+#define KA_EXACT_POW10 27
+#define KA_EXACT_SCALED 9007199254740992.0L
+#else
+#define KA_EXACT_DIGITS 15
+#define KA_EXACT_POW10 22
+#define KA_EXACT_SCALED 4398046511104.0L
+#endif
 
-static inline KaNode *ka_ref(KaNode **ctx, KaNode *args)
+static int ka_decimals = 2;
+
+static const long double ka_pow10[] = {
+    1e0L, 1e1L, 1e2L, 1e3L, 1e4L, 1e5L, 1e6L, 1e7L, 1e8L, 1e9L, 1e10L,
+    1e11L, 1e12L, 1e13L, 1e14L, 1e15L, 1e16L, 1e17L, 1e18L, 1e19L, 1e20L,
+    1e21L, 1e22L, 1e23L, 1e24L, 1e25L, 1e26L, 1e27L
+};
+
+static inline char *ka_utoa(unsigned long long value, char *end)
 {
-    KaNode *node = *ctx;
-    char *sym = args->key ? args->key : args->symbol;
+    do {
+        *--end = '0' + value % 10;
+        value /= 10;
+    } while (value);
 
-    if (args->type == KA_NUMBER || isdigit(sym[0])) {
-        int i = isdigit(sym[0]) ? atoi(sym) : *args->number;
+    return end;
+}
 
-        while (node && node->type != KA_CTX && i-- > 0) {
-            node = node->next;
-        }
+static inline int ka_ntoa(char *buf, long double number, int decimals)
+{
+    int negative = number < 0;
+    long double abs = negative ? -number : number;
+    char digits[KA_NUMBER_SIZE], *end = digits + sizeof(digits);
+
+    // Integers, up to the range of long long
+    if (abs < 9223372036854775808.0L && abs == (unsigned long long)abs) {
+        char *start = ka_utoa((unsigned long long)abs, end);
+        if (negative && abs) *--start = '-';
+
+        memcpy(buf, start, end - start);
+        buf[end - start] = '\0';
+        return end - start;
+    }
 
-        if (node && node->type == KA_CTX) {
-            node = NULL;
-        }
+    // Fixed decimals. Scale to an integer unless the rounding is too close
+    // to call, where the exact expansion done by printf is needed. The
+    // divisor must fit unsigned long long, so at most 10^19.
+    if (decimals >= 0 && decimals <= 19 &&
+        abs * ka_pow10[decimals] < KA_EXACT_SCALED) {
+        long double scaled = abs * ka_pow10[decimals];
+        unsigned long long whole = (unsigned long long)scaled;
+        long double frac = scaled - whole;
+
+        if (frac < 0.499L || frac > 0.501L) {
+            unsigned long long pow = (unsigned long long)ka_pow10[decimals];
+            whole += frac > 0.5L;
+
+            char *start = end;
+
+            if (decimals) {
+                start = ka_utoa(whole % pow, end);
+                while (end - start < decimals) *--start = '0';
+                *--start = '.';
+            }
+
+            start = ka_utoa(whole / pow, start);
+            if (negative) *--start = '-';
+
+            memcpy(buf, start, end - start);
+            buf[end - start] = '\0';
+            return end - start;
+        }
+    }
+
+    if (decimals >= 0) {
+        if (decimals > KA_MAX_DECIMALS) decimals = KA_MAX_DECIMALS;
+        return snprintf(buf, KA_NUMBER_SIZE, "%.*Lf", decimals, number);
+    }
+
+    // Shortest round trip. The digit counts that read back are contiguous,
+    // so bisect for the smallest one.
+    int lo = 1, hi = LDBL_DIG + 3;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        snprintf(buf, KA_NUMBER_SIZE, "%.*Lg", mid, number);
+
+        if (strtold(buf, NULL) == number || number != number) hi = mid;
+        else lo = mid + 1;
+    }
+
+    return snprintf(buf, KA_NUMBER_SIZE, "%.*Lg", lo, number);
+}
+
+// Parse a number from the first length bytes of str. Plain decimals are
+// converted exactly from their digits, anything else goes through strtold.
+
+static inline long double ka_aton(const char *str, size_t length, size_t *used)
+{
+    size_t i = 0, digits = 0, significant = 0, decimals = 0;
+    unsigned long long mantissa = 0;
+    int negative = 0, dot = 0;
+
+    if (i < length && (str[i] == '-' || str[i] == '+')) {
+        negative = str[i++] == '-';
+    }
+
+    for (; i < length; i++) {
+        if (str[i] >= '0' && str[i] <= '9') {
+            if (mantissa || str[i] != '0') significant++;
+            if (significant > KA_EXACT_DIGITS) break;
+
+            mantissa = mantissa * 10 + (str[i] - '0');
+            decimals += dot;
+            digits++;
+        } else if (str[i] == '.' && !dot) {
+            dot = 1;
+        } else {
+            break;
+        }
+    }
+
+    if (digits > 0 && significant <= KA_EXACT_DIGITS &&
+        decimals <= KA_EXACT_POW10 &&
+        (i == length || !strchr("eEpPxX", str[i]))) {
+        if (used) *used = i;
+
+        long double number = mantissa / ka_pow10[decimals];
+        return negative ? -number : number;
+    }
+
+    char small[KA_NUMBER_SIZE], *end;
+    char *copy = length < sizeof(small) ? small : (char *)malloc(length + 1);
+
+    memcpy(copy, str, length);
+    copy[length] = '\0';
+
+    long double number = strtold(copy, &end);
+    if (used) *used = end - copy;
+    if (copy != small) free(copy);
+
+    return number;
+}
+
+// Variables
+
+static inline KaNode *ka_ref(KaNode **ctx, KaNode *args)
+{
+    ka_own(args);
+
+    KaNode *node = *ctx;
+    char *sym = args->key ? args->key : args->symbol;
+
+    if (args->type == KA_NUMBER || isdigit(sym[0])) {
+        int i = isdigit(sym[0]) ? atoi(sym) : *args->number;
+
+        while (node && node->type != KA_CTX && i-- > 0) {
+            node = node->next;
+        }
+
+        if (node && node->type == KA_CTX) {
+            node = NULL;
+        }
     } else {
         while (node && strcmp(sym, node->key ? node->key : "")) {
             node = node->next;
@@ -224,6 +1077,8 @@ static inline KaNode *ka_del(KaNode **ctx, KaNode *args)
         return ka_new(KA_NONE);
     }
 
+    ka_own(args);
+
     KaNode *prev = *ctx;
     KaNode *node = *ctx;
     char *sym = (args->type != KA_STRING && args->key)
@@ -246,8 +1101,10 @@ static inline KaNode *ka_del(KaNode **ctx, KaNode *args)
         prev->next = node->next;
     }
 
+    // A node kept by a checkpoint comes back on rollback
     node->next = NULL;
-    ka_free(node);
+    if (!(node->flags & KA_KEEP)) ka_free(node);
+
     ka_free(args);
     return ka_new(KA_NONE);
 }
@@ -259,9 +1116,16 @@ static inline KaNode *ka_key(KaNode **ctx, KaNode *args)
         return ka_new(KA_NONE);
     }
 
+    ka_own(args);
+    char *key = ka_intern(args->symbol);
+
+    if (args->symbol && !key) {
+        ka_free(args);
+        return ka_new(KA_NONE);
+    }
+
     KaNode *data = ka_copy(args->next);
-    free(data->key);
-    data->key = strdup(args->symbol);
+    data->key = key;
 
     ka_free(args);
     return data;
@@ -270,9 +1134,9 @@ static inline KaNode *ka_key(KaNode **ctx, KaNode *args)
 static inline KaNode *ka_get(KaNode **ctx, KaNode *args)
 {
     if (args && args->type >= KA_NUMBER && args->type <= KA_SYMBOL) {
-        return ka_copy(ka_ref(ctx, args));
+        return ka_share(ka_ref(ctx, args));
     } else {
-        return ka_copy(ka_ref(ctx, ka_number(0)));
+        return ka_share(ka_ref(ctx, ka_number(0)));
     }
 }
 
@@ -283,8 +1147,17 @@ static inline KaNode *ka_def(KaNode **ctx, KaNode *args)
         return ka_new(KA_NONE);
     }
 
-    KaNode *data = ka_copy(args->next);
-    data->key = strdup(args->symbol);
+    ka_own(args);
+    char *key = ka_intern(args->symbol);
+
+    // No room for a new name
+    if (args->symbol && !key) {
+        ka_free(args);
+        return ka_new(KA_NONE);
+    }
+
+    KaNode *data = ka_claim(args->next);
+    data->key = key;
     data->next = *ctx;
 
     ka_free(args);
@@ -294,7 +1167,7 @@ static inline KaNode *ka_def(KaNode **ctx, KaNode *args)
 
     return (type == KA_FUNC || type == KA_BLOCK)
         ? ka_new(KA_NONE)
-        : ka_copy(data);
+        : ka_share(data);
 }
 
 static inline KaNode *ka_set(KaNode **ctx, KaNode *args)
@@ -312,29 +1185,18 @@ static inline KaNode *ka_set(KaNode **ctx, KaNode *args)
         return ka_del(ctx, args);
     }
 
-    KaNode *data = ka_copy(args->next);
-
     if (!node->key && args->next->key) {
-        node->key = strdup(args->next->key);
-    }
-
-    if (node->type >= KA_LIST) {
-        ka_free((KaNode *)node->value);
-    } else if (node->type != KA_FUNC) {
-        free(node->value);
+        node->key = args->next->key;
     }
 
-    node->value = data->value;
-    node->type = data->type;
+    ka_assign(node, ka_claim(args->next));
     KaType type = node->type;
 
-    free(data->key);
-    free(data);
     ka_free(args);
 
     return (type == KA_FUNC || type == KA_BLOCK)
         ? ka_new(KA_NONE)
-        : ka_copy(node);
+        : ka_share(node);
 }
 
 static inline KaNode *ka_bind(KaNode **ctx, KaNode *args)
@@ -344,9 +1206,44 @@ static inline KaNode *ka_bind(KaNode **ctx, KaNode *args)
         return ka_new(KA_NONE);
     }
 
-    KaNode *last, *last_ret;
+    // Index a string by byte position, counting from the end if negative
+    if (args->type == KA_STRING) {
+        KA_ROOT(&args);
+        KaNode *index = ka_eval(ctx, args->next);
+        KaNode *result = NULL;
+        KA_UNROOT(1);
+
+        if (index->type == KA_NUMBER) {
+            long double i = *index->number;
+            i += (i < 0) ? args->length : 0;
+
+            if (i >= 0 && i < args->length) {
+                result = ka_substr(args, (size_t)i, 1);
+            }
+        }
+
+        ka_free(index);
+        ka_free(args);
+        return result ? result : ka_new(KA_NONE);
+    }
+
+    KaNode *last;
     KaNode *left = args;
     KaNode *right = args->next;
+
+    // The scope is chained to the children, so shared ones get nodes of their
+    // own. Lists and blocks in them are still shared.
+    if (left->flags & KA_SHARED) {
+        KaNode **child = &left->children;
+
+        for (KaNode *curr = left->children; curr; curr = curr->next) {
+            *child = ka_share(curr);
+            child = &(*child)->next;
+        }
+
+        left->flags &= ~KA_SHARED;
+    }
+
     KaNode *blk_ctx = ka_chain(left->children, ka_new(KA_CTX), *ctx, NULL);
     KaNode *blk_ret = ka_eval(&blk_ctx,
         (right->type == KA_BLOCK) ? right->children : right
@@ -358,25 +1255,21 @@ static inline KaNode *ka_bind(KaNode **ctx, KaNode *args)
     ka_free(last->next);
     last->next = NULL;
 
+    // Store the list back, it is not freed with the arguments then
     if (left->key && right->type == KA_BLOCK) {
-        ka_free(
-            ka_set(ctx, ka_chain(ka_symbol(left->key), ka_copy(left), NULL))
-        );
+        args = right;
+        left->next = NULL;
+        ka_free(ka_set(ctx, ka_chain(ka_symbol(left->key), left, NULL)));
     }
 
-    for (last_ret = blk_ret; last_ret->next; last_ret = last_ret->next);
-
-    KaNode *result = ka_copy(last_ret);
-    ka_free(blk_ret);
     ka_free(args);
-    return result;
+    return ka_last(blk_ret);
 }
 
 static inline KaNode *ka_return(KaNode **ctx, KaNode *args)
 {
     KaNode *result = ka_copy(args);
-    free(result->key);
-    result->key = strdup("return");
+    result->key = ka_intern("return");
 
     ka_free(args);
     return result;
@@ -446,7 +1339,9 @@ static inline KaNode *ka_eq(KaNode **ctx, KaNode *args)
 
     KaNode *result = (
         (left->type == KA_NUMBER && *left->number == *right->number) ||
-        (left->type == KA_STRING && !strcmp(left->string, right->string)) ||
+        (left->type == KA_STRING && right->type == KA_STRING &&
+         left->length == right->length &&
+         !memcmp(left->string, right->string, left->length)) ||
         (left->value == right->value)
     ) ? ka_true() : ka_false();
 
@@ -557,10 +1452,14 @@ static inline KaNode *ka_if(KaNode **ctx, KaNode *args)
     }
 
     block = ka_copy(block);
+    KA_ROOT(&args);
+    KA_ROOT(&block);
+
     KaNode *result = ka_eval(ctx,
         (block->type == KA_BLOCK) ? block->children : block
     );
 
+    KA_UNROOT(2);
     ka_free(block);
     ka_free(args);
     return result;
@@ -576,19 +1475,33 @@ static inline KaNode *ka_while(KaNode **ctx, KaNode *args)
     KaNode *cond = ka_copy(args);
     KaNode *cond_ret = NULL;
     KaNode *block = NULL;
+#ifdef KA_JIT
+    int turns = 0;
+#endif
 
     if (args->next->type == KA_BLOCK) {
         block = args->next->children;
     }
 
+    KA_ROOT(&args);
+    KA_ROOT(&cond);
     cond_ret = ka_eval(ctx, cond->children);
 
     while (cond_ret->type >= KA_TRUE) {
         ka_free(cond_ret);
         ka_free(ka_eval(ctx, block));
+        ka_gc_poll(*ctx);
+#ifdef KA_JIT
+        // A loop that keeps running may finish as machine code
+        if (++turns == KA_JIT_THRESHOLD && ka_jit_while(ctx, cond, block)) {
+            cond_ret = ka_false();
+            break;
+        }
+#endif
         cond_ret = ka_eval(ctx, cond->children);
     }
 
+    KA_UNROOT(2);
     ka_free(cond_ret);
     ka_free(cond);
     ka_free(args);
@@ -612,11 +1525,13 @@ static inline KaNode *ka_for(KaNode **ctx, KaNode *args)
         block = args->next->children;
     }
 
+    KA_ROOT(&args);
+    KA_ROOT(&result);
+
     for (KaNode *curr = args->children; curr; curr = curr->next) {
         KaNode *blk_ctx = ka_chain(ka_copy(curr), ka_new(KA_CTX), *ctx, NULL);
         KaNode *blk_ret = ka_eval(&blk_ctx, block);
-        free(blk_ret->key);
-        blk_ret->key = curr->key ? strdup(curr->key) : NULL;
+        blk_ret->key = curr->key;
 
         if (blk_ret->type) {
             last->next = ka_copy(blk_ret);
@@ -627,6 +1542,7 @@ static inline KaNode *ka_for(KaNode **ctx, KaNode *args)
         ka_free(blk_ctx);
     }
 
+    KA_UNROOT(2);
     result->children = children->next;
     children->next = NULL;
     ka_free(children);
@@ -662,6 +1578,173 @@ static inline KaNode *ka_range(KaNode **ctx, KaNode *args)
 
 // String and list functions
 
+// Bytes of a string, or of a number formatted into buf. Anything else is empty.
+
+static inline const char *ka_text(KaNode *node, char *buf, size_t *length)
+{
+    if (node->type == KA_STRING) {
+        *length = node->length;
+        return node->string ? node->string : "";
+    } else if (node->type == KA_NUMBER) {
+        *length = ka_ntoa(buf, *node->number, ka_decimals);
+        return buf;
+    }
+
+    *length = 0;
+    return "";
+}
+
+// Two-Way search (Crochemore and Perrin) for long patterns, linear in the
+// length of str. The pattern is split at its critical factorization, the
+// right part is matched first and the left part after it. The last byte of
+// each window also skips ahead by the distance to its last use in sub.
+
+static inline const char *ka_twoway(const char *str, size_t length,
+                                    const char *sub, size_t sublength)
+{
+    const unsigned char *at = (const unsigned char *)str;
+    const unsigned char *end = at + length;
+    const unsigned char *pat = (const unsigned char *)sub;
+    size_t shift[256] = { 0 };
+    size_t i, j, k, period, split, keep, memory = 0;
+    size_t splits[2], periods[2];
+
+    for (i = 0; i < sublength; i++) shift[pat[i]] = i + 1;
+
+    // Maximal suffix for both orderings of the bytes. The later start is
+    // the critical factorization, split is the last byte before it.
+    for (int order = 0; order < 2; order++) {
+        i = (size_t)-1;
+        j = 0;
+        k = period = 1;
+
+        while (j + k < sublength) {
+            unsigned char a = pat[i + k], b = pat[j + k];
+
+            if (a == b && k == period) {
+                j += period;
+                k = 1;
+            } else if (a == b) {
+                k++;
+            } else if (order ? a < b : a > b) {
+                j += k;
+                k = 1;
+                period = j - i;
+            } else {
+                i = j++;
+                k = period = 1;
+            }
+        }
+
+        splits[order] = i;
+        periods[order] = period;
+    }
+
+    int later = splits[1] + 1 > splits[0] + 1;
+    split = splits[later];
+    period = periods[later];
+
+    // A periodic pattern remembers how much of its left part still matches
+    // after shifting by its period. Otherwise shift past the larger part.
+    if (memcmp(pat, pat + period, split + 1)) {
+        keep = 0;
+        period = (split > sublength - split - 1 ? split
+                                                : sublength - split - 1) + 1;
+    } else {
+        keep = sublength - period;
+    }
+
+    while ((size_t)(end - at) >= sublength) {
+        k = sublength - shift[at[sublength - 1]];
+
+        if (k) {
+            at += k < memory ? memory : k;
+            memory = 0;
+            continue;
+        }
+
+        // Right part, then the left part down to what is known to match
+        for (k = split + 1 > memory ? split + 1 : memory;
+             k < sublength && pat[k] == at[k]; k++);
+
+        if (k < sublength) {
+            at += k - split;
+            memory = 0;
+            continue;
+        }
+
+        for (k = split + 1; k > memory && pat[k - 1] == at[k - 1]; k--);
+
+        if (k <= memory) return (const char *)at;
+
+        at += period;
+        memory = keep;
+    }
+
+    return NULL;
+}
+
+// Find the first occurrence of sub in str. Short patterns let memchr, which
+// libc vectorizes, jump between candidates for the first byte and check the
+// last byte before the full memcmp. Their worst case is bounded by the short
+// length, longer patterns use Two-Way instead.
+
+#define KA_SEARCH_SHORT 16
+
+static inline const char *ka_search(const char *str, size_t length,
+                                    const char *sub, size_t sublength)
+{
+    if (!sublength) return str;
+    if (sublength > length) return NULL;
+    if (sublength > KA_SEARCH_SHORT) {
+        return ka_twoway(str, length, sub, sublength);
+    }
+
+    const char *last = str + length - sublength;
+    char tail = sub[sublength - 1];
+
+    for (const char *at = str; at <= last; at++) {
+        at = (const char *)memchr(at, sub[0], last - at + 1);
+
+        if (!at) return NULL;
+        if (at[sublength - 1] == tail &&
+            !memcmp(at + 1, sub + 1, sublength - 1)) {
+            return at;
+        }
+    }
+
+    return NULL;
+}
+
+// Append bytes to a string node. Its buffer grows in place when the node owns
+// it alone, otherwise the string is first moved to a buffer of its own.
+// Returns 0 and leaves the node alone if it would pass KA_MAX_LENGTH.
+
+static inline int ka_append(KaNode *node, const char *str, size_t length)
+{
+    if (length > KA_MAX_LENGTH - node->length) return 0;
+
+    size_t size = node->length + length + 1;
+
+    if (!node->string || (node->flags & (KA_INLINE | KA_VIEW)) ||
+        KA_BUF(node->string)->refs > 1 || ka_buf_mapped(node)) {
+        char *data = ka_buf_new(size);
+        if (node->length) memcpy(data, node->string, node->length);
+
+        ka_release(node);
+        node->flags &= ~(KA_INLINE | KA_VIEW);
+        node->string = data;
+    } else {
+        node->string = ka_buf_grow(node->string, size);
+    }
+
+    memcpy(node->string + node->length, str, length);
+    node->length += length;
+    node->string[node->length] = '\0';
+    node->flags |= KA_DIRTY;
+    return 1;
+}
+
 static inline KaNode *ka_merge(KaNode **ctx, KaNode *args)
 {
     if (!args || !args->next) {
@@ -675,6 +1758,9 @@ static inline KaNode *ka_merge(KaNode **ctx, KaNode *args)
     KaType ltype = left->type;
     KaType rtype = right->type;
 
+    ka_unshare(left);
+    ka_unshare(right);
+
     // Merge lists, repend or append to list
     if (ltype == KA_LIST && rtype == KA_LIST) {
         result->children = ka_chain(left->children, right->children, NULL);
@@ -705,38 +1791,41 @@ static inline KaNode *ka_cat(KaNode **ctx, KaNode *args)
 
     KaNode *left = args;
     KaNode *right = args->next;
-    KaType ltype = left->type;
-    KaType rtype = right->type;
-    char *str = NULL, *lstr = NULL, *rstr = NULL;
-    int r;
+    char lbuf[KA_NUMBER_SIZE], rbuf[KA_NUMBER_SIZE];
+    size_t llen, rlen;
+    const char *lstr = ka_text(left, lbuf, &llen);
+    const char *rstr = ka_text(right, rbuf, &rlen);
 
-    if (ltype == KA_STRING) {
-        lstr = strdup(left->string);
-    } else if (ltype == KA_NUMBER) {
-        int is_long = (*left->number == (long long)*left->number);
-        r = asprintf(&lstr, "%.*Lf", is_long ? 0 : 2, *left->number);
+    if (llen + rlen > KA_MAX_LENGTH) {
+        ka_free(args);
+        return ka_new(KA_NONE);
     }
 
-    if (rtype == KA_STRING) {
-        rstr = strdup(right->string);
-    } else if (rtype == KA_NUMBER) {
-        int is_long = (*right->number == (long long)*right->number);
-        r = asprintf(&rstr, "%.*Lf", is_long ? 0 : 2, *right->number);
+    // The left string is consumed, so append to it and hand it back
+    if (left->type == KA_STRING) {
+        ka_append(left, rstr, rlen);
+        left->key = NULL;
+        left->next = NULL;
+        ka_free(right);
+        return left;
     }
 
-    r = asprintf(&str, "%s%s", lstr, rstr);
-    KaNode *result = ka_string(str);
+    KaNode *result = ka_stralloc(KA_STRING, llen + rlen);
+    memcpy(result->string, lstr, llen);
+    memcpy(result->string + llen, rstr, rlen);
 
-    free(str);
-    free(rstr);
-    free(lstr);
     ka_free(args);
     return result;
 }
 
+// Split a string on every occurrence of the separator, or into single bytes
+// if it is empty. Empty pieces are dropped unless a third argument is true.
+// Long pieces are views into the split string.
+
 static inline KaNode *ka_split(KaNode **ctx, KaNode *args)
 {
-    if (!args || !args->next) {
+    if (!args || !args->next || args->type != KA_STRING ||
+        args->next->type != KA_STRING) {
         ka_free(args);
         return ka_new(KA_NONE);
     }
@@ -744,40 +1833,33 @@ static inline KaNode *ka_split(KaNode **ctx, KaNode *args)
     KaNode *left = args;
     KaNode *right = args->next;
     KaNode *result = ka_new(KA_LIST);
-    KaNode *last = NULL;
-    KaType ltype = left->type;
-    KaType rtype = right->type;
-
-    // Split string into list - empty separator
-    if (ltype == KA_STRING && rtype == KA_STRING && !right->string[0]) {
-        for (int i = 0; left->string[i]; i++) {
-            KaNode *str = ka_string((char[]){ left->string[i], '\0' });
-
-            if (last) {
-                last->next = str;
-                last = last->next;
-            } else {
-                result->children = str;
-                last = result->children;
-            }
+    KaNode **last = &result->children;
+    int keep = right->next && right->next->type >= KA_TRUE;
+    const char *str = left->string;
+    size_t length = left->length;
+
+    if (!right->length) {
+        for (size_t i = 0; i < length; i++) {
+            *last = ka_stringn(str + i, 1);
+            last = &(*last)->next;
         }
-    }
-    // Split string into list - string separator
-    else if (ltype == KA_STRING && rtype == KA_STRING) {
-        char *str = strtok(left->string, right->string);
 
-        if (str) {
-            result->children = ka_string(str);
-            last = result->children;
-        }
+        ka_free(args);
+        return result;
+    }
 
-        str = strtok(NULL, right->string);
+    for (size_t start = 0;;) {
+        const char *hit = ka_search(str + start, length - start,
+                                    right->string, right->length);
+        size_t stop = hit ? (size_t)(hit - str) : length;
 
-        while (str) {
-            last->next = ka_string(str);
-            last = last->next;
-            str = strtok(NULL, right->string);
+        if (stop > start || keep) {
+            *last = ka_substr(left, start, stop - start);
+            last = &(*last)->next;
         }
+
+        if (!hit) break;
+        start = stop + right->length;
     }
 
     ka_free(args);
@@ -786,509 +1868,2678 @@ static inline KaNode *ka_split(KaNode **ctx, KaNode *args)
 
 static inline KaNode *ka_join(KaNode **ctx, KaNode *args)
 {
-    if (!args || !args->next) {
+    if (!args || !args->next || args->type != KA_LIST ||
+        args->next->type != KA_STRING || !args->children) {
         ka_free(args);
         return ka_new(KA_NONE);
     }
 
     KaNode *left = args;
     KaNode *right = args->next;
-    KaNode *result;
-    KaType ltype = left->type;
-    KaType rtype = right->type;
-
-    if (ltype == KA_LIST && rtype == KA_STRING && left->children) {
-        size_t size = sizeof(char);
-        char *str = (char *)calloc(1, size);
+    char buf[KA_NUMBER_SIZE];
+    size_t size = 0, length = 0;
+
+    // Size the result first. Numbers are formatted here too, so the result
+    // is allocated at its exact length.
+    for (KaNode *node = left->children; node; node = node->next) {
+        if (node->type == KA_STRING) {
+            size += node->length;
+        } else if (node->type == KA_NUMBER) {
+            size += ka_ntoa(buf, *node->number, ka_decimals);
+        }
 
-        for (KaNode *node = left->children; node; node = node->next) {
-            if (node->type != KA_STRING) continue;
+        if (node->next) size += right->length;
+    }
 
-            size += strlen(node->string) + strlen(right->string);
-            str = (char *)realloc(str, size);
-            strcat(str, node->string);
+    if (size > KA_MAX_LENGTH) {
+        ka_free(args);
+        return ka_new(KA_NONE);
+    }
 
-            if (node->next) strcat(str, right->string);
+    KaNode *result = ka_stralloc(KA_STRING, size);
+    char *str = result->string;
+
+    for (KaNode *node = left->children; node; node = node->next) {
+        if (node->type == KA_STRING) {
+            memcpy(str + length, node->string, node->length);
+            length += node->length;
+        } else if (node->type == KA_NUMBER) {
+            size_t n = ka_ntoa(buf, *node->number, ka_decimals);
+            memcpy(str + length, buf, n);
+            length += n;
         }
 
-        result = ka_string(str); // Implement the list to string join
-        free(str);
-    } else {
-        result = ka_new(KA_NONE);
+        if (node->next) {
+            memcpy(str + length, right->string, right->length);
+            length += right->length;
+        }
     }
 
+    str[length] = '\0';
+    result->length = length;
+
     ka_free(args);
     return result;
 }
 
-static inline KaNode *ka_length(KaNode **ctx, KaNode *args)
+// Clamp a position to a string, negative positions count from the end
+
+static inline size_t ka_index(long double index, size_t length)
 {
-    if (!args) return ka_new(KA_NONE);
+    if (index < 0) index += length;
 
-    int length = 0;
+    return (index < 0) ? 0 : (index > length) ? length : (size_t)index;
+}
 
-    if (args->type == KA_STRING) {
-        length = strlen(args->string);
-    } else if (args->type == KA_LIST) {
-        for (KaNode *curr = args->children; curr; curr = curr->next) {
-            length++;
-        }
+// Position of the first occurrence of a substring, starting at an optional
+// position, or none if it is not found
+
+static inline KaNode *ka_find(KaNode **ctx, KaNode *args)
+{
+    if (!args || !args->next || args->type != KA_STRING ||
+        args->next->type != KA_STRING) {
+        ka_free(args);
+        return ka_new(KA_NONE);
     }
 
+    KaNode *left = args;
+    KaNode *right = args->next;
+    KaNode *from = right->next;
+    size_t start = (from && from->type == KA_NUMBER)
+        ? ka_index(*from->number, left->length)
+        : 0;
+
+    const char *hit = ka_search(left->string + start, left->length - start,
+                                right->string, right->length);
+    KaNode *result = hit
+        ? ka_number(hit - left->string)
+        : ka_new(KA_NONE);
+
     ka_free(args);
-    return ka_number(length);
+    return result;
 }
 
-static inline KaNode *ka_upper(KaNode **ctx, KaNode *args)
+static inline KaNode *ka_contains(KaNode **ctx, KaNode *args)
 {
-    if (!args || args->type != KA_STRING) {
+    KaNode *result = ka_find(ctx, args);
+    KaType type = result->type;
+
+    ka_free(result);
+    return (type == KA_NUMBER) ? ka_true() : ka_false();
+}
+
+static inline KaNode *ka_startswith(KaNode **ctx, KaNode *args)
+{
+    if (!args || !args->next || args->type != KA_STRING ||
+        args->next->type != KA_STRING) {
         ka_free(args);
         return ka_new(KA_NONE);
     }
 
-    KaNode *result = ka_copy(args);
+    KaNode *left = args;
+    KaNode *right = args->next;
 
-    for (char *c = result->string; *c; c++) {
-        *c = toupper(*c);
-    }
+    KaNode *result = (right->length <= left->length &&
+        !memcmp(left->string, right->string, right->length))
+        ? ka_true()
+        : ka_false();
 
     ka_free(args);
     return result;
 }
 
-static inline KaNode *ka_lower(KaNode **ctx, KaNode *args)
+static inline KaNode *ka_endswith(KaNode **ctx, KaNode *args)
 {
-    if (!args || args->type != KA_STRING) {
+    if (!args || !args->next || args->type != KA_STRING ||
+        args->next->type != KA_STRING) {
         ka_free(args);
         return ka_new(KA_NONE);
     }
 
-    KaNode *result = ka_copy(args);
+    KaNode *left = args;
+    KaNode *right = args->next;
+    size_t offset = left->length - right->length;
 
-    for (char *c = result->string; *c; c++) {
-        *c = tolower(*c);
-    }
+    KaNode *result = (right->length <= left->length &&
+        !memcmp(left->string + offset, right->string, right->length))
+        ? ka_true()
+        : ka_false();
 
     ka_free(args);
     return result;
 }
 
-// Arithmetic operators
+// Replace occurrences of a substring, all of them or up to a count. Matches
+// are counted first so the result is allocated once.
 
-static inline KaNode *ka_add(KaNode **ctx, KaNode *args)
+static inline KaNode *ka_replace(KaNode **ctx, KaNode *args)
 {
-    if (!args || !args->next) {
+    if (!args || !args->next || !args->next->next ||
+        args->type != KA_STRING || args->next->type != KA_STRING) {
         ka_free(args);
         return ka_new(KA_NONE);
     }
 
-    KaNode *left = args;
-    KaNode *right = args->next;
-    KaType ltype = left->type;
-    KaType rtype = right->type;
-
-    // Add numbers
-    if (ltype == KA_NUMBER && rtype == KA_NUMBER) {
-        long double lnum = *left->number;
-        long double rnum = *right->number;
+    KaNode *text = args;
+    KaNode *pattern = args->next;
+    KaNode *value = pattern->next;
+    KaNode *limit = value->next;
+    char buf[KA_NUMBER_SIZE];
+    size_t vlen, count = 0;
+    size_t max = (limit && limit->type == KA_NUMBER && *limit->number >= 0)
+        ? (size_t)*limit->number
+        : (size_t)-1;
+    const char *str = text->string, *end = str + text->length;
+    const char *vstr = ka_text(value, buf, &vlen);
+
+    for (const char *at = str; pattern->length && count < max; count++) {
+        at = ka_search(at, end - at, pattern->string, pattern->length);
+        if (!at) break;
+        at += pattern->length;
+    }
 
+    if (!count) {
+        KaNode *result = ka_copy(text);
+        result->key = NULL;
         ka_free(args);
-        return ka_number(lnum + rnum);
-    } else if (ltype == KA_LIST || rtype == KA_LIST) {
-        return ka_merge(ctx, args);
+        return result;
     }
 
-    return ka_cat(ctx, args);
-}
+    size_t size = text->length - count * pattern->length + count * vlen;
 
-static inline KaNode *ka_sub(KaNode **ctx, KaNode *args)
-{
-    if (!args || !args->next) {
+    if (size > KA_MAX_LENGTH) {
         ka_free(args);
         return ka_new(KA_NONE);
     }
 
-    KaNode *left = args;
-    KaNode *right = args->next;
+    KaNode *result = ka_stralloc(KA_STRING, size);
+    char *out = result->string;
 
-    KaNode *result = (left->type == KA_NUMBER && right->type == KA_NUMBER)
-        ? ka_number(*left->number - *right->number)
-        : ka_new(KA_NONE);
+    for (size_t i = 0; i < count; i++) {
+        const char *at = ka_search(str, end - str,
+                                   pattern->string, pattern->length);
+
+        memcpy(out, str, at - str);
+        out += at - str;
+        memcpy(out, vstr, vlen);
+        out += vlen;
+        str = at + pattern->length;
+    }
+
+    memcpy(out, str, end - str);
 
     ka_free(args);
     return result;
 }
 
-static inline KaNode *ka_mul(KaNode **ctx, KaNode *args)
+static inline KaNode *ka_length(KaNode **ctx, KaNode *args)
 {
-    if (!args || !args->next) {
+    if (!args) return ka_new(KA_NONE);
+
+    int length = 0;
+
+    if (args->type == KA_STRING) {
+        length = args->length;
+    } else if (args->type == KA_LIST) {
+        for (KaNode *curr = args->children; curr; curr = curr->next) {
+            length++;
+        }
+    }
+
+    ka_free(args);
+    return ka_number(length);
+}
+
+static inline KaNode *ka_slice(KaNode **ctx, KaNode *args)
+{
+    if (!args || !args->next || args->type != KA_STRING ||
+        args->next->type != KA_NUMBER) {
         ka_free(args);
         return ka_new(KA_NONE);
     }
 
-    KaNode *left = args;
-    KaNode *right = args->next;
-    KaType ltype = left->type;
-    KaType rtype = right->type;
+    KaNode *end = args->next->next;
+    size_t from = ka_index(*args->next->number, args->length);
+    size_t to = (end && end->type == KA_NUMBER)
+        ? ka_index(*end->number, args->length)
+        : args->length;
 
-    // Multiply numbers
-    if (ltype == KA_NUMBER && rtype == KA_NUMBER) {
-        KaNode *result = (ltype == KA_NUMBER && rtype == KA_NUMBER)
-            ? ka_number(*left->number * *right->number)
-            : ka_new(KA_NONE);
+    KaNode *result = ka_substr(args, from, (to > from) ? to - from : 0);
 
-        ka_free(args);
-        return result;
-    } else if (ltype == KA_LIST && rtype == KA_BLOCK) {
-        return ka_for(ctx, args);
-    } else if (ltype == KA_LIST && rtype == KA_STRING) {
-        return ka_join(ctx, args);
+    ka_free(args);
+    return result;
+}
+
+// ASCII byte classes, eight bytes at a time. Each byte is tested on its low
+// seven bits, and bytes with the high bit set, such as UTF-8 sequences, never
+// match, so they pass through case conversion untouched.
+
+#define KA_ONES 0x0101010101010101ULL
+#define KA_HIGH 0x8080808080808080ULL
+
+// High bit set in every byte of word that lies between lo and hi
+
+static inline uint64_t ka_range8(uint64_t word, unsigned char lo,
+                                 unsigned char hi)
+{
+    uint64_t low = word & ~KA_HIGH;
+    uint64_t ge = low + (0x80 - lo) * KA_ONES;
+    uint64_t gt = low + (0x7f - hi) * KA_ONES;
+
+    return ge & ~gt & ~word & KA_HIGH;
+}
+
+// Copy bytes flipping the case of the 26 letters starting at first
+
+static inline void ka_case(char *out, const char *str, size_t length,
+                           char first)
+{
+    size_t i = 0;
+
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, str + i, 8);
+        word ^= ka_range8(word, first, first + 25) >> 2;
+        memcpy(out + i, &word, 8);
     }
 
-    ka_free(args);
-    return ka_new(KA_NONE);
+    for (; i < length; i++) {
+        unsigned char c = str[i];
+        out[i] = (c >= first && c <= first + 25) ? c ^ 0x20 : c;
+    }
 }
 
-static inline KaNode *ka_div(KaNode **ctx, KaNode *args)
+static inline KaNode *ka_upper(KaNode **ctx, KaNode *args)
 {
-    if (!args || !args->next) {
+    if (!args || args->type != KA_STRING) {
         ka_free(args);
         return ka_new(KA_NONE);
     }
 
-    KaNode *left = args;
-    KaNode *right = args->next;
-    KaType ltype = left->type;
-    KaType rtype = right->type;
+    KaNode *result = ka_stralloc(KA_STRING, args->length);
+    ka_case(result->string, args->string, args->length, 'a');
+    result->key = args->key;
 
-    // Divide numbers
-    if (ltype == KA_NUMBER && rtype == KA_NUMBER) {
-        KaNode *result = (left->type == KA_NUMBER && right->type == KA_NUMBER)
-            ? ka_number(*left->number / *right->number)
-            : NULL;
+    ka_free(args);
+    return result;
+}
 
+static inline KaNode *ka_lower(KaNode **ctx, KaNode *args)
+{
+    if (!args || args->type != KA_STRING) {
         ka_free(args);
-        return result;
-    } else if (ltype == KA_STRING && rtype == KA_STRING) {
-        return ka_split(ctx, args);
+        return ka_new(KA_NONE);
     }
 
+    KaNode *result = ka_stralloc(KA_STRING, args->length);
+    ka_case(result->string, args->string, args->length, 'A');
+    result->key = args->key;
+
     ka_free(args);
-    return ka_new(KA_NONE);
+    return result;
 }
 
-static inline KaNode *ka_mod(KaNode **ctx, KaNode *args)
+static inline int ka_blank(unsigned char c)
 {
-    if (!args || !args->next) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// Remove leading and trailing whitespace, or any of the given bytes
+
+static inline KaNode *ka_trim(KaNode **ctx, KaNode *args)
+{
+    if (!args || args->type != KA_STRING) {
         ka_free(args);
         return ka_new(KA_NONE);
     }
 
-    KaNode *left = args;
-    KaNode *right = args->next;
+    unsigned char set[256] = { 0 };
+    const unsigned char *str = (const unsigned char *)args->string;
+    size_t start = 0, end = args->length;
 
-    KaNode *result = (left->type == KA_NUMBER && right->type == KA_NUMBER)
-        ? ka_number((int)*left->number % (int)*right->number)
-        : ka_new(KA_NONE);
+    if (args->next && args->next->type == KA_STRING) {
+        for (size_t i = 0; i < args->next->length; i++) {
+            set[(unsigned char)args->next->string[i]] = 1;
+        }
+    } else {
+        for (int c = 0; c < 256; c++) set[c] = ka_blank(c);
+    }
+
+    while (start < end && set[str[start]]) start++;
+    while (end > start && set[str[end - 1]]) end--;
+
+    KaNode *result = ka_substr(args, start, end - start);
 
     ka_free(args);
     return result;
 }
 
-static inline KaNode *ka_addset(KaNode **ctx, KaNode *args)
+// Whether a non-empty string only holds bytes of one class
+
+static inline KaNode *ka_isclass(KaNode *args, unsigned char lo,
+                                 unsigned char hi, uint64_t fold)
 {
-    if (!args || !args->next) {
+    if (!args || args->type != KA_STRING) {
         ka_free(args);
         return ka_new(KA_NONE);
     }
 
-    KaNode *symbol = ka_symbol(args->key);
-    return ka_set(ctx, ka_chain(symbol, ka_add(ctx, args), NULL));
+    const char *str = args->string;
+    size_t length = args->length, i = 0;
+    int match = length > 0;
+
+    for (; match && i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, str + i, 8);
+        match = ka_range8(word | fold, lo, hi) == KA_HIGH;
+    }
+
+    for (; match && i < length; i++) {
+        unsigned char c = str[i] | (unsigned char)fold;
+        match = c >= lo && c <= hi;
+    }
+
+    ka_free(args);
+    return match ? ka_true() : ka_false();
 }
 
-static inline KaNode *ka_subset(KaNode **ctx, KaNode *args)
+static inline KaNode *ka_isdigit(KaNode **ctx, KaNode *args)
 {
-    if (!args || !args->next) {
-        ka_free(args);
-        return ka_new(KA_NONE);
-    }
+    return ka_isclass(args, '0', '9', 0);
+}
 
-    KaNode *symbol = ka_symbol(args->key);
-    return ka_set(ctx, ka_chain(symbol, ka_sub(ctx, args), NULL));
+static inline KaNode *ka_isalpha(KaNode **ctx, KaNode *args)
+{
+    return ka_isclass(args, 'a', 'z', 0x20 * KA_ONES);
 }
 
-static inline KaNode *ka_mulset(KaNode **ctx, KaNode *args)
+static inline KaNode *ka_isspace(KaNode **ctx, KaNode *args)
 {
-    if (!args || !args->next) {
+    if (!args || args->type != KA_STRING) {
         ka_free(args);
         return ka_new(KA_NONE);
     }
 
-    KaNode *symbol = ka_symbol(args->key);
-    return ka_set(ctx, ka_chain(symbol, ka_mul(ctx, args), NULL));
+    int match = args->length > 0;
+
+    for (size_t i = 0; match && i < args->length; i++) {
+        match = ka_blank(args->string[i]);
+    }
+
+    ka_free(args);
+    return match ? ka_true() : ka_false();
 }
 
-static inline KaNode *ka_divset(KaNode **ctx, KaNode *args)
+// Pattern matching. A pattern is parsed into a tree, compiled into a program
+// and run by a Pike VM, which advances every alternative in lockstep over the
+// subject, so matching never backtracks. Compiled patterns are cached by their
+// text. The syntax covers literals, . ^ $, [classes] with ranges and negation,
+// \d \w \s and their negations, groups (...) and (?:...), alternation and the
+// * + ? quantifiers, which are lazy when followed by ?.
+
+#define KA_REGEX_CACHE 64
+
+typedef enum {
+    // Tree leaves and instructions
+    KA_RE_CHAR, KA_RE_ANY, KA_RE_SET, KA_RE_BOL, KA_RE_EOL,
+    // Instructions
+    KA_RE_SPLIT, KA_RE_JMP, KA_RE_SAVE, KA_RE_MATCH,
+    // Tree nodes
+    KA_RE_CAT, KA_RE_ALT, KA_RE_STAR, KA_RE_PLUS, KA_RE_QUEST, KA_RE_GROUP,
+    KA_RE_EMPTY
+} KaReOp;
+
+typedef struct {
+    unsigned char op;
+    unsigned char lazy;
+    int a, b;
+} KaReNode;
+
+typedef struct {
+    unsigned char op;
+    int x, y;
+} KaReInst;
+
+typedef struct {
+    int count;
+    size_t gen;
+    int *pcs;
+    size_t *caps;
+    size_t *mark;
+} KaReList;
+
+typedef struct KaRegex {
+    char *pattern;
+    size_t length;
+    KaReInst *code;
+    int count;
+    unsigned char (*sets)[32];
+    int slots;
+    int first;
+    size_t gen;
+    KaReList lists[2];
+    size_t *caps;
+    size_t *match;
+    struct KaRegex *next;
+} KaRegex;
+
+typedef struct {
+    const char *src;
+    size_t length, pos;
+    KaReNode *nodes;
+    int count, cap;
+    unsigned char (*sets)[32];
+    int nsets;
+    int groups;
+} KaReParser;
+
+static inline int ka_re_node(KaReParser *p, KaReOp op, int a, int b)
 {
-    if (!args || !args->next) {
-        ka_free(args);
-        return ka_new(KA_NONE);
+    if (a < -1 || b < -1 || p->count == p->cap) return -2;
+
+    KaReNode *node = &p->nodes[p->count];
+    node->op = op;
+    node->lazy = 0;
+    node->a = a;
+    node->b = b;
+    return p->count++;
+}
+
+// Add the bytes matched by \d \w \s, or by their uppercase negations
+
+static inline void ka_re_escape(unsigned char *set, char c)
+{
+    for (int i = 0; i < 256; i++) {
+        int in = ((c | 0x20) == 'd') ? (i >= '0' && i <= '9')
+            : ((c | 0x20) == 'w') ? (i == '_' || (i >= '0' && i <= '9') ||
+                                     ((i | 0x20) >= 'a' && (i | 0x20) <= 'z'))
+            : ka_blank(i);
+
+        if (c >= 'A' && c <= 'Z') in = !in;
+        if (in) set[i >> 3] |= 1 << (i & 7);
     }
+}
 
-    KaNode *symbol = ka_symbol(args->key);
-    return ka_set(ctx, ka_chain(symbol, ka_div(ctx, args), NULL));
+static inline char ka_re_literal(char c)
+{
+    return (c == 'n') ? '\n' : (c == 't') ? '\t' : (c == 'r') ? '\r' : c;
 }
 
-static inline KaNode *ka_modset(KaNode **ctx, KaNode *args)
+static inline int ka_re_class(KaReParser *p)
 {
-    if (!args || !args->next) {
-        ka_free(args);
-        return ka_new(KA_NONE);
+    unsigned char *set = p->sets[p->nsets];
+    int negate = p->pos < p->length && p->src[p->pos] == '^';
+    int first = 1;
+
+    memset(set, 0, 32);
+    p->pos += negate;
+
+    while (p->pos < p->length && (p->src[p->pos] != ']' || first)) {
+        unsigned char lo = p->src[p->pos++], hi;
+        first = 0;
+
+        if (lo == '\\' && p->pos < p->length) {
+            char e = p->src[p->pos++];
+
+            if (e && strchr("dwsDWS", e)) {
+                ka_re_escape(set, e);
+                continue;
+            }
+
+            lo = ka_re_literal(e);
+        }
+
+        hi = lo;
+
+        if (p->pos + 1 < p->length && p->src[p->pos] == '-' &&
+            p->src[p->pos + 1] != ']') {
+            hi = p->src[p->pos + 1];
+            p->pos += 2;
+
+            if (hi == '\\' && p->pos < p->length) {
+                hi = ka_re_literal(p->src[p->pos++]);
+            }
+        }
+
+        for (int i = lo; i <= hi; i++) {
+            set[i >> 3] |= 1 << (i & 7);
+        }
     }
 
-    KaNode *symbol = ka_symbol(args->key);
-    return ka_set(ctx, ka_chain(symbol, ka_mod(ctx, args), NULL));
+    if (p->pos >= p->length) return -2;
+    p->pos++;
+
+    if (negate) {
+        for (int i = 0; i < 32; i++) set[i] = ~set[i];
+    }
+
+    return ka_re_node(p, KA_RE_SET, p->nsets++, -1);
 }
 
-// Parser and Interpreter
+static inline int ka_re_alt(KaReParser *p);
 
-static inline KaNode *ka_eval(KaNode **ctx, KaNode *nodes)
+static inline int ka_re_atom(KaReParser *p)
 {
-    KaNode *head = ka_new(KA_NONE);
-    KaNode *first = head;
-    KaNode *last = head;
+    char c = p->src[p->pos++];
 
-    if (!nodes) return head;
+    if (c == '(') {
+        int capture = !(p->pos + 1 < p->length &&
+                        p->src[p->pos] == '?' && p->src[p->pos + 1] == ':');
+        int group = capture ? ++p->groups : 0;
 
-    // Evaluate expressions and resolve variables
-    for (KaNode *curr = nodes, *skip = NULL; curr; curr = curr->next) {
-        // Flagged node skip processing
-        if (curr == skip) {
-            last->next = ka_copy(curr);
-            last = last->next;
-            continue;
+        p->pos += capture ? 0 : 2;
+        int inner = ka_re_alt(p);
+
+        if (inner < 0 || p->pos >= p->length || p->src[p->pos] != ')') {
+            return -2;
         }
-        // Process node based on its type
-        if (curr->type == KA_SYMBOL) {
-            last->next = ka_get(ctx, ka_symbol(curr->symbol));
-            last = last->next;
-        } else if (curr->type == KA_LIST) {
-            last->next = ka_new(curr->type);
-            last = last->next;
-            last->key = curr->key ? strdup(curr->key) : NULL;
-            last->children = ka_eval(ctx, curr->children);
-        } else if (curr->type == KA_EXPR) {
-            last->next = ka_eval(ctx, curr->children);
-            last = last->next;
-            if (!strcmp("return", last->key ? last->key : "")) break;
-        } else {
-            last->next = ka_copy(curr);
-            last = last->next;
+
+        p->pos++;
+        return capture ? ka_re_node(p, KA_RE_GROUP, inner, group) : inner;
+    } else if (c == '[') {
+        return ka_re_class(p);
+    } else if (c == '.') {
+        return ka_re_node(p, KA_RE_ANY, -1, -1);
+    } else if (c == '^') {
+        return ka_re_node(p, KA_RE_BOL, -1, -1);
+    } else if (c == '$') {
+        return ka_re_node(p, KA_RE_EOL, -1, -1);
+    } else if (c == '*' || c == '+' || c == '?') {
+        return -2;
+    } else if (c == '\\') {
+        if (p->pos >= p->length) return -2;
+
+        char e = p->src[p->pos++];
+
+        if (e && strchr("dwsDWS", e)) {
+            memset(p->sets[p->nsets], 0, 32);
+            ka_re_escape(p->sets[p->nsets], e);
+            return ka_re_node(p, KA_RE_SET, p->nsets++, -1);
         }
-        // Flag next node for special treatment
-        if (curr->next && curr->next->type == KA_SYMBOL &&
-            (last->func == ka_key ||
-             last->func == ka_def ||
-             last->func == ka_set ||
-             last->func == ka_del)) {
-            skip = curr->next; 
-        } else if (last->func == ka_while) {
-            skip = curr->next;
-        } else if (curr->next && last->func == ka_bind) {
-            skip = curr->next->next;
+
+        c = ka_re_literal(e);
+    }
+
+    return ka_re_node(p, KA_RE_CHAR, (unsigned char)c, -1);
+}
+
+static inline int ka_re_repeat(KaReParser *p)
+{
+    int node = ka_re_atom(p);
+
+    while (node >= 0 && p->pos < p->length && p->src[p->pos] &&
+           strchr("*+?", p->src[p->pos])) {
+        char q = p->src[p->pos++];
+        KaReOp op = (q == '*') ? KA_RE_STAR
+            : (q == '+') ? KA_RE_PLUS
+            : KA_RE_QUEST;
+
+        node = ka_re_node(p, op, node, -1);
+
+        if (node >= 0 && p->pos < p->length && p->src[p->pos] == '?') {
+            p->nodes[node].lazy = 1;
+            p->pos++;
+        }
+    }
+
+    return node;
+}
+
+static inline int ka_re_cat(KaReParser *p)
+{
+    int node = -1;
+
+    while (p->pos < p->length &&
+           p->src[p->pos] != '|' && p->src[p->pos] != ')') {
+        int next = ka_re_repeat(p);
+        node = (node == -1) ? next : ka_re_node(p, KA_RE_CAT, node, next);
+        if (node < 0) return -2;
+    }
+
+    return (node == -1) ? ka_re_node(p, KA_RE_EMPTY, -1, -1) : node;
+}
+
+static inline int ka_re_alt(KaReParser *p)
+{
+    int node = ka_re_cat(p);
+
+    while (node >= 0 && p->pos < p->length && p->src[p->pos] == '|') {
+        p->pos++;
+        node = ka_re_node(p, KA_RE_ALT, node, ka_re_cat(p));
+    }
+
+    return node;
+}
+
+static inline void ka_re_emit(KaRegex *re, KaReNode *nodes, int index)
+{
+    KaReNode *node = &nodes[index];
+    KaReInst *code = re->code;
+    int at = re->count;
+
+    switch (node->op) {
+    case KA_RE_CHAR: case KA_RE_ANY: case KA_RE_SET:
+    case KA_RE_BOL: case KA_RE_EOL:
+        code[re->count++] = (KaReInst){ node->op, node->a, 0 };
+        break;
+    case KA_RE_CAT:
+        ka_re_emit(re, nodes, node->a);
+        ka_re_emit(re, nodes, node->b);
+        break;
+    case KA_RE_ALT: {
+        re->count++;
+        ka_re_emit(re, nodes, node->a);
+        int jmp = re->count++;
+        code[at] = (KaReInst){ KA_RE_SPLIT, at + 1, re->count };
+        ka_re_emit(re, nodes, node->b);
+        code[jmp] = (KaReInst){ KA_RE_JMP, re->count, 0 };
+        break;
+    }
+    case KA_RE_QUEST:
+    case KA_RE_STAR:
+        re->count++;
+        ka_re_emit(re, nodes, node->a);
+
+        if (node->op == KA_RE_STAR) {
+            code[re->count++] = (KaReInst){ KA_RE_JMP, at, 0 };
         }
+
+        code[at] = node->lazy
+            ? (KaReInst){ KA_RE_SPLIT, re->count, at + 1 }
+            : (KaReInst){ KA_RE_SPLIT, at + 1, re->count };
+        break;
+    case KA_RE_PLUS: {
+        ka_re_emit(re, nodes, node->a);
+        int split = re->count++;
+        code[split] = node->lazy
+            ? (KaReInst){ KA_RE_SPLIT, split + 1, at }
+            : (KaReInst){ KA_RE_SPLIT, at, split + 1 };
+        break;
+    }
+    case KA_RE_GROUP:
+        code[re->count++] = (KaReInst){ KA_RE_SAVE, node->b * 2, 0 };
+        ka_re_emit(re, nodes, node->a);
+        code[re->count++] = (KaReInst){ KA_RE_SAVE, node->b * 2 + 1, 0 };
+        break;
+    }
+}
+
+static inline void ka_re_free(KaRegex *re)
+{
+    for (int i = 0; i < 2; i++) {
+        free(re->lists[i].pcs);
+        free(re->lists[i].caps);
+        free(re->lists[i].mark);
+    }
+
+    free(re->pattern);
+    free(re->code);
+    free(re->sets);
+    free(re->caps);
+    free(re->match);
+    free(re);
+}
+
+static inline KaRegex *ka_re_compile(const char *pattern, size_t length)
+{
+    KaReParser p = { .src = pattern, .length = length };
+    p.cap = 4 * length + 4;
+    p.nodes = (KaReNode *)malloc(p.cap * sizeof(KaReNode));
+    p.sets = (unsigned char (*)[32])malloc((length + 1) * 32);
+
+    int root = ka_re_alt(&p);
+
+    if (root < 0 || p.pos != length) {
+        free(p.nodes);
+        free(p.sets);
+        return NULL;
+    }
+
+    KaRegex *re = (KaRegex *)calloc(1, sizeof(KaRegex));
+    re->pattern = (char *)malloc(length + 1);
+    memcpy(re->pattern, pattern, length);
+    re->length = length;
+    re->sets = p.sets;
+    re->slots = (p.groups + 1) * 2;
+    re->code = (KaReInst *)malloc((2 * p.count + 3) * sizeof(KaReInst));
+
+    re->code[re->count++] = (KaReInst){ KA_RE_SAVE, 0, 0 };
+    ka_re_emit(re, p.nodes, root);
+    re->code[re->count++] = (KaReInst){ KA_RE_SAVE, 1, 0 };
+    re->code[re->count++] = (KaReInst){ KA_RE_MATCH, 0, 0 };
+    re->first = (re->code[1].op == KA_RE_CHAR) ? re->code[1].x : -1;
+    free(p.nodes);
+
+    for (int i = 0; i < 2; i++) {
+        re->lists[i].pcs = (int *)malloc(re->count * sizeof(int));
+        re->lists[i].caps = (size_t *)malloc(
+            re->count * re->slots * sizeof(size_t)
+        );
+        re->lists[i].mark = (size_t *)calloc(re->count, sizeof(size_t));
+    }
+
+    re->caps = (size_t *)malloc(re->slots * sizeof(size_t));
+    re->match = (size_t *)malloc(re->slots * sizeof(size_t));
+    return re;
+}
+
+// Compiled patterns, most recently used first
+
+static inline KaRegex *ka_regex(const char *pattern, size_t length)
+{
+    static KaRegex *cache = NULL;
+    static int cached = 0;
+
+    for (KaRegex **link = &cache; *link; link = &(*link)->next) {
+        KaRegex *re = *link;
+
+        if (re->length == length && !memcmp(re->pattern, pattern, length)) {
+            *link = re->next;
+            re->next = cache;
+            return cache = re;
+        }
+    }
+
+    KaRegex *re = ka_re_compile(pattern, length);
+    if (!re) return NULL;
+
+    re->next = cache;
+    cache = re;
+
+    if (++cached > KA_REGEX_CACHE) {
+        KaRegex **link = &cache;
+        while ((*link)->next) link = &(*link)->next;
+
+        ka_re_free(*link);
+        *link = NULL;
+        cached--;
+    }
+
+    return re;
+}
+
+// Add a thread to a list, following jumps, splits, saves and anchors
+
+static inline void ka_re_add(KaRegex *re, KaReList *list, int pc,
+                             size_t *caps, size_t pos, size_t length)
+{
+    if (list->mark[pc] == list->gen) return;
+    list->mark[pc] = list->gen;
+
+    KaReInst *inst = &re->code[pc];
+
+    switch (inst->op) {
+    case KA_RE_JMP:
+        ka_re_add(re, list, inst->x, caps, pos, length);
+        return;
+    case KA_RE_SPLIT:
+        ka_re_add(re, list, inst->x, caps, pos, length);
+        ka_re_add(re, list, inst->y, caps, pos, length);
+        return;
+    case KA_RE_SAVE: {
+        size_t old = caps[inst->x];
+        caps[inst->x] = pos;
+        ka_re_add(re, list, pc + 1, caps, pos, length);
+        caps[inst->x] = old;
+        return;
+    }
+    case KA_RE_BOL:
+        if (pos == 0) ka_re_add(re, list, pc + 1, caps, pos, length);
+        return;
+    case KA_RE_EOL:
+        if (pos == length) ka_re_add(re, list, pc + 1, caps, pos, length);
+        return;
+    }
+
+    memcpy(list->caps + list->count * re->slots, caps,
+           re->slots * sizeof(size_t));
+    list->pcs[list->count++] = pc;
+}
+
+// Find the leftmost match at or after start. Its group boundaries are left in
+// re->match, with (size_t)-1 for groups that did not take part.
+
+static inline int ka_re_exec(KaRegex *re, const char *str, size_t length,
+                             size_t start)
+{
+    KaReList *clist = &re->lists[0], *nlist = &re->lists[1];
+    int matched = 0;
+
+    clist->count = 0;
+    clist->gen = ++re->gen;
+
+    for (size_t pos = start;; pos++) {
+        if (!matched) {
+            // Skip to the next candidate when the pattern starts with a byte
+            if (!clist->count && re->first >= 0) {
+                const char *hit = (const char *)memchr(
+                    str + pos, re->first, length - pos
+                );
+
+                if (!hit) break;
+                pos = hit - str;
+            }
+
+            memset(re->caps, 0xff, re->slots * sizeof(size_t));
+            ka_re_add(re, clist, 0, re->caps, pos, length);
+        }
+
+        if (!clist->count) break;
+
+        int c = (pos < length) ? (unsigned char)str[pos] : -1;
+        nlist->count = 0;
+        nlist->gen = ++re->gen;
+
+        for (int i = 0; i < clist->count; i++) {
+            KaReInst *inst = &re->code[clist->pcs[i]];
+            size_t *caps = clist->caps + i * re->slots;
+            int step = 0;
+
+            if (inst->op == KA_RE_MATCH) {
+                // Lower priority threads are cut off
+                memcpy(re->match, caps, re->slots * sizeof(size_t));
+                matched = 1;
+                break;
+            } else if (inst->op == KA_RE_CHAR) {
+                step = c == inst->x;
+            } else if (inst->op == KA_RE_ANY) {
+                step = c >= 0 && c != '\n';
+            } else if (inst->op == KA_RE_SET) {
+                step = c >= 0 && (re->sets[inst->x][c >> 3] >> (c & 7)) & 1;
+            }
+
+            if (step) {
+                ka_re_add(re, nlist, clist->pcs[i] + 1, caps, pos + 1, length);
+            }
+        }
+
+        KaReList *swap = clist;
+        clist = nlist;
+        nlist = swap;
+
+        if (pos >= length) break;
+    }
+
+    return matched;
+}
+
+// Whole match followed by the groups, as pieces of the subject
+
+static inline KaNode *ka_re_groups(KaRegex *re, KaNode *subject)
+{
+    KaNode *result = ka_new(KA_LIST);
+    KaNode **last = &result->children;
+
+    for (int i = 0; i < re->slots; i += 2) {
+        size_t from = re->match[i], to = re->match[i + 1];
+
+        *last = (from == (size_t)-1 || to == (size_t)-1)
+            ? ka_new(KA_NONE)
+            : ka_substr(subject, from, to - from);
+        last = &(*last)->next;
+    }
+
+    return result;
+}
+
+// match text pattern: the first match and its groups, or none
+
+static inline KaNode *ka_match(KaNode **ctx, KaNode *args)
+{
+    if (!args || !args->next || args->type != KA_STRING ||
+        args->next->type != KA_STRING) {
+        ka_free(args);
+        return ka_new(KA_NONE);
+    }
+
+    KaRegex *re = ka_regex(args->next->string, args->next->length);
+    KaNode *result = (re && ka_re_exec(re, args->string, args->length, 0))
+        ? ka_re_groups(re, args)
+        : ka_new(KA_NONE);
+
+    ka_free(args);
+    return result;
+}
+
+// matchall text pattern: every match, as strings if the pattern has no
+// groups or as lists with the groups otherwise
+
+static inline KaNode *ka_matchall(KaNode **ctx, KaNode *args)
+{
+    if (!args || !args->next || args->type != KA_STRING ||
+        args->next->type != KA_STRING) {
+        ka_free(args);
+        return ka_new(KA_NONE);
+    }
+
+    KaRegex *re = ka_regex(args->next->string, args->next->length);
+
+    if (!re) {
+        ka_free(args);
+        return ka_new(KA_NONE);
+    }
+
+    KaNode *result = ka_new(KA_LIST);
+    KaNode **last = &result->children;
+
+    for (size_t start = 0; start <= args->length &&
+         ka_re_exec(re, args->string, args->length, start);) {
+        size_t from = re->match[0], to = re->match[1];
+
+        *last = (re->slots > 2)
+            ? ka_re_groups(re, args)
+            : ka_substr(args, from, to - from);
+        last = &(*last)->next;
+
+        // Step over empty matches so the search moves forward
+        start = (to > from) ? to : to + 1;
+    }
+
+    ka_free(args);
+    return result;
+}
+
+// Arithmetic operators
+
+static inline KaNode *ka_add(KaNode **ctx, KaNode *args)
+{
+    if (!args || !args->next) {
+        ka_free(args);
+        return ka_new(KA_NONE);
+    }
+
+    KaNode *left = args;
+    KaNode *right = args->next;
+    KaType ltype = left->type;
+    KaType rtype = right->type;
+
+    // Add numbers
+    if (ltype == KA_NUMBER && rtype == KA_NUMBER) {
+        long double lnum = *left->number;
+        long double rnum = *right->number;
+
+        ka_free(args);
+        return ka_number(lnum + rnum);
+    } else if (ltype == KA_LIST || rtype == KA_LIST) {
+        return ka_merge(ctx, args);
+    }
+
+    return ka_cat(ctx, args);
+}
+
+static inline KaNode *ka_sub(KaNode **ctx, KaNode *args)
+{
+    if (!args || !args->next) {
+        ka_free(args);
+        return ka_new(KA_NONE);
+    }
+
+    KaNode *left = args;
+    KaNode *right = args->next;
+
+    KaNode *result = (left->type == KA_NUMBER && right->type == KA_NUMBER)
+        ? ka_number(*left->number - *right->number)
+        : ka_new(KA_NONE);
+
+    ka_free(args);
+    return result;
+}
+
+static inline KaNode *ka_mul(KaNode **ctx, KaNode *args)
+{
+    if (!args || !args->next) {
+        ka_free(args);
+        return ka_new(KA_NONE);
+    }
+
+    KaNode *left = args;
+    KaNode *right = args->next;
+    KaType ltype = left->type;
+    KaType rtype = right->type;
+
+    // Multiply numbers
+    if (ltype == KA_NUMBER && rtype == KA_NUMBER) {
+        KaNode *result = (ltype == KA_NUMBER && rtype == KA_NUMBER)
+            ? ka_number(*left->number * *right->number)
+            : ka_new(KA_NONE);
+
+        ka_free(args);
+        return result;
+    } else if (ltype == KA_LIST && rtype == KA_BLOCK) {
+        return ka_for(ctx, args);
+    } else if (ltype == KA_LIST && rtype == KA_STRING) {
+        return ka_join(ctx, args);
+    }
+
+    ka_free(args);
+    return ka_new(KA_NONE);
+}
+
+static inline KaNode *ka_div(KaNode **ctx, KaNode *args)
+{
+    if (!args || !args->next) {
+        ka_free(args);
+        return ka_new(KA_NONE);
+    }
+
+    KaNode *left = args;
+    KaNode *right = args->next;
+    KaType ltype = left->type;
+    KaType rtype = right->type;
+
+    // Divide numbers
+    if (ltype == KA_NUMBER && rtype == KA_NUMBER) {
+        KaNode *result = (left->type == KA_NUMBER && right->type == KA_NUMBER)
+            ? ka_number(*left->number / *right->number)
+            : NULL;
+
+        ka_free(args);
+        return result;
+    } else if (ltype == KA_STRING && rtype == KA_STRING) {
+        return ka_split(ctx, args);
+    }
+
+    ka_free(args);
+    return ka_new(KA_NONE);
+}
+
+static inline KaNode *ka_mod(KaNode **ctx, KaNode *args)
+{
+    if (!args || !args->next) {
+        ka_free(args);
+        return ka_new(KA_NONE);
+    }
+
+    KaNode *left = args;
+    KaNode *right = args->next;
+
+    KaNode *result = (left->type == KA_NUMBER && right->type == KA_NUMBER)
+        ? ka_number((int)*left->number % (int)*right->number)
+        : ka_new(KA_NONE);
+
+    ka_free(args);
+    return result;
+}
+
+static inline KaNode *ka_addset(KaNode **ctx, KaNode *args)
+{
+    if (!args || !args->next) {
+        ka_free(args);
+        return ka_new(KA_NONE);
+    }
+
+    KaNode *node = args->key ? ka_ref(ctx, ka_symbol(args->key)) : NULL;
+
+    // Append to a string variable in place. Free the left operand first, it
+    // is a copy of the variable holding a reference to the same buffer.
+    if (node && node->type == KA_STRING && args->type == KA_STRING &&
+        node->length == args->length &&
+        (node->string == args->string || (node->flags & KA_INLINE &&
+         !memcmp(node->string, args->string, node->length)))) {
+        KaNode *right = args->next;
+        char buf[KA_NUMBER_SIZE];
+        size_t length;
+
+        args->next = NULL;
+        ka_free(args);
+
+        const char *str = ka_text(right, buf, &length);
+        int appended = ka_append(node, str, length);
+        ka_free(right);
+
+        return appended ? ka_copy(node) : ka_new(KA_NONE);
+    }
+
+    KaNode *symbol = ka_symbol(args->key);
+    return ka_set(ctx, ka_chain(symbol, ka_add(ctx, args), NULL));
+}
+
+static inline KaNode *ka_subset(KaNode **ctx, KaNode *args)
+{
+    if (!args || !args->next) {
+        ka_free(args);
+        return ka_new(KA_NONE);
+    }
+
+    KaNode *symbol = ka_symbol(args->key);
+    return ka_set(ctx, ka_chain(symbol, ka_sub(ctx, args), NULL));
+}
+
+static inline KaNode *ka_mulset(KaNode **ctx, KaNode *args)
+{
+    if (!args || !args->next) {
+        ka_free(args);
+        return ka_new(KA_NONE);
+    }
+
+    KaNode *symbol = ka_symbol(args->key);
+    return ka_set(ctx, ka_chain(symbol, ka_mul(ctx, args), NULL));
+}
+
+static inline KaNode *ka_divset(KaNode **ctx, KaNode *args)
+{
+    if (!args || !args->next) {
+        ka_free(args);
+        return ka_new(KA_NONE);
+    }
+
+    KaNode *symbol = ka_symbol(args->key);
+    return ka_set(ctx, ka_chain(symbol, ka_div(ctx, args), NULL));
+}
+
+static inline KaNode *ka_modset(KaNode **ctx, KaNode *args)
+{
+    if (!args || !args->next) {
+        ka_free(args);
+        return ka_new(KA_NONE);
+    }
+
+    KaNode *symbol = ka_symbol(args->key);
+    return ka_set(ctx, ka_chain(symbol, ka_mod(ctx, args), NULL));
+}
+
+// Just in time compiler. Build with -DKA_JIT on x86-64 to let while loops that
+// keep running finish as machine code. After KA_JIT_THRESHOLD turns, a loop
+// that only assigns numbers with =, computes with + - * / % and comparisons,
+// and nests while and if of the same kind is compiled and run natively. Names
+// are resolved when it is compiled: variables must hold numbers and operators
+// must be their builtins, otherwise it goes on in the interpreter. Nothing in
+// such a loop can change a type, so that check is enough. The code works on
+// the payloads of the variables in place, with long doubles on the x87 stack
+// as in C, so results do not change.
+
+#ifdef KA_JIT
+
+#define KA_JIT_STACK 8
+
+enum { KA_JIT_NONE, KA_JIT_VALUE, KA_JIT_TEST };
+
+typedef struct {
+    KaNode **ctx;
+    unsigned char *code;
+    size_t size, cap;
+    int depth;
+} KaJit;
+
+// Loops compiled so far, and room for the operands of %
+static size_t ka_jit_loops = 0;
+static int ka_jit_scratch[2];
+
+// Operators on the two topmost x87 registers. Comparisons leave their result
+// in al, and take their operands in the order that keeps NaN false.
+
+static const struct {
+    KaFunc func;
+    int kind;
+    int swap;
+    const char *code;
+} ka_jit_ops[] = {
+    // faddp, fsubp, fmulp, fdivp
+    { ka_add, KA_JIT_VALUE, 0, "\xDE\xC1" },
+    { ka_sub, KA_JIT_VALUE, 0, "\xDE\xE9" },
+    { ka_mul, KA_JIT_VALUE, 0, "\xDE\xC9" },
+    { ka_div, KA_JIT_VALUE, 0, "\xDE\xF9" },
+    // fisttp both to [rcx], idiv, fild the remainder
+    { ka_mod, KA_JIT_VALUE, 0,
+      "\xDB\x49\x04\xDB\x09\x8B\x01\x99\xF7\x79\x04\x89\x11\xDB\x01" },
+    // fcomip, fstp st0, then sete and setnp, setne or setp, seta, setae
+    { ka_eq,  KA_JIT_TEST, 0,
+      "\xDF\xF1\xDD\xD8\x0F\x94\xC0\x0F\x9B\xC1\x20\xC8" },
+    { ka_neq, KA_JIT_TEST, 0,
+      "\xDF\xF1\xDD\xD8\x0F\x95\xC0\x0F\x9A\xC1\x08\xC8" },
+    { ka_gt,  KA_JIT_TEST, 1, "\xDF\xF1\xDD\xD8\x0F\x97\xC0" },
+    { ka_lt,  KA_JIT_TEST, 0, "\xDF\xF1\xDD\xD8\x0F\x97\xC0" },
+    { ka_gte, KA_JIT_TEST, 1, "\xDF\xF1\xDD\xD8\x0F\x93\xC0" },
+    { ka_lte, KA_JIT_TEST, 0, "\xDF\xF1\xDD\xD8\x0F\x93\xC0" },
+};
+
+static inline void ka_jit_emit(KaJit *jit, const char *bytes, size_t size)
+{
+    if (jit->size + size > jit->cap) {
+        jit->cap = (jit->size + size) * 2;
+        jit->code = (unsigned char *)realloc(jit->code, jit->cap);
+    }
+
+    memcpy(jit->code + jit->size, bytes, size);
+    jit->size += size;
+}
+
+// mov rax or rcx, address
+
+static inline void ka_jit_address(KaJit *jit, int reg, const void *address)
+{
+    char bytes[10] = { 0x48, (char)(0xB8 + reg) };
+    uint64_t value = (uintptr_t)address;
+
+    memcpy(bytes + 2, &value, sizeof(value));
+    ka_jit_emit(jit, bytes, sizeof(bytes));
+}
+
+// Jump with a 32 bit offset, filled in by ka_jit_patch
+
+static inline size_t ka_jit_jump(KaJit *jit, const char *op, size_t size)
+{
+    ka_jit_emit(jit, op, size);
+    ka_jit_emit(jit, "\0\0\0\0", 4);
+    return jit->size - 4;
+}
+
+static inline void ka_jit_patch(KaJit *jit, size_t at, size_t target)
+{
+    int32_t offset = (int32_t)(target - (at + 4));
+    memcpy(jit->code + at, &offset, sizeof(offset));
+}
+
+// Builtin a name stands for
+
+static inline KaFunc ka_jit_func(KaJit *jit, KaNode *node)
+{
+    KaNode *ref = node->type == KA_SYMBOL
+        ? ka_ref(jit->ctx, ka_symbol(node->symbol))
+        : NULL;
+
+    return (ref && ref->type == KA_FUNC) ? ref->func : NULL;
+}
+
+static inline int ka_jit_list(KaJit *jit, KaNode *nodes);
+
+// Push a number, or set al for true and false
+
+static inline int ka_jit_expr(KaJit *jit, KaNode *node)
+{
+    KaNode *ref = node;
+
+    if (node->type == KA_EXPR) {
+        return ka_jit_list(jit, node->children);
+    } else if (node->type == KA_SYMBOL) {
+        ref = ka_ref(jit->ctx, ka_symbol(node->symbol));
+    }
+
+    if (!ref) {
+        return KA_JIT_NONE;
+    } else if (ref->type == KA_TRUE || ref->type == KA_FALSE) {
+        // mov al, 1 or 0
+        ka_jit_emit(jit, ref->type == KA_TRUE ? "\xB0\x01" : "\xB0\x00", 2);
+        return KA_JIT_TEST;
+    } else if (ref->type != KA_NUMBER || ++jit->depth > KA_JIT_STACK) {
+        return KA_JIT_NONE;
+    }
+
+    // fld tword [rax]
+    ka_jit_address(jit, 0, ref->number);
+    ka_jit_emit(jit, "\xDB\x28", 2);
+    return KA_JIT_VALUE;
+}
+
+static inline int ka_jit_op(KaJit *jit, KaNode *nodes)
+{
+    KaFunc func = ka_jit_func(jit, nodes);
+    KaNode *left = nodes->next, *right = left ? left->next : NULL;
+
+    if (!func || !right || right->next) return KA_JIT_NONE;
+
+    for (size_t i = 0; i < sizeof(ka_jit_ops) / sizeof(ka_jit_ops[0]); i++) {
+        int swap = ka_jit_ops[i].swap, kind = ka_jit_ops[i].kind;
+
+        if (ka_jit_ops[i].func != func) continue;
+
+        // fisttp came with SSE3
+        if ((func == ka_mod && !__builtin_cpu_supports("sse3")) ||
+            ka_jit_expr(jit, swap ? right : left) != KA_JIT_VALUE ||
+            ka_jit_expr(jit, swap ? left : right) != KA_JIT_VALUE) {
+            return KA_JIT_NONE;
+        }
+
+        if (func == ka_mod) ka_jit_address(jit, 1, ka_jit_scratch);
+
+        ka_jit_emit(jit, ka_jit_ops[i].code, strlen(ka_jit_ops[i].code));
+        jit->depth -= kind == KA_JIT_TEST ? 2 : 1;
+        return kind;
+    }
+
+    return KA_JIT_NONE;
+}
+
+// A list of nodes, as ka_eval takes it
+
+static inline int ka_jit_list(KaJit *jit, KaNode *nodes)
+{
+    if (!nodes) return KA_JIT_NONE;
+
+    return nodes->next ? ka_jit_op(jit, nodes) : ka_jit_expr(jit, nodes);
+}
+
+// Test a condition and jump if it is false. Any number is true.
+
+static inline size_t ka_jit_test(KaJit *jit, KaNode *nodes, int list)
+{
+    int kind = list ? ka_jit_list(jit, nodes) : ka_jit_expr(jit, nodes);
+
+    if (kind == KA_JIT_NONE) {
+        return 0;
+    } else if (kind == KA_JIT_VALUE) {
+        // fstp st0, mov al, 1
+        ka_jit_emit(jit, "\xDD\xD8\xB0\x01", 4);
+        jit->depth--;
+    }
+
+    // test al, al, jz
+    return ka_jit_jump(jit, "\x84\xC0\x0F\x84", 4);
+}
+
+static inline int ka_jit_block(KaJit *jit, KaNode *nodes);
+
+static inline int ka_jit_loop(KaJit *jit, KaNode *cond, KaNode *block)
+{
+    size_t top = jit->size, end = ka_jit_test(jit, cond, 1);
+
+    if (!end || !ka_jit_block(jit, block)) return 0;
+
+    // jmp
+    ka_jit_patch(jit, ka_jit_jump(jit, "\xE9", 1), top);
+    ka_jit_patch(jit, end, jit->size);
+    return 1;
+}
+
+// Conditions and blocks of an if, from the given condition on
+
+static inline int ka_jit_if(KaJit *jit, KaNode *cond)
+{
+    KaNode *block = cond->next;
+
+    if (!block) {
+        return cond->type == KA_BLOCK && ka_jit_block(jit, cond->children);
+    } else if (block->type != KA_BLOCK) {
+        return 0;
+    }
+
+    size_t next = ka_jit_test(jit, cond, 0), end = 0;
+
+    if (!next || !ka_jit_block(jit, block->children)) return 0;
+
+    if (block->next) end = ka_jit_jump(jit, "\xE9", 1);
+
+    ka_jit_patch(jit, next, jit->size);
+
+    if (block->next && !ka_jit_if(jit, block->next)) return 0;
+
+    if (end) ka_jit_patch(jit, end, jit->size);
+
+    return 1;
+}
+
+// Statements: = on a variable holding a number, while and if
+
+static inline int ka_jit_stmt(KaJit *jit, KaNode *nodes)
+{
+    if (!nodes) return 0;
+
+    KaFunc func = ka_jit_func(jit, nodes);
+    KaNode *first = nodes->next, *second = first ? first->next : NULL;
+
+    if (!first && nodes->type == KA_EXPR) {
+        return ka_jit_stmt(jit, nodes->children);
+    } else if (func == ka_set && first->type == KA_SYMBOL && second &&
+               !second->next) {
+        KaNode *node = ka_ref(jit->ctx, ka_symbol(first->symbol));
+
+        // Only inline numbers are changed in place by ka_assign
+        if (!node || node->type != KA_NUMBER || !(node->flags & KA_INLINE) ||
+            ka_jit_expr(jit, second) != KA_JIT_VALUE) {
+            return 0;
+        }
+
+        // fstp tword [rax]
+        ka_jit_address(jit, 0, node->number);
+        ka_jit_emit(jit, "\xDB\x38", 2);
+        jit->depth--;
+        node->flags |= KA_DIRTY;
+        return 1;
+    } else if (func == ka_while) {
+        return second && !second->next && second->type == KA_BLOCK &&
+               (first->type == KA_EXPR || first->type == KA_BLOCK) &&
+               ka_jit_loop(jit, first->children, second->children);
+    }
+
+    return func == ka_if && second && ka_jit_if(jit, first);
+}
+
+static inline int ka_jit_block(KaJit *jit, KaNode *nodes)
+{
+    for (KaNode *curr = nodes; curr; curr = curr->next) {
+        if (curr->type != KA_EXPR || !ka_jit_stmt(jit, curr->children)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Run the rest of a while loop as machine code, if it qualifies
+
+static inline int ka_jit_while(KaNode **ctx, KaNode *cond, KaNode *block)
+{
+    KaJit jit = { 0 };
+    void *code = MAP_FAILED;
+    int done = 0;
+
+    jit.ctx = ctx;
+
+    if ((cond->type == KA_EXPR || cond->type == KA_BLOCK) &&
+        ka_jit_loop(&jit, cond->children, block)) {
+        // ret
+        ka_jit_emit(&jit, "\xC3", 1);
+        code = mmap(NULL, jit.size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+
+    if (code != MAP_FAILED) {
+        memcpy(code, jit.code, jit.size);
+
+        if (!mprotect(code, jit.size, PROT_READ | PROT_EXEC)) {
+            void (*run)(void);
+
+            memcpy(&run, &code, sizeof(run));
+            run();
+            ka_jit_loops++;
+            done = 1;
+        }
+
+        munmap(code, jit.size);
+    }
+
+    free(jit.code);
+    return done;
+}
+
+#endif
+
+// Parser and Interpreter
+
+// Whether a value ends the evaluation of its list, as the result of return
+
+static inline int ka_returned(KaNode *node)
+{
+    static char *key = NULL;
+
+    if (!key) key = ka_intern("return");
+    return node->key == key;
+}
+
+// Act on an evaluated list: call the function it starts with, or the block
+// with the arguments that follow, or hand the values back as they are
+
+static inline KaNode *ka_apply(KaNode **ctx, KaNode *head)
+{
+    if (head->type == KA_FUNC) {
+        KA_ROOT(&head);
+        KaNode *result = head->func(ctx, head->next);
+        KA_UNROOT(1);
+        head->next = NULL;
+        ka_free(head);
+        return result;
+    } else if (head->type == KA_BLOCK && head->next) {
+        // Avoid deep recursion. Use loop functions (e.g., while, for) instead.
+        KaNode *blk_ctx = ka_chain(head->next, ka_new(KA_CTX), *ctx, NULL);
+        KA_ROOT(&head);
+        KaNode *blk_ret = ka_eval(&blk_ctx, head->children);
+        KA_UNROOT(1);
+
+        KaNode *result = ka_last(blk_ret);
+        ka_free(blk_ctx);
+        head->next = NULL;
+        ka_free(head);
+        return result;
+    }
+
+    return head;
+}
+
+static inline KaNode *ka_eval(KaNode **ctx, KaNode *nodes)
+{
+    KaNode *head = ka_new(KA_NONE);
+    KaNode *first = head;
+    KaNode *last = head;
+
+    if (!nodes) return head;
+
+    KA_ROOT(ctx);
+    KA_ROOT(&nodes);
+    KA_ROOT(&head);
+
+    // Evaluate expressions and resolve variables
+    for (KaNode *curr = nodes, *skip = NULL; curr; curr = curr->next) {
+        // Flagged node skip processing
+        if (curr == skip) {
+            last->next = ka_copy(curr);
+            last = last->next;
+            continue;
+        }
+        // Process node based on its type
+        if (curr->type == KA_SYMBOL) {
+            last->next = ka_get(ctx, ka_symbol(curr->symbol));
+            last = last->next;
+        } else if (curr->type == KA_LIST) {
+            last->next = ka_new(curr->type);
+            last = last->next;
+            last->key = curr->key;
+            last->children = ka_eval(ctx, curr->children);
+        } else if (curr->type == KA_EXPR) {
+            last->next = ka_eval(ctx, curr->children);
+            last = last->next;
+            if (ka_returned(last)) break;
+        } else {
+            last->next = ka_copy(curr);
+            last = last->next;
+        }
+        // Flag next node for special treatment
+        if (curr->next && curr->next->type == KA_SYMBOL &&
+            (last->func == ka_key ||
+             last->func == ka_def ||
+             last->func == ka_set ||
+             last->func == ka_del)) {
+            skip = curr->next; 
+        } else if (last->func == ka_while) {
+            skip = curr->next;
+        } else if (curr->next && last->func == ka_bind) {
+            skip = curr->next->next;
+        }
+    }
+
+    // Discard first head node
+    head = head->next;
+    first->next = NULL;
+    ka_free(first);
+
+    KaNode *result = ka_apply(ctx, head);
+
+    KA_UNROOT(3);
+    return result;
+}
+
+// Compiled programs. kamby -c lowers each list of nodes to the steps ka_eval
+// takes on it, with values held in arrays of temporaries, which these join
+// and apply. Variables the compiler keeps in C locals are set through them.
+
+static inline void ka_root_all(KaNode **values, int count)
+{
+    for (int i = 0; i < count; i++) {
+        KA_ROOT(&values[i]);
+    }
+}
+
+// Chain the values evaluated so far. Only the last one keeps what followed
+// it, the rest of the others is freed as ka_eval would drop it.
+
+static inline KaNode *ka_args(KaNode **values, int count)
+{
+    KaNode *result = NULL, *last = NULL;
+
+    for (int i = 0; i < count; i++) {
+        if (!values[i]) continue;
+
+        if (last) {
+            ka_free(last->next);
+            last->next = values[i];
+        } else {
+            result = values[i];
+        }
+
+        last = values[i];
+        values[i] = NULL;
+    }
+
+    return result;
+}
+
+// := and = on a variable in a local, which is NULL while it is undefined
+
+static inline KaNode *ka_local_def(KaNode **local, char *key, KaNode *args)
+{
+    if (!args) return ka_new(KA_NONE);
+
+    ka_free(*local);
+    *local = ka_claim(args);
+    (*local)->key = key;
+    (*local)->next = NULL;
+    ka_free(args);
+
+    KaType type = (*local)->type;
+
+    return (type == KA_FUNC || type == KA_BLOCK)
+        ? ka_new(KA_NONE)
+        : ka_share(*local);
+}
+
+static inline KaNode *ka_local_set(KaNode **local, char *key, KaNode *args)
+{
+    if (!args || !*local) {
+        return ka_local_def(local, key, args);
+    } else if (!args->type) {
+        ka_free(*local);
+        *local = NULL;
+        ka_free(args);
+        return ka_new(KA_NONE);
+    }
+
+    ka_assign(*local, ka_claim(args));
+    ka_free(args);
+
+    KaType type = (*local)->type;
+
+    return (type == KA_FUNC || type == KA_BLOCK)
+        ? ka_new(KA_NONE)
+        : ka_share(*local);
+}
+
+// Lexer. Source is a buffer of known length, read once from front to back.
+// Bytes are classified by table: names are made of word bytes, operators
+// start with an operator byte and go on while joining bytes follow.
+
+#define KA_LEX_DIGIT 0x01
+#define KA_LEX_WORD  0x02
+#define KA_LEX_OPER  0x04
+#define KA_LEX_JOIN  0x08
+
+static const unsigned char ka_lex[256] = {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // 0x00 - 0x07
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // 0x08 - 0x0f
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // 0x10 - 0x17
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // 0x18 - 0x1f
+    0x00, 0x0c, 0x04, 0x0c, 0x04, 0x0c, 0x0c, 0x04,  // SP ! " # $ % & '
+    0x04, 0x04, 0x0c, 0x0c, 0x04, 0x0c, 0x0c, 0x0c,  // ( ) * + , - . /
+    0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,  // 0 1 2 3 4 5 6 7
+    0x03, 0x03, 0x0c, 0x04, 0x0c, 0x0c, 0x0c, 0x0c,  // 8 9 : ; < = > ?
+    0x0c, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,  // @ A B C D E F G
+    0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,  // H I J K L M N O
+    0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,  // P Q R S T U V W
+    0x02, 0x02, 0x02, 0x04, 0x0c, 0x04, 0x0c, 0x0a,  // X Y Z [ \ ] ^ _
+    0x0c, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,  // ` a b c d e f g
+    0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,  // h i j k l m n o
+    0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,  // p q r s t u v w
+    0x02, 0x02, 0x02, 0x04, 0x0c, 0x04, 0x0c, 0x00,  // x y z { | } ~ DEL
+};
+
+typedef enum {
+    KA_TOKEN_END, KA_TOKEN_BREAK, KA_TOKEN_OPEN, KA_TOKEN_CLOSE,
+    KA_TOKEN_NUMBER, KA_TOKEN_STRING, KA_TOKEN_SYMBOL
+} KaTokenType;
+
+// Tokens point into the source. String tokens hold the bytes between quotes,
+// and escaped tells whether those contain a backslash.
+
+typedef struct {
+    KaTokenType type;
+    const char *text;
+    size_t length;
+    int escaped;
+} KaToken;
+
+// Lexer position in a buffer. When the buffer ends inside a comment or a
+// string, pending is the byte that would close it.
+
+typedef struct {
+    const char *text;
+    size_t length;
+    size_t pos;
+    char pending;
+} KaLexer;
+
+// First byte equal to a or b, or the end. With SSE2, sixteen bytes are
+// compared at a time. Otherwise eight are, as a word holding one of them has
+// a zero byte once xored with it.
+
+static inline const char *ka_scan(const char *str, const char *end,
+                                  char a, char b)
+{
+#ifdef __SSE2__
+    __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+
+    for (; end - str >= 16; str += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)str);
+        int mask = _mm_movemask_epi8(_mm_or_si128(
+            _mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb)
+        ));
+
+        if (mask) return str + __builtin_ctz(mask);
+    }
+#endif
+
+    uint64_t wa = KA_ONES * (unsigned char)a, wb = KA_ONES * (unsigned char)b;
+
+    for (; end - str >= 8; str += 8) {
+        uint64_t word, x, y;
+        memcpy(&word, str, 8);
+        x = word ^ wa;
+        y = word ^ wb;
+
+        if ((((x - KA_ONES) & ~x) | ((y - KA_ONES) & ~y)) & KA_HIGH) break;
+    }
+
+    while (str < end && *str != a && *str != b) str++;
+    return str;
+}
+
+static inline KaToken ka_token(KaLexer *lex)
+{
+    const char *text = lex->text;
+    size_t length = lex->length;
+
+    lex->pending = '\0';
+
+    while (lex->pos < length) {
+        size_t start = lex->pos++;
+        unsigned char c = text[start];
+        int next = (lex->pos < length) ? text[lex->pos] : '\0';
+        KaToken token = { KA_TOKEN_SYMBOL, text + start, 1, 0 };
+
+        if (c == '#' || (c == '/' && next == '/')) {
+            // The newline is left to end the statement
+            const char *end = (const char *)memchr(
+                text + lex->pos, '\n', length - lex->pos
+            );
+            lex->pos = end ? (size_t)(end - text) : length;
+            lex->pending = end ? '\0' : '\n';
+            continue;
+        } else if (c == '/' && next == '*') {
+            const char *end = ka_search(text + lex->pos, length - lex->pos,
+                                        "*/", 2);
+            lex->pos = end ? (size_t)(end - text) + 2 : length;
+            lex->pending = end ? '\0' : '/';
+            continue;
+        } else if (c == ';' || c == ',' || c == '\n') {
+            token.type = KA_TOKEN_BREAK;
+        } else if (c == '(' || c == '[' || c == '{') {
+            token.type = KA_TOKEN_OPEN;
+        } else if (c == ')' || c == ']' || c == '}') {
+            token.type = KA_TOKEN_CLOSE;
+        } else if (c == '\'' || c == '"') {
+            // Quotes are escaped by a backslash that is not escaped itself
+            while ((lex->pos = ka_scan(text + lex->pos, text + length,
+                                       c, '\\') - text) < length) {
+                if (text[lex->pos] == '\\') {
+                    token.escaped = 1;
+                } else if (text[lex->pos - 1] != '\\' ||
+                           text[lex->pos - 2] == '\\') {
+                    break;
+                }
+
+                lex->pos++;
+            }
+
+            token.type = KA_TOKEN_STRING;
+            token.text = text + start + 1;
+            token.length = lex->pos - start - 1;
+            lex->pending = (lex->pos < length) ? '\0' : c;
+            lex->pos += lex->pos < length;
+        } else if (ka_lex[c] & KA_LEX_DIGIT) {
+            while (lex->pos < length &&
+                   ((ka_lex[(unsigned char)text[lex->pos]] & KA_LEX_DIGIT) ||
+                    (text[lex->pos] == '.' && lex->pos + 1 < length &&
+                     (ka_lex[(unsigned char)text[lex->pos + 1]] &
+                      KA_LEX_DIGIT)))) {
+                lex->pos++;
+            }
+
+            token.type = KA_TOKEN_NUMBER;
+            token.length = lex->pos - start;
+        } else if (ka_lex[c] & (KA_LEX_OPER | KA_LEX_WORD)) {
+            int join = (ka_lex[c] & KA_LEX_OPER) ? KA_LEX_JOIN : KA_LEX_WORD;
+
+            while (lex->pos < length &&
+                   (ka_lex[(unsigned char)text[lex->pos]] & join)) {
+                lex->pos++;
+            }
+
+            token.length = lex->pos - start;
+        } else {
+            // Indentation is skipped eight spaces at a time
+            while (length - lex->pos >= 8 &&
+                   !memcmp(text + lex->pos, "        ", 8)) {
+                lex->pos += 8;
+            }
+
+            continue;
+        }
+
+        return token;
+    }
+
+    return (KaToken){ KA_TOKEN_END, text + length, 0, 0 };
+}
+
+// String literal. A backslash is dropped before the quote or a backslash.
+
+static inline KaNode *ka_literal(KaToken token)
+{
+    if (!token.escaped) return ka_stringn(token.text, token.length);
+
+    KaNode *node = ka_stralloc(KA_STRING, token.length);
+    char *value = node->string, quote = token.text[-1];
+
+    for (size_t i = 0; i < token.length; i++) {
+        if (token.text[i] != '\\' || i + 1 == token.length ||
+            (token.text[i + 1] != quote && token.text[i + 1] != '\\')) {
+            *value++ = token.text[i];
+        }
+    }
+
+    *value = '\0';
+    node->length = value - node->string;
+    return node;
+}
+
+// Operators. Prefix operators apply to the node right after them. Infix
+// operators are left associative and bind tighter the higher their
+// precedence. A leading operator is moved before its left operand instead,
+// which is how ? receives the condition as its first argument. Symbols that
+// are not in the table are assignments if they are = or an arithmetic
+// operator followed by =, and infix operators if they start with punctuation.
+
+typedef enum {
+    KA_OP_NONE, KA_OP_PREFIX, KA_OP_INFIX, KA_OP_LEADING
+} KaOpKind;
+
+enum { KA_PREC_ASSIGN = 1, KA_PREC_KEY, KA_PREC_INFIX, KA_PREC_BIND };
+
+typedef struct {
+    const char *symbol;
+    KaOpKind kind;
+    int precedence;
+} KaOperator;
+
+#define KA_MAX_OPERATORS 64
+
+static KaOperator ka_operators[KA_MAX_OPERATORS] = {
+    { "$", KA_OP_PREFIX,  0             },
+    { "!", KA_OP_PREFIX,  0             },
+    { ".", KA_OP_INFIX,   KA_PREC_BIND  },
+    { ":", KA_OP_INFIX,   KA_PREC_KEY   },
+    { "?", KA_OP_LEADING, KA_PREC_KEY   },
+};
+static int ka_operators_count = 5;
+
+// Add an operator, or change an existing one, for code parsed from now on.
+// Extensions call it from ka_extend(). Returns 0 if a table is full.
+
+static inline int ka_defop(const char *symbol, KaOpKind kind, int precedence)
+{
+    KaOperator *op = ka_operators;
+
+    while (op < ka_operators + ka_operators_count &&
+           strcmp(op->symbol, symbol)) {
+        op++;
+    }
+
+    char *key = ka_intern(symbol);
+
+    if (!key || op == ka_operators + KA_MAX_OPERATORS) return 0;
+    if (op == ka_operators + ka_operators_count) ka_operators_count++;
+
+    op->symbol = key;
+    op->kind = kind;
+    op->precedence = precedence;
+    return 1;
+}
+
+static inline KaOpKind ka_opkind(KaNode *node, int *precedence)
+{
+    if (!node || node->type != KA_SYMBOL) return KA_OP_NONE;
+
+    const char *sym = node->symbol;
+
+    for (int i = 0; i < ka_operators_count; i++) {
+        if (!strcmp(ka_operators[i].symbol, sym)) {
+            *precedence = ka_operators[i].precedence;
+            return ka_operators[i].kind;
+        }
+    }
+
+    *precedence = KA_PREC_INFIX;
+
+    if (!strcmp("=", sym) ||
+        (sym[0] && strchr("+-*/%:", sym[0]) && sym[1] == '=')) {
+        *precedence = KA_PREC_ASSIGN;
+    } else if (!ispunct((unsigned char)sym[0])) {
+        return KA_OP_NONE;
+    }
+
+    return KA_OP_INFIX;
+}
+
+static inline KaNode *ka_parse_block(KaLexer *lex);
+
+// Next node of a statement, or NULL once the statement has ended. The token
+// that ended it is left in end.
+
+static inline KaNode *ka_parse_node(KaLexer *lex, KaTokenType *end)
+{
+    KaToken token = ka_token(lex);
+    KaNode *node;
+
+    if (token.type == KA_TOKEN_OPEN) {
+        char c = token.text[0];
+        node = ka_new((c == '(') ? KA_EXPR : (c == '[') ? KA_LIST : KA_BLOCK);
+        node->children = ka_parse_block(lex);
+    } else if (token.type == KA_TOKEN_STRING) {
+        node = ka_literal(token);
+    } else if (token.type == KA_TOKEN_NUMBER) {
+        node = ka_number(ka_aton(token.text, token.length, NULL));
+    } else if (token.type == KA_TOKEN_SYMBOL) {
+        node = ka_symboln(token.text, token.length);
+    } else {
+        *end = token.type;
+        node = NULL;
+    }
+
+    return node;
+}
+
+// Nodes of a statement with one node of lookahead
+
+typedef struct {
+    KaLexer *lex;
+    KaNode *next;
+    KaTokenType end;
+} KaCursor;
+
+static inline KaNode *ka_take(KaCursor *cur)
+{
+    KaNode *node = cur->next;
+    cur->next = node ? ka_parse_node(cur->lex, &cur->end) : NULL;
+    return node;
+}
+
+static inline KaNode *ka_parse_operand(KaCursor *cur)
+{
+    int precedence;
+    KaNode *node = ka_take(cur);
+
+    if (ka_opkind(node, &precedence) != KA_OP_PREFIX) return node;
+
+    KaNode *expr = ka_new(KA_EXPR);
+    expr->children = node;
+    node->next = ka_take(cur);
+    return expr;
+}
+
+// Precedence climbing. Operands are single nodes, so an expression ends at
+// the first node that does not continue it.
+
+static inline KaNode *ka_parse_expr(KaCursor *cur, int min)
+{
+    KaNode *left = ka_parse_operand(cur);
+    int precedence;
+
+    while (ka_opkind(cur->next, &precedence) == KA_OP_INFIX &&
+           precedence >= min) {
+        KaNode *expr = ka_new(KA_EXPR);
+        expr->children = ka_take(cur);
+        expr->children->next = left;
+        left->next = cur->next ? ka_parse_expr(cur, precedence + 1) : NULL;
+        left = expr;
+    }
+
+    return left;
+}
+
+// Parse the expressions of a statement. Parsing starts from a placeholder
+// that is dropped at the end together with the first expression, so an
+// infix operator that opens a statement takes it as its left operand and is
+// discarded along with its right operand.
+
+static inline KaNode *ka_parse_statement(KaLexer *lex, KaTokenType *end)
+{
+    KaCursor cur = { lex, ka_new(KA_NONE), KA_TOKEN_END };
+    KaNode *head = NULL, **tail = &head, **link = &head;
+    int precedence;
+
+    while (cur.next) {
+        if (ka_opkind(cur.next, &precedence) == KA_OP_LEADING) {
+            KaNode *op = ka_take(&cur);
+            op->next = *link;
+            *link = op;
+            link = &op->next;
+        } else {
+            link = tail;
+            *tail = ka_parse_expr(&cur, 0);
+            tail = &(*tail)->next;
+        }
+    }
+
+    *end = cur.end;
+
+    KaNode *result = head->next;
+    head->next = NULL;
+    ka_free(head);
+    return result;
+}
+
+// operator symbol [precedence]: define an infix operator, or a prefix one if
+// no precedence is given
+
+static inline KaNode *ka_operator(KaNode **ctx, KaNode *args)
+{
+    if (!args || args->type != KA_STRING) {
+        ka_free(args);
+        return ka_new(KA_NONE);
+    }
+
+    ka_own(args);
+
+    if (args->next && args->next->type == KA_NUMBER) {
+        ka_defop(args->string, KA_OP_INFIX, *args->next->number);
+    } else {
+        ka_defop(args->string, KA_OP_PREFIX, 0);
+    }
+
+    ka_free(args);
+    return ka_new(KA_NONE);
+}
+
+// Parse statements up to the end of the source or a closing bracket
+
+static inline KaNode *ka_parse_block(KaLexer *lex)
+{
+    KaNode *head = NULL, **last = &head;
+    KaTokenType end;
+
+    do {
+        KaNode *children = ka_parse_statement(lex, &end);
+
+        if (children) {
+            *last = ka_new(KA_EXPR);
+            (*last)->children = children;
+            last = &(*last)->next;
+        }
+    } while (end == KA_TOKEN_BREAK);
+
+    return head;
+}
+
+// Parse length bytes of source from *pos, which is left past the last byte
+// read. Every statement becomes an expression node.
+
+static inline KaNode *ka_parse(const char *text, size_t length, size_t *pos)
+{
+    KaLexer lex = { text, length, *pos, '\0' };
+    KaNode *result = ka_parse_block(&lex);
+
+    *pos = lex.pos;
+    return result;
+}
+
+static inline KaNode *ka_parser(char *text, int *pos)
+{
+    size_t at = *pos;
+    KaNode *result = ka_parse(text, strlen(text), &at);
+
+    *pos = at;
+    return result;
+}
+
+// Streaming parser. Source is fed in chunks of any size and complete top
+// level statements come out as soon as they end, so a script read from a
+// pipe is parsed in linear time with memory bounded by its longest statement.
+// Lexing resumes where the last chunk stopped, and a string or comment still
+// open is only scanned again once a byte that may close it has arrived.
+
+typedef struct {
+    char *buf;
+    size_t length, cap;
+    size_t scan;
+    size_t checked;
+    char pending;
+    int depth;
+} KaStream;
+
+static inline void ka_stream_feed(KaStream *stream, const char *data,
+                                  size_t length)
+{
+    if (stream->length + length > stream->cap) {
+        stream->cap = (stream->length + length) * 2;
+        stream->buf = (char *)realloc(stream->buf, stream->cap);
+    }
+
+    memcpy(stream->buf + stream->length, data, length);
+    stream->length += length;
+}
+
+// Next complete statements, or NULL until more input is fed. At the end of
+// the input, eof takes whatever is left as complete.
+
+static inline KaNode *ka_stream_next(KaStream *stream, int eof)
+{
+    for (;;) {
+        char *buf = stream->buf;
+        size_t length = stream->length, end = 0;
+
+        if (!eof && stream->pending &&
+            !memchr(buf + stream->checked, stream->pending,
+                    length - stream->checked)) {
+            stream->checked = length;
+            return NULL;
+        }
+
+        KaLexer lex = { buf, length, stream->scan, '\0' };
+        stream->pending = '\0';
+
+        for (;;) {
+            size_t at = lex.pos;
+            KaToken token = ka_token(&lex);
+
+            // Names and numbers that reach the end may go on in the next
+            // chunk. Numbers also wait for the byte after a trailing dot.
+            size_t reach = lex.pos + (token.type == KA_TOKEN_NUMBER &&
+                                      lex.pos < length && buf[lex.pos] == '.');
+            int name = token.type == KA_TOKEN_NUMBER ||
+                       token.type == KA_TOKEN_SYMBOL;
+
+            if (!eof && (lex.pending || (name && reach >= length))) {
+                stream->scan = at;
+                stream->pending = lex.pending;
+                stream->checked = length;
+                break;
+            }
+
+            stream->scan = lex.pos;
+
+            if (token.type == KA_TOKEN_END) {
+                end = eof ? length : end;
+                break;
+            } else if (token.type == KA_TOKEN_OPEN) {
+                stream->depth++;
+            } else if (token.type == KA_TOKEN_CLOSE && stream->depth > 0) {
+                stream->depth--;
+            } else if (token.type == KA_TOKEN_CLOSE) {
+                // A stray closing bracket ends parsing of what comes before
+                end = lex.pos;
+                break;
+            } else if (token.type == KA_TOKEN_BREAK && !stream->depth) {
+                end = lex.pos;
+            }
+        }
+
+        if (!end) return NULL;
+        if (end == length) stream->depth = 0;
+
+        size_t pos = 0;
+        KaNode *result = ka_parse(buf, end, &pos);
+
+        memmove(buf, buf + end, length - end);
+        stream->length -= end;
+        stream->scan -= end;
+        stream->checked -= (stream->checked > end) ? end : stream->checked;
+
+        if (result) return result;
+    }
+}
+
+static inline void ka_stream_free(KaStream *stream)
+{
+    free(stream->buf);
+    memset(stream, 0, sizeof(KaStream));
+}
+
+// Precompiled scripts. A .kac file holds a parsed tree laid out as it is in
+// memory: a header, the nodes, then their numbers and a table of distinct
+// strings and keys, each in a KaBuf that is never released. Native functions
+// are stored by their registered name. Pointers are stored as offsets from
+// the start of the file. Loading maps the file privately and turns them back
+// into addresses in place, so no node is allocated. The mapping is kept for
+// the life of the process, since copies of its strings share their buffers.
+//
+// The layout depends on the build, which the header records along with a
+// hash of the source the tree was parsed from and one of the image itself.
+// The same format holds saved contexts, told apart by the kind of image.
+
+#define KA_CACHE_MAGIC "KAC"
+#define KA_CACHE_VERSION 2
+#define KA_IMAGE_SCRIPT 0
+#define KA_IMAGE_CONTEXT 1
+#define KA_CACHE_NODES ((sizeof(KaCacheHeader) + 15) & ~(size_t)15)
+#define KA_CACHE_PINNED ((size_t)1 << (sizeof(size_t) * 8 - 2))
+
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0
+#endif
+
+typedef struct KaCacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t node_size;
+    uint32_t number_size;
+    uint32_t kind;
+    uint64_t source_length;
+    uint64_t source_hash;
+    uint64_t hash;
+    uint64_t size;
+    uint64_t count;
+} KaCacheHeader;
+
+typedef struct KaCacheWriter {
+    char *image;
+    size_t size;
+    size_t cap;
+    size_t node;
+    size_t *strings;
+    size_t strings_cap;
+    size_t strings_count;
+} KaCacheWriter;
+
+// FNV-1a style hash over four interleaved words at a time, so that a check
+// of a large image runs near memory speed
+
+#define KA_FNV_BASIS 14695981039346656037ULL
+#define KA_FNV_PRIME 1099511628211ULL
+
+static inline uint64_t ka_checksum(const void *data, size_t length)
+{
+    const unsigned char *c = (const unsigned char *)data;
+    uint64_t lanes[4] = { KA_FNV_BASIS, KA_FNV_BASIS + 1,
+                          KA_FNV_BASIS + 2, KA_FNV_BASIS + 3 };
+    uint64_t hash = KA_FNV_BASIS ^ length, word;
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        for (int j = 0; j < 4; j++) {
+            memcpy(&word, c + i + j * 8, 8);
+            lanes[j] = (lanes[j] ^ word) * KA_FNV_PRIME;
+            lanes[j] ^= lanes[j] >> 29;
+        }
+    }
+
+    for (int j = 0; j < 4; j++) {
+        hash = (hash ^ lanes[j]) * KA_FNV_PRIME;
+    }
+
+    for (; i < length; i++) {
+        hash = (hash ^ c[i]) * KA_FNV_PRIME;
+    }
+
+    return hash ^ hash >> 32;
+}
+
+// Chains end at a context without a key, as in ka_free
+
+static inline size_t ka_cache_count(KaNode *nodes)
+{
+    size_t count = 0;
+
+    for (KaNode *node = nodes; node; node = node->next) {
+        if (node->type == KA_FUNC && !ka_native_name(node)) return 0;
+
+        if (node->type >= KA_LIST && node->children) {
+            size_t children = ka_cache_count(node->children);
+            if (!children) return 0;
+            count += children;
+        }
+
+        count++;
+
+        if (node->type == KA_CTX && !node->key) break;
+    }
+
+    return count;
+}
+
+static inline size_t ka_cache_data(KaCacheWriter *w, const void *data,
+                                   size_t length)
+{
+    size_t offset = (w->size + 15) & ~(size_t)15;
+
+    if (offset + length > w->cap) {
+        size_t cap = w->cap * 2 > offset + length ? w->cap * 2
+                                                  : offset + length;
+        w->image = (char *)realloc(w->image, cap);
+        memset(w->image + w->cap, 0, cap - w->cap);
+        w->cap = cap;
+    }
+
+    memcpy(w->image + offset, data, length);
+    w->size = offset + length;
+    return offset;
+}
+
+// Offset of the bytes of a string in the table, adding it when it is new
+
+static inline size_t ka_cache_string(KaCacheWriter *w, const char *str,
+                                     size_t length)
+{
+    if (w->strings_count * 2 >= w->strings_cap) {
+        size_t old_cap = w->strings_cap, *old = w->strings;
+
+        w->strings_cap = old_cap ? old_cap * 2 : 256;
+        w->strings = (size_t *)calloc(w->strings_cap, sizeof(size_t));
+
+        for (size_t i = 0; i < old_cap; i++) {
+            if (!old[i]) continue;
+
+            KaBuf *buf = KA_BUF(w->image + old[i]);
+            size_t j = ka_checksum(buf->data, buf->cap - 1) &
+                       (w->strings_cap - 1);
+            while (w->strings[j]) j = (j + 1) & (w->strings_cap - 1);
+            w->strings[j] = old[i];
+        }
+
+        free(old);
+    }
+
+    size_t mask = w->strings_cap - 1;
+
+    for (size_t i = ka_checksum(str, length) & mask;; i = (i + 1) & mask) {
+        if (!w->strings[i]) {
+            KaBuf buf = { KA_CACHE_PINNED, length + 1 };
+            size_t offset = ka_cache_data(w, &buf, sizeof(KaBuf));
+
+            ka_cache_data(w, str, length);
+            w->image[w->size++] = '\0';
+            w->strings_count++;
+            return w->strings[i] = offset + sizeof(KaBuf);
+        }
+
+        KaBuf *buf = KA_BUF(w->image + w->strings[i]);
+
+        if (buf->cap == length + 1 && !memcmp(buf->data, str, length)) {
+            return w->strings[i];
+        }
+    }
+}
+
+// Lay out a chain with its nodes next to each other, then their children
+
+static inline size_t ka_cache_chain(KaCacheWriter *w, KaNode *nodes)
+{
+    size_t first = w->node, at = first;
+
+    for (KaNode *node = nodes; node; node = node->next) {
+        w->node += sizeof(KaNode);
+        if (node->type == KA_CTX && !node->key) break;
+    }
+
+    for (KaNode *node = nodes; node; node = node->next) {
+        KaNode record;
+        int end = node->type == KA_CTX && !node->key;
+        size_t value = 0, key = 0;
+
+        memset(&record, 0, sizeof(KaNode));
+        record.type = node->type;
+
+        if (node->type == KA_NUMBER) {
+            record.flags = KA_INLINE;
+            value = ka_cache_data(w, node->number, sizeof(long double));
+        } else if (node->type == KA_STRING || node->type == KA_SYMBOL) {
+            record.length = node->length;
+            value = node->string
+                ? ka_cache_string(w, node->string, node->length)
+                : 0;
+        } else if (node->type == KA_FUNC) {
+            const char *name = ka_native_name(node);
+            record.length = strlen(name);
+            value = ka_cache_string(w, name, record.length);
+        } else if (node->type >= KA_LIST && node->children) {
+            value = ka_cache_chain(w, node->children);
+        }
+
+        if (node->key) key = ka_cache_string(w, node->key, strlen(node->key));
+
+        record.key = (char *)(uintptr_t)key;
+        record.value = (void *)(uintptr_t)value;
+        record.next = (KaNode *)(uintptr_t)(node->next && !end
+            ? at + sizeof(KaNode)
+            : 0);
+        memcpy(w->image + at, &record, sizeof(KaNode));
+        at += sizeof(KaNode);
+
+        if (end) break;
+    }
+
+    return first;
+}
+
+static inline int ka_cache_write(const char *path, KaNode *tree, int kind,
+                                 const char *source, size_t length)
+{
+    size_t count = ka_cache_count(tree);
+
+    if (tree && !count) return 0;
+
+    // Write a new file and move it in place. An image may still be mapped,
+    // and a mapping of a file rewritten in place would change under it.
+    char *temp = (char *)malloc(strlen(path) + 5);
+    sprintf(temp, "%s.tmp", path);
+    FILE *file = fopen(temp, "wb");
+
+    if (!file) {
+        free(temp);
+        return 0;
     }
 
-    // Discard first head node
-    head = head->next;
-    first->next = NULL;
-    ka_free(first);
+    KaCacheWriter w = { 0 };
+    KaCacheHeader header = {
+        .magic = KA_CACHE_MAGIC,
+        .version = KA_CACHE_VERSION,
+        .node_size = sizeof(KaNode),
+        .number_size = sizeof(long double),
+        .kind = kind,
+        .source_length = length,
+        .source_hash = ka_checksum(source, length),
+    };
 
-    // Take actions based on node type
-    if (head->type == KA_FUNC) {
-        KaNode *result = head->func(ctx, head->next);
-        head->next = NULL;
-        ka_free(head);
+    w.cap = KA_CACHE_NODES + count * sizeof(KaNode) * 2;
+    w.image = (char *)calloc(1, w.cap);
+    w.size = w.node = KA_CACHE_NODES;
+    w.size += count * sizeof(KaNode);
 
-        return result;
-    } else if (head->type == KA_BLOCK && head->next) {
-        // Avoid deep recursion. Use loop functions (e.g., while, for) instead.
-        KaNode *blk_ctx = ka_chain(head->next, ka_new(KA_CTX), *ctx, NULL);
-        KaNode *blk_ret = ka_eval(&blk_ctx, head->children);
-        KaNode *last_ret = NULL;
+    if (tree) ka_cache_chain(&w, tree);
 
-        for (last_ret = blk_ret; last_ret->next; last_ret = last_ret->next);
+    header.size = w.size;
+    header.count = count;
+    header.hash = ka_checksum(w.image + KA_CACHE_NODES,
+                              w.size - KA_CACHE_NODES);
+    memcpy(w.image, &header, sizeof(KaCacheHeader));
 
-        KaNode *result = ka_copy(last_ret);
-        ka_free(blk_ret);
-        ka_free(blk_ctx);
-        head->next = NULL;
-        ka_free(head);
+    int saved = fwrite(w.image, 1, w.size, file) == w.size;
 
-        return result;
-    }
+    saved = !fclose(file) && saved;
+    saved = saved && !rename(temp, path);
 
-    return head;
+    if (!saved) remove(temp);
+
+    free(temp);
+    free(w.image);
+    free(w.strings);
+    return saved;
 }
 
-static inline KaNode *ka_parser(char *text, int *pos)
+static inline int ka_cache_save(const char *path, KaNode *tree,
+                                const char *source, size_t length)
 {
-    KaNode *head = ka_new(KA_NONE);
-    KaNode *last = head;
-    int length = strlen(text);
+    return ka_cache_write(path, tree, KA_IMAGE_SCRIPT, source, length);
+}
 
-    // If at the initial position, use a negative position as a flag to wrap
-    // sentences, parsing each one as a separate expression node.
-    if (*pos == 0) {
-        --(*pos);
+// Check an image and turn its offsets into addresses. Offsets only point
+// forward, so a damaged file can not make a loop.
 
-        while (*pos < length) {
-            KaNode *children = ka_parser(text, pos);
+static inline KaNode *ka_cache_map(char *image, size_t size, int kind,
+                                   const char *source, size_t length)
+{
+    KaCacheHeader *header = (KaCacheHeader *)image;
+    size_t data = KA_CACHE_NODES + header->count * sizeof(KaNode);
+
+    if (memcmp(header->magic, KA_CACHE_MAGIC, 4) ||
+        header->version != KA_CACHE_VERSION ||
+        header->node_size != sizeof(KaNode) ||
+        header->number_size != sizeof(long double) ||
+        header->kind != (uint32_t)kind || header->size != size ||
+        header->count > size / sizeof(KaNode) ||
+        data > size ||
+        (source && (header->source_length != length ||
+                    header->source_hash != ka_checksum(source, length))) ||
+        header->hash != ka_checksum(image + KA_CACHE_NODES,
+                                    size - KA_CACHE_NODES)) {
+        return NULL;
+    }
 
-            if (children) {
-                last->next = ka_new(KA_EXPR);
-                last = last->next;
-                last->children = children;
-            }
+    for (size_t at = KA_CACHE_NODES; at < data; at += sizeof(KaNode)) {
+        KaNode *node = (KaNode *)(image + at);
+        size_t value = (uintptr_t)node->value, key = (uintptr_t)node->key;
+        size_t next = (uintptr_t)node->next;
+
+        if (node->type > KA_BLOCK ||
+            (node->type == KA_CTX && kind != KA_IMAGE_CONTEXT) ||
+            (next && (next <= at || next >= data ||
+                      (next - KA_CACHE_NODES) % sizeof(KaNode))) ||
+            (key && (key < data || !memchr(image + key, 0, size - key)))) {
+            return NULL;
+        }
 
-            if (strchr(")]}", text[*pos - 1])) {
-                length = 0;
+        if (node->type >= KA_LIST) {
+            if (value && (value <= at || value >= data ||
+                          (value - KA_CACHE_NODES) % sizeof(KaNode))) {
+                return NULL;
+            }
+        } else if (node->type == KA_NUMBER) {
+            if (value < data || value + sizeof(long double) > size) {
+                return NULL;
             }
+        } else if (node->type == KA_STRING || node->type == KA_SYMBOL ||
+                   node->type == KA_FUNC) {
+            if (value && (value < data + sizeof(KaBuf) ||
+                          node->length >= size - value ||
+                          image[value + node->length])) {
+                return NULL;
+            }
+        } else if (value) {
+            return NULL;
         }
-    }
 
-    // Parse each character, recognize types and create nodes.
-    // If position is negative, start at the beginning.
-    for (*pos = *pos < 0 ? 0 : *pos; *pos < length; (*pos)++) {
-        int start = *pos;
-        int childpos = 0;
-        char c = text[*pos];
-
-        if (c == '#' || (c == '/' && text[*pos + 1] == '/')) {
-            while (text[++(*pos)] != '\n');
-        } else if (c == '/' && text[*pos + 1] == '*') {
-            while (!(text[++(*pos)] == '*' && text[++(*pos)] == '/'));
-        } else if (strchr(";,)]}\n", c)) {
-            length = 0;
-        } else if (strchr("([{", c)) {
-            if (c == '(') last->next = ka_new(KA_EXPR);
-            else if (c == '[') last->next = ka_new(KA_LIST);
-            else if (c == '{') last->next = ka_new(KA_BLOCK);
-            last = last->next;
-            last->children = ka_parser(text + *pos + 1, &childpos);
-            *pos += childpos;
-        } else if (strchr("'\"", c)) {
-            while ((text[++(*pos)] != text[start]) ||
-                   (text[*pos - 1] == '\\' && text[*pos - 2] != '\\'));
+        node->key = key ? ka_intern(image + key) : NULL;
+        if (key && !node->key) return NULL;
 
-            last->next = ka_new(KA_STRING);
-            last = last->next;
-            last->string = strndup(text + start + 1, *pos - start - 1);
-            char *value = last->string;
+        node->value = value ? image + value : NULL;
+        node->next = next ? (KaNode *)(image + next) : NULL;
+        node->flags |= KA_STATIC;
 
-            for (char *str = value; *str; str++) {
-                if (*str != '\\' || (str[1] != text[start] && str[1] != '\\')) {
-                    *value++ = *str;
-                }
-            }
+        if (node->type == KA_FUNC) {
+            node->length = 0;
+            if (!value || !ka_native(node, image + value)) return NULL;
+        }
+    }
 
-            *value = '\0';
-        } else if (isdigit(c)) {
-            while (isdigit(text[*pos + 1]) ||
-                   (text[*pos + 1] == '.' && isdigit(text[*pos + 2]))) {
-                (*pos)++;
-            }
+    if (!header->count) return NULL;
+
+    KaImage *mapped = (KaImage *)malloc(sizeof(KaImage));
+    mapped->nodes = (KaNode *)(image + KA_CACHE_NODES);
+    mapped->count = header->count;
+    mapped->base = image;
+    mapped->size = size;
+    mapped->retired = 0;
+    mapped->next = ka_images;
+    ka_images = mapped;
+    return mapped->nodes;
+}
 
-            last->next = ka_number(strtold(text + start, NULL));
-            last = last->next;
-        } else if (isgraph(c)) {
-            while ((ispunct(c) && !strchr("_", c))
-                ? (ispunct(text[*pos + 1]) &&
-                   !strchr("$;,()[]{}'\"\n", text[*pos + 1]))
-                : (isalnum(text[*pos + 1]) || strchr("_", text[*pos + 1]))) {
-                (*pos)++;
-            }
+// Load a precompiled tree. With a source, the image must have been made
+// from it. Returns NULL when there is no usable image.
 
-            last->next = ka_new(KA_SYMBOL);
-            last = last->next;
-            last->symbol = strndup(text + start, *pos - start + 1);
-        }
+static inline KaNode *ka_cache_open(const char *path, int kind,
+                                    const char *source, size_t length)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) return NULL;
+
+    if (fstat(fd, &st) || (size_t)st.st_size < KA_CACHE_NODES) {
+        close(fd);
+        return NULL;
     }
 
-    // Reorder operators by precedence
-    for (int step = 1; step <= 5; step++) {
-        for (KaNode *prev = NULL, *a = head; a && a->next;) {
-            KaNode *op = a->next;
-            KaNode *b = op->next;
-            KaNode *next = b ? b->next : NULL;
-            KaNode *expr = NULL;
-            char *sym = (op->type == KA_SYMBOL) ? op->symbol : (char *)"";
-            int isunary = strchr("$!", sym[0]) && !sym[1];
-            int isassign = !strcmp("=", sym) || (
-                strchr("+-*/%:", sym[0]) && strchr("=", sym[1] ? sym[1] : ' ')
-            );
-            int iskey = !strcmp(":", sym);
-            int isbind = !strcmp(".", sym);
-            int isexpr = !strcmp("?", sym);
-            int ispunctuation = !isunary && !iskey && !isassign && !isbind &&
-                !isexpr && ispunct(sym[0]);
-
-            if (step == 1 && isunary) {
-                a->next = ka_new(KA_EXPR);
-                a->next->next = next;
-                a->next->children = op;
-
-                if (b) b->next = NULL;
-            } else if ((step == 2 && isbind) ||
-                       (step == 3 && ispunctuation) ||
-                       (step == 4 && iskey) ||
-                       (step == 5 && isassign)) {
-                expr = ka_new(KA_EXPR);
-                expr->next = next;
-
-                if (op) op->next = a;
-                if (a) a->next = b;
-                if (b) b->next = NULL;
-
-                expr->children = op;
-
-                if (prev) prev->next = expr;
-                else head = expr;
-
-                a = expr;
-            } else if (step == 4 && isexpr) {
-                op->next = a;
-                a->next  = b;
-
-                if (prev) prev->next = op;
-                else head = op;
-
-                a = op;
-            } else {
-                prev = a;
-                a = prev->next;
+    char *image = (char *)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+
+    if (image == MAP_FAILED) return NULL;
+
+    KaNode *tree = ka_cache_map(image, st.st_size, kind, source, length);
+    if (!tree) munmap(image, st.st_size);
+
+    return tree;
+}
+
+static inline KaNode *ka_cache_load(const char *path, const char *source,
+                                    size_t length)
+{
+    return ka_cache_open(path, KA_IMAGE_SCRIPT, source, length);
+}
+
+// Unmap the retired images whose strings are no longer shared. Copies of an
+// image string add to the pinned count of its buffer, the image nodes
+// themselves do not.
+
+static inline void ka_cache_sweep(void)
+{
+    for (KaImage **link = &ka_images; *link;) {
+        KaImage *image = *link;
+        size_t i = 0;
+
+        for (; image->retired && i < image->count; i++) {
+            KaNode *node = &image->nodes[i];
+
+            if ((node->type == KA_STRING || node->type == KA_SYMBOL) &&
+                node->string &&
+                KA_BUF(node->string)->refs != KA_CACHE_PINNED) {
+                break;
             }
         }
+
+        if (!image->retired || i < image->count) {
+            link = &image->next;
+            continue;
+        }
+
+        *link = image->next;
+        munmap(image->base, image->size);
+        free(image);
     }
+}
 
-    KaNode *result = head->next;
-    head->next = NULL;
-    ka_free(head);
-    return result;
+// Give up a mapped tree. Script trees are only read, so nothing outside the
+// image hangs from their nodes.
+
+static inline void ka_cache_close(KaImage *image)
+{
+    image->retired = 1;
+    ka_cache_sweep();
 }
 
 // I/O functions
 
+static inline KaNode *ka_precision(KaNode **ctx, KaNode *args)
+{
+    KaNode *result = ka_number(ka_decimals);
+
+    // Negative selects the shortest round trip, past the maximum is clamped
+    if (args && args->type == KA_NUMBER) {
+        long double decimals = *args->number;
+        ka_decimals = decimals < 0 ? -1
+            : decimals <= KA_MAX_DECIMALS ? (int)decimals : KA_MAX_DECIMALS;
+    }
+
+    ka_free(args);
+    return result;
+}
+
 static inline KaNode *ka_print(KaNode **ctx, KaNode *args)
 {
     for (KaNode *arg = args; arg != NULL; arg = arg->next) {
-        if (arg->type == KA_NUMBER && *arg->number == (long long)(*arg->number))
-            printf("%lld", (long long)(*arg->number));
-        else if (arg->type == KA_NUMBER)
-            printf("%.2Lf", *arg->number);
-        else if (arg->type == KA_STRING)
-            printf("%s", arg->string);
-        else if (arg->type == KA_LIST) {
+        if (arg->type == KA_NUMBER) {
+            char buf[KA_NUMBER_SIZE];
+            fwrite(buf, 1, ka_ntoa(buf, *arg->number, ka_decimals), stdout);
+        } else if (arg->type == KA_STRING) {
+            fwrite(arg->string, 1, arg->length, stdout);
+        } else if (arg->type == KA_LIST) {
             KaNode *copy = ka_copy(arg);
             ka_free(ka_print(ctx, copy->children));
             printf("\x1B[A");
@@ -1305,159 +4556,604 @@ static inline KaNode *ka_print(KaNode **ctx, KaNode *args)
 static inline KaNode *ka_input(KaNode **ctx, KaNode *args)
 {
     ka_free(args);
-    char input[8192], *end;
-    int r = scanf("%[^\n]", input);
+    char input[8192] = "";
+    int r = scanf("%8191[^\n]", input);
     getchar();
-    long double number = strtold(input, &end);
 
-    return (*end == '\0')
+    size_t length = strlen(input), used;
+    long double number = ka_aton(input, length, &used);
+
+    return (used == length)
         ? ka_number(number)
-        : ka_string(input);
+        : ka_stringn(input, length);
 }
 
+// Regular files from this size on are mapped instead of read, and their
+// string shares the pages of the file until it is freed. Writing the file
+// copies them first, but it should not be shrunk by other programs meanwhile,
+// reading past its new end would fault.
+
+#define KA_READ_MAP (64 * 1024)
+
 static inline KaNode *ka_read(KaNode **ctx, KaNode *args)
 {
-    FILE *file = args ? fopen(args->string, "r") : NULL;
+    ka_own(args);
+    FILE *file = args ? fopen(args->string, "rb") : NULL;
     ka_free(args);
 
     if (!file) return ka_new(KA_NONE);
 
+    struct stat st;
     size_t cap = 1024;
     size_t len = 0;
     size_t n;
-    char *buf = (char *)calloc(1, cap);
+    char *buf = NULL;
+
+    if (!fstat(fileno(file), &st) && S_ISREG(st.st_mode) &&
+        st.st_size >= KA_READ_MAP) {
+        if ((unsigned long long)st.st_size > KA_MAX_LENGTH) {
+            fclose(file);
+            return ka_new(KA_NONE);
+        }
+
+        len = st.st_size;
+        buf = ka_buf_map(fileno(file), &st);
+    }
+
+    // Pipes, small files and files that fail to map are read. Streams longer
+    // than a string can hold give none.
+    if (!buf) {
+        len = 0;
+        buf = ka_buf_new(cap);
+
+        while ((n = fread(buf + len, 1, cap - len, file)) > 0 &&
+               (len += n) == cap && len <= KA_MAX_LENGTH) {
+            cap *= 2;
+            buf = ka_buf_grow(buf, cap);
+        }
+
+        if (len > KA_MAX_LENGTH) {
+            ka_buf_release(buf);
+            fclose(file);
+            return ka_new(KA_NONE);
+        }
 
-    while ((n = fread(buf + len, 1, cap - len, file)) > 0 &&
-           (len += n) == cap) {
-        cap *= 2;
-        buf = (char *)realloc(buf, cap);
+        // Keep the buffer as the payload, the file may contain NUL bytes
+        buf = ka_buf_grow(buf, len + 1);
+        buf[len] = '\0';
     }
 
-    buf[len] = '\0';
-    KaNode *result = ka_string(buf);
+    KaNode *result = ka_new(KA_STRING);
+    result->string = buf;
+    result->length = len;
     fclose(file);
-    free(buf);
 
     return result;
 }
 
 static inline KaNode *ka_write(KaNode **ctx, KaNode *args)
 {
-    FILE *file = args ? fopen(args->string, "w") : NULL;
+    ka_own(args);
+
+    // Opening the file truncates it, strings mapped from it are copied first
+    if (args) ka_buf_unmap(args->string);
+
+    FILE *file = args ? fopen(args->string, "wb") : NULL;
 
     if (!file || !args->next) return ka_new(KA_NONE);
 
-    fputs(args->next->string, file);
+    if (args->next->type == KA_STRING) {
+        fwrite(args->next->string, 1, args->next->length, file);
+    }
+
     fclose(file);
     ka_free(args);
     return ka_new(KA_NONE);
 }
 
+// Modules
+
+static inline int ka_suffix(KaNode *node, const char *suffix)
+{
+    size_t length = strlen(suffix);
+
+    return node->length >= length &&
+           !memcmp(node->string + node->length - length, suffix, length);
+}
+
+// Libraries are closed along with the natives they registered. Functions of
+// a library kept in variables must not be called after it is reloaded.
+
+static inline void ka_module_free(KaModule *module)
+{
+    for (KaModule **link = &ka_module_list; *link; link = &(*link)->next) {
+        if (*link == module) {
+            *link = module->next;
+            break;
+        }
+    }
+
+    if (module->image) {
+        ka_cache_close(module->image);
+    } else {
+        ka_free(module->tree);
+    }
+
+    if (module->lib) {
+        size_t kept = 0;
+
+        for (size_t i = 0; i < ka_natives_count; i++) {
+            if (ka_natives[i].lib != module->lib) {
+                ka_natives[kept++] = ka_natives[i];
+            }
+        }
+
+        ka_natives_count = kept;
+        dlclose(module->lib);
+    }
+
+    free(module->path);
+    free(module);
+}
+
+// Free every module that is not running, at the end of a program. Running
+// ones are freed once they return.
+
+static inline void ka_module_clear(void)
+{
+    for (KaModule *module = ka_module_list, *next; module; module = next) {
+        next = module->next;
+        module->stale = 1;
+        if (!module->running) ka_module_free(module);
+    }
+
+    ka_cache_sweep();
+}
+
+// Find the module of a file, reading it again when the file changed since
+// it was loaded. Returns NULL when the file can not be loaded.
+
+static inline KaModule *ka_module(KaNode **ctx, KaNode *path)
+{
+    struct stat st;
+
+    if (stat(path->string, &st)) return NULL;
+
+    for (KaModule *module = ka_module_list; module; module = module->next) {
+        if (module->stale || module->dev != st.st_dev ||
+            module->ino != st.st_ino) {
+            continue;
+        }
+
+        if (module->size == st.st_size &&
+            module->mtime.tv_sec == st.st_mtim.tv_sec &&
+            module->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            ka_module_hits++;
+            return module;
+        }
+
+        // A module still running is freed once it returns
+        module->stale = 1;
+        if (!module->running) ka_module_free(module);
+        break;
+    }
+
+    KaModule *module = (KaModule *)calloc(1, sizeof(KaModule));
+    int loaded;
+
+    module->path = realpath(path->string, NULL);
+
+    // A file replaced by another one under the same path leaves its module.
+    // It goes first, so a library is opened again instead of reused.
+    for (KaModule *old = ka_module_list, *next; old; old = next) {
+        next = old->next;
+
+        if (!old->stale && old->path && module->path &&
+            !strcmp(old->path, module->path)) {
+            old->stale = 1;
+            if (!old->running) ka_module_free(old);
+        }
+    }
+
+    if (ka_suffix(path, ".so")) {
+        void *lib = dlopen(path->string, RTLD_NOW);
+        module->extend = lib
+            ? (void (*)(KaNode **))dlsym(lib, "ka_extend")
+            : NULL;
+
+        if (lib && !module->extend) dlclose(lib);
+        module->lib = module->extend ? lib : NULL;
+        loaded = module->extend != NULL;
+    } else if (ka_suffix(path, ".kac")) {
+        module->tree = ka_cache_load(path->string, NULL, 0);
+        module->image = module->tree ? ka_images : NULL;
+        loaded = module->tree != NULL;
+    } else {
+        size_t pos = 0;
+        KaNode *source = ka_read(ctx, ka_copy(path));
+        loaded = source->type == KA_STRING;
+
+        // Use the .kac image when it was made from this source
+        if (loaded && ka_suffix(path, ".ka")) {
+            KaNode *image = ka_copy(path);
+            ka_append(image, "c", 1);
+            module->tree = ka_cache_load(image->string, source->string,
+                                         source->length);
+            module->image = module->tree ? ka_images : NULL;
+            ka_free(image);
+        }
+
+        if (loaded && !module->tree) {
+            module->tree = ka_parse(source->string, source->length, &pos);
+        }
+
+        ka_free(source);
+    }
+
+    if (!loaded) {
+        free(module->path);
+        free(module);
+        return NULL;
+    }
+
+    module->dev = st.st_dev;
+    module->ino = st.st_ino;
+    module->size = st.st_size;
+    module->mtime = st.st_mtim;
+    module->next = ka_module_list;
+    ka_module_list = module;
+    ka_module_misses++;
+    return module;
+}
+
+// Scripts are parsed and libraries opened once, then run again from the
+// module on each load
+
 static inline KaNode *ka_load(KaNode **ctx, KaNode *args)
 {
     if (!args) return ka_new(KA_NONE);
 
-    // Load dynamic library
-    if (!strcmp(args->string + strlen(args->string) - 3, ".so")) {
-        void *lib = dlopen(args->string, RTLD_NOW);
-        ka_free(args);
+    ka_own(args);
+    KaModule *module = ka_module(ctx, args);
+    ka_free(args);
 
-        if (!lib) return ka_new(KA_NONE);
+    if (!module) return ka_new(KA_NONE);
 
-        typedef void (*ka_extend)(KaNode **);
-        ka_extend extend = (ka_extend)dlsym(lib, "ka_extend");
+    if (module->extend) {
+        ka_module_lib = module->lib;
+        module->extend(ctx);
+        ka_module_lib = NULL;
+        return ka_new(KA_NONE);
+    }
 
-        if (extend) extend(ctx);
-        else dlclose(lib);
+    module->running++;
+    KaNode *result = ka_eval(ctx, module->tree);
 
-        return ka_new(KA_NONE);
+    if (!--module->running && module->stale) ka_module_free(module);
+
+    return result;
+}
+
+static inline KaNode *ka_modules(KaNode **ctx, KaNode *args)
+{
+    KaNode *hits = ka_number(ka_module_hits);
+    KaNode *misses = ka_number(ka_module_misses);
+    KaNode *paths = ka_new(KA_LIST), **last = &paths->children;
+
+    for (KaModule *module = ka_module_list; module; module = module->next) {
+        if (module->stale) continue;
+
+        *last = ka_string(module->path ? module->path : "");
+        last = &(*last)->next;
     }
 
-    // Load and evaluate script file
-    int pos = 0;
-    KaNode *source = ka_read(ctx, ka_copy(args));
-    KaNode *expr = ka_parser(source->string, &pos);
-    KaNode *result = ka_eval(ctx, expr);
+    hits->key = ka_intern("hits");
+    misses->key = ka_intern("misses");
+    paths->key = ka_intern("paths");
 
-    ka_free(expr);
-    ka_free(source);
     ka_free(args);
-    return result;
+    return ka_list(hits, misses, paths, NULL);
+}
+
+// Built-in functions and default values. Native functions are known by the
+// name they have here, or the one they were registered with, which is how
+// saved images refer to them.
+
+// Functions also keep the name of their C function, which compiled programs
+// call directly
+
+#define KA_BUILTIN(sym, fn) \
+    { .key = sym, .type = KA_FUNC, .func = fn, .name = #fn }
+
+static const struct {
+    const char *key;
+    KaType type;
+    KaFunc func;
+    const char *name;
+} ka_builtins[] = {
+    // Default values
+    { .key = "true",  .type = KA_TRUE  },
+    { .key = "false", .type = KA_FALSE },
+    { .key = "else",  .type = KA_TRUE  },
+    // Variables
+    KA_BUILTIN(":",      ka_key),
+    KA_BUILTIN("$",      ka_get),
+    KA_BUILTIN(":=",     ka_def),
+    KA_BUILTIN("=",      ka_set),
+    KA_BUILTIN(".",      ka_bind),
+    KA_BUILTIN("del",    ka_del),
+    KA_BUILTIN("get",    ka_get),
+    KA_BUILTIN("def",    ka_def),
+    KA_BUILTIN("set",    ka_set),
+    KA_BUILTIN("return", ka_return),
+    // Logical operators
+    KA_BUILTIN("&&", ka_and),
+    KA_BUILTIN("||", ka_or),
+    KA_BUILTIN("!",  ka_not),
+    // Comparison operators
+    KA_BUILTIN("==", ka_eq),
+    KA_BUILTIN("!=", ka_neq),
+    KA_BUILTIN(">",  ka_gt),
+    KA_BUILTIN("<",  ka_lt),
+    KA_BUILTIN(">=", ka_gte),
+    KA_BUILTIN("<=", ka_lte),
+    // Conditional, lists and loops
+    KA_BUILTIN("?",     ka_if),
+    KA_BUILTIN("..",    ka_range),
+    KA_BUILTIN("if",    ka_if),
+    KA_BUILTIN("while", ka_while),
+    KA_BUILTIN("for",   ka_for),
+    // Arithmetic operators
+    KA_BUILTIN("+",  ka_add),
+    KA_BUILTIN("-",  ka_sub),
+    KA_BUILTIN("*",  ka_mul),
+    KA_BUILTIN("/",  ka_div),
+    KA_BUILTIN("%",  ka_mod),
+    KA_BUILTIN("+=", ka_addset),
+    KA_BUILTIN("-=", ka_subset),
+    KA_BUILTIN("*=", ka_mulset),
+    KA_BUILTIN("/=", ka_divset),
+    KA_BUILTIN("%=", ka_modset),
+    // String and list functions
+    KA_BUILTIN("split",      ka_split),
+    KA_BUILTIN("join",       ka_join),
+    KA_BUILTIN("find",       ka_find),
+    KA_BUILTIN("contains",   ka_contains),
+    KA_BUILTIN("startswith", ka_startswith),
+    KA_BUILTIN("endswith",   ka_endswith),
+    KA_BUILTIN("replace",    ka_replace),
+    KA_BUILTIN("length",     ka_length),
+    KA_BUILTIN("slice",      ka_slice),
+    KA_BUILTIN("upper",      ka_upper),
+    KA_BUILTIN("lower",      ka_lower),
+    KA_BUILTIN("trim",       ka_trim),
+    KA_BUILTIN("isdigit",    ka_isdigit),
+    KA_BUILTIN("isalpha",    ka_isalpha),
+    KA_BUILTIN("isspace",    ka_isspace),
+    KA_BUILTIN("match",      ka_match),
+    KA_BUILTIN("matchall",   ka_matchall),
+    // I/O
+    KA_BUILTIN("print",     ka_print),
+    KA_BUILTIN("precision", ka_precision),
+    KA_BUILTIN("input",     ka_input),
+    KA_BUILTIN("read",      ka_read),
+    KA_BUILTIN("write",     ka_write),
+    KA_BUILTIN("load",      ka_load),
+    KA_BUILTIN("modules",   ka_modules),
+    // Parser
+    KA_BUILTIN("operator",  ka_operator),
+};
+
+#define KA_BUILTINS (sizeof(ka_builtins) / sizeof(ka_builtins[0]))
+
+// Register a native function from an extension, so images can save it
+
+static inline void ka_register(const char *name, KaFunc func)
+{
+    const char *key = ka_intern(name);
+    size_t i = 0;
+
+    if (!key) return;
+
+    // Loading a library again registers its natives again
+    while (i < ka_natives_count && ka_natives[i].name != key) i++;
+
+    if (i == ka_natives_count) {
+        ka_natives = (KaNative *)realloc(ka_natives, (ka_natives_count + 1) *
+                                                     sizeof(KaNative));
+        ka_natives_count++;
+    }
+
+    ka_natives[i].name = key;
+    ka_natives[i].func = func;
+    ka_natives[i].lib = ka_module_lib;
+}
+
+static inline const char *ka_native_name(KaNode *node)
+{
+    for (size_t i = 0; i < KA_BUILTINS; i++) {
+        if (ka_builtins[i].func && ka_builtins[i].func == node->func) {
+            return ka_builtins[i].key;
+        }
+    }
+
+    for (size_t i = 0; i < ka_natives_count; i++) {
+        if (ka_natives[i].func == node->func) return ka_natives[i].name;
+    }
+
+    return NULL;
+}
+
+static inline int ka_native(KaNode *node, const char *name)
+{
+    for (size_t i = 0; i < KA_BUILTINS; i++) {
+        if (ka_builtins[i].func && !strcmp(ka_builtins[i].key, name)) {
+            node->func = ka_builtins[i].func;
+            return 1;
+        }
+    }
+
+    for (size_t i = 0; i < ka_natives_count; i++) {
+        if (!strcmp(ka_natives[i].name, name)) {
+            node->func = ka_natives[i].func;
+            return 1;
+        }
+    }
+
+    return 0;
 }
 
 // Initialize context with built-in functions
 
 static inline KaNode *ka_init()
 {
-    const KaNode kv[] = {
-        // Default values
-        { .key = (char *)"true",  .value = ka_true()  },
-        { .key = (char *)"false", .value = ka_false() },
-        { .key = (char *)"else",  .value = ka_true()  },
-        // Variables
-        { .key = (char *)":",      .value = ka_func(ka_key)    },
-        { .key = (char *)"$",      .value = ka_func(ka_get)    },
-        { .key = (char *)":=",     .value = ka_func(ka_def)    },
-        { .key = (char *)"=",      .value = ka_func(ka_set)    },
-        { .key = (char *)".",      .value = ka_func(ka_bind)   },
-        { .key = (char *)"del",    .value = ka_func(ka_del)    },
-        { .key = (char *)"get",    .value = ka_func(ka_get)    },
-        { .key = (char *)"def",    .value = ka_func(ka_def)    },
-        { .key = (char *)"set",    .value = ka_func(ka_set)    },
-        { .key = (char *)"return", .value = ka_func(ka_return) },
-        // Logical operators
-        { .key = (char *)"&&", .value = ka_func(ka_and) },
-        { .key = (char *)"||", .value = ka_func(ka_or)  },
-        { .key = (char *)"!",  .value = ka_func(ka_not) },
-        // Comparison operators
-        { .key = (char *)"==", .value = ka_func(ka_eq)  },
-        { .key = (char *)"!=", .value = ka_func(ka_neq) },
-        { .key = (char *)">",  .value = ka_func(ka_gt)  },
-        { .key = (char *)"<",  .value = ka_func(ka_lt)  },
-        { .key = (char *)">=", .value = ka_func(ka_gte) },
-        { .key = (char *)"<=", .value = ka_func(ka_lte) },
-        // Conditional, lists and loops
-        { .key = (char *)"?",     .value = ka_func(ka_if)    },
-        { .key = (char *)"..",    .value = ka_func(ka_range) },
-        { .key = (char *)"if",    .value = ka_func(ka_if)    },
-        { .key = (char *)"while", .value = ka_func(ka_while) },
-        { .key = (char *)"for",   .value = ka_func(ka_for)   },
-        // Arithmetic operators
-        { .key = (char *)"+",  .value = ka_func(ka_add)    },
-        { .key = (char *)"-",  .value = ka_func(ka_sub)    },
-        { .key = (char *)"*",  .value = ka_func(ka_mul)    },
-        { .key = (char *)"/",  .value = ka_func(ka_div)    },
-        { .key = (char *)"%",  .value = ka_func(ka_mod)    },
-        { .key = (char *)"+=", .value = ka_func(ka_addset) },
-        { .key = (char *)"-=", .value = ka_func(ka_subset) },
-        { .key = (char *)"*=", .value = ka_func(ka_mulset) },
-        { .key = (char *)"/=", .value = ka_func(ka_divset) },
-        { .key = (char *)"%=", .value = ka_func(ka_modset) },
-        // String and list functions
-        { .key = (char *)"split",  .value = ka_func(ka_split)  },
-        { .key = (char *)"join",   .value = ka_func(ka_join)   },
-        { .key = (char *)"length", .value = ka_func(ka_length) },
-        { .key = (char *)"upper",  .value = ka_func(ka_upper)  },
-        { .key = (char *)"lower",  .value = ka_func(ka_lower)  },
-        // I/O
-        { .key = (char *)"print", .value = ka_func(ka_print) },
-        { .key = (char *)"input", .value = ka_func(ka_input) },
-        { .key = (char *)"read",  .value = ka_func(ka_read)  },
-        { .key = (char *)"write", .value = ka_func(ka_write) },
-        { .key = (char *)"load",  .value = ka_func(ka_load)  },
-    };
 
+    // Keys are interned once, after that each entry is a single allocation
+    static char *keys[KA_BUILTINS];
     KaNode *init = ka_new(KA_CTX);
     KaNode *ctx = ka_new(KA_CTX);
-    ctx->key = strdup("(ctx)");
+    ctx->key = ka_intern("(ctx)");
+
+    for (size_t i = 0; i < KA_BUILTINS; i++) {
+        KaNode *node = ka_new(ka_builtins[i].type);
 
-    for (int i = 0; i < sizeof(kv) / sizeof(KaNode); i++) {
-        ka_free(
-            ka_def(&init, ka_chain(ka_symbol(kv[i].key), kv[i].value, NULL))
-       );
+        if (!keys[i]) keys[i] = ka_intern(ka_builtins[i].key);
+
+        node->key = keys[i];
+        node->func = ka_builtins[i].func;
+        node->next = init;
+        init = node;
     }
 
     return ka_chain(ctx, init, NULL);
 }
 
+// Copy a context down to the end of its chain, for a new interpreter that
+// starts from a prepared one, preludes included. Values are copied as by
+// ka_copy, so strings share their buffers with the original.
+
+static inline KaNode *ka_clone(KaNode *ctx)
+{
+    KaNode *result = NULL, **last = &result;
+
+    for (KaNode *node = ctx; node; node = node->next) {
+        *last = ka_copy(node);
+        last = &(*last)->next;
+
+        if (node->type == KA_CTX && !node->key) break;
+    }
+
+    return result ? result : ka_new(KA_NONE);
+}
+
+// Checkpoints. Mark the state of a context, say after its prelude, and roll
+// it back there after each use: what was defined since is freed, and what
+// was changed, deleted or appended to is restored. A context takes one
+// checkpoint at a time, which must be freed before the context is.
+
+static inline KaCheckpoint *ka_checkpoint(KaNode *ctx)
+{
+    KaCheckpoint *cp = (KaCheckpoint *)calloc(1, sizeof(KaCheckpoint));
+    size_t cap = 0;
+
+    for (KaNode *node = ctx; node; node = node->next) {
+        if (cp->count == cap) {
+            cap = cap ? cap * 2 : 64;
+            cp->nodes = (KaNode **)realloc(cp->nodes, cap * sizeof(KaNode *));
+            cp->saved = (KaNode **)realloc(cp->saved, cap * sizeof(KaNode *));
+        }
+
+        node->flags = (node->flags & ~KA_DIRTY) | KA_KEEP;
+        cp->nodes[cp->count] = node;
+        cp->saved[cp->count++] = ka_copy(node);
+
+        if (node->type == KA_CTX && !node->key) break;
+    }
+
+    cp->next = ka_checkpoints;
+    ka_checkpoints = cp;
+    return cp;
+}
+
+static inline void ka_rollback(KaNode **ctx, KaCheckpoint *cp)
+{
+    if (!cp->count) return;
+
+    KaNode *end = cp->nodes[cp->count - 1];
+
+    for (KaNode *node = *ctx, *next; node && node != end; node = next) {
+        next = node->next;
+
+        if (!(node->flags & KA_KEEP)) {
+            node->next = NULL;
+            ka_free(node);
+        }
+    }
+
+    for (size_t i = 0; i < cp->count; i++) {
+        KaNode *node = cp->nodes[i];
+
+        if (node->flags & KA_DIRTY) {
+            ka_assign(node, ka_copy(cp->saved[i]));
+            node->key = cp->saved[i]->key;
+            node->flags &= ~KA_DIRTY;
+        }
+
+        if (node != end) node->next = cp->nodes[i + 1];
+    }
+
+    *ctx = cp->nodes[0];
+}
+
+// Release a checkpoint, leaving the context as it is. Kept nodes that were
+// deleted since are freed now.
+
+static inline void ka_checkpoint_free(KaNode *ctx, KaCheckpoint *cp)
+{
+    KaNode *end = cp->count ? cp->nodes[cp->count - 1] : NULL;
+
+    for (KaNode *node = ctx; node; node = node->next) {
+        node->flags &= ~KA_KEEP;
+        if (node == end) break;
+    }
+
+    for (size_t i = 0; i < cp->count; i++) {
+        if (cp->nodes[i]->flags & KA_KEEP) {
+            cp->nodes[i]->flags &= ~KA_KEEP;
+            ka_free(cp->nodes[i]);
+        }
+
+        ka_free(cp->saved[i]);
+    }
+
+    for (KaCheckpoint **link = &ka_checkpoints; *link;
+         link = &(*link)->next) {
+        if (*link == cp) {
+            *link = cp->next;
+            break;
+        }
+    }
+
+    free(cp->nodes);
+    free(cp->saved);
+    free(cp);
+}
+
+// Save a context to a file, down to the end of its chain, and map it back
+// later instead of computing it again. Values, keyed lists and blocks are
+// kept as they are, native functions by their registered name. The nodes of
+// a restored context stay in the mapping and are never freed, but can be
+// changed, deleted or shadowed like any other.
+
+static inline int ka_context_save(const char *path, KaNode *ctx)
+{
+    return ctx && ka_cache_write(path, ctx, KA_IMAGE_CONTEXT, NULL, 0);
+}
+
+static inline KaNode *ka_context_load(const char *path)
+{
+    return ka_cache_open(path, KA_IMAGE_CONTEXT, NULL, 0);
+}
+
+
 #endif
@@ -67,6 +67,40 @@ void test_new()
     ka_free(node);
 }
 
+void test_intern()
+{
+    char key[] = "name";
+    char *interned = ka_intern(key);
+
+    assert(interned != key);
+    assert(!strcmp(interned, "name"));
+    assert(ka_intern("name") == interned);
+    assert(ka_intern(interned) == interned);
+    assert(ka_intern("other") != interned);
+    assert(ka_intern(NULL) == NULL);
+
+    // A full table still finds known keys, and defining a new name fails
+    KaNode *ctx = ka_new(KA_CTX), *result;
+    size_t count = ka_keys_count;
+
+    ka_keys_count = KA_MAX_KEYS;
+    assert(ka_intern("name") == interned);
+    assert(ka_intern("a key never seen before") == NULL);
+
+    result = ka_def(&ctx, ka_chain(
+        ka_symbol("a name never seen before"), ka_number(1), NULL
+    ));
+    assert(result->type == KA_NONE && ctx->type == KA_CTX);
+    ka_free(result);
+
+    result = ka_def(&ctx, ka_chain(ka_symbol("name"), ka_number(1), NULL));
+    assert(ctx->key == interned && *result->number == 1);
+    ka_free(result);
+
+    ka_keys_count = count;
+    ka_free(ctx);
+}
+
 void test_chain()
 {
     KaNode *node = ka_chain(
@@ -108,6 +142,7 @@ void test_number()
     KaNode *node = ka_number(42);
 
     assert(node->type == KA_NUMBER);
+    assert(node->flags & KA_INLINE);
     assert(node->key == NULL);
     assert(*node->number == 42);
     assert(node->next == NULL);
@@ -122,9 +157,24 @@ void test_string()
     assert(node->type == KA_STRING);
     assert(node->key == NULL);
     assert(!strcmp(node->string, "Hello"));
+    assert(node->length == 5);
     assert(node->next == NULL);
 
     ka_free(node);
+
+    node = ka_stringn("a\0b", 3);
+    assert(node->length == 3);
+    assert(!memcmp(node->string, "a\0b", 4));
+    assert(node->flags & KA_INLINE);
+    assert(node->string == KA_PAYLOAD(node));
+
+    ka_free(node);
+
+    node = ka_string("A string longer than sixteen bytes");
+    assert(node->length == 34);
+    assert(!(node->flags & KA_INLINE));
+
+    ka_free(node);
 }
 
 void test_symbol()
@@ -134,6 +184,7 @@ void test_symbol()
     assert(node->type == KA_SYMBOL);
     assert(node->key == NULL);
     assert(!strcmp(node->symbol, "sum"));
+    assert(node->length == 3 && (node->flags & KA_INLINE));
     assert(node->next == NULL);
 
     ka_free(node);
@@ -180,6 +231,16 @@ void test_copy()
     );
     assert(!list_copy->children->next->next->next);
 
+    KaNode *text = ka_string("A string longer than sixteen bytes");
+    KaNode *text_copy = ka_copy(text);
+    assert(text_copy->string == text->string);
+    assert(KA_BUF(text->string)->refs == 2);
+    ka_free(text_copy);
+#ifndef KA_GC
+    assert(KA_BUF(text->string)->refs == 1);
+#endif
+    ka_free(text);
+
     ka_free(list_copy);
     ka_free(third_copy);
     ka_free(second_copy);
@@ -187,6 +248,75 @@ void test_copy()
     ka_free(list);
 }
 
+void test_assign()
+{
+    KaNode *node = ka_number(1);
+    long double *number = node->number;
+
+    ka_assign(node, ka_number(2));
+    assert(node->number == number && *node->number == 2);
+
+    ka_assign(node, ka_string("John"));
+    assert(node->type == KA_STRING && !strcmp(node->string, "John"));
+    assert(node->length == 4 && !(node->flags & KA_INLINE));
+
+    ka_assign(node, ka_number(3));
+    assert(node->type == KA_NUMBER && !(node->flags & KA_INLINE));
+    assert(*node->number == 3);
+
+    ka_assign(node, ka_list(ka_number(4), NULL));
+    assert(node->type == KA_LIST && *node->children->number == 4);
+
+    ka_free(node);
+}
+
+void test_ntoa()
+{
+    char buf[KA_NUMBER_SIZE];
+
+    assert(ka_ntoa(buf, 42, 2) == 2 && !strcmp(buf, "42"));
+    assert(ka_ntoa(buf, -7, 2) == 2 && !strcmp(buf, "-7"));
+    assert(ka_ntoa(buf, 10.123, 2) == 5 && !strcmp(buf, "10.12"));
+    assert(ka_ntoa(buf, -0.005, 1) == 4 && !strcmp(buf, "-0.0"));
+    assert(ka_ntoa(buf, 1.5, 0) == 1 && !strcmp(buf, "2"));
+    assert(ka_ntoa(buf, 2.5, 0) == 1 && !strcmp(buf, "2"));
+    assert(ka_ntoa(buf, 0.1L, -1) == 3 && !strcmp(buf, "0.1"));
+    assert(ka_ntoa(buf, 1e30L, -1) == 5 && !strcmp(buf, "1e+30"));
+    assert(strtold(buf, NULL) == 1e30L);
+
+    // Integers print without decimals in the range of long long, larger
+    // magnitudes keep fixed decimals
+    assert(ka_ntoa(buf, 1e18L, 2) == 19 &&
+           !strcmp(buf, "1000000000000000000"));
+    assert(ka_ntoa(buf, -ldexpl(1, 62), 2) == 20 &&
+           !strcmp(buf, "-4611686018427387904"));
+    assert(ka_ntoa(buf, ldexpl(1, 100), 2) == 34 &&
+           !strcmp(buf, "1267650600228229401496703205376.00"));
+    assert(ka_ntoa(buf, -1e19L, 1) == 23 &&
+           !strcmp(buf, "-10000000000000000000.0"));
+    assert(ka_ntoa(buf, LDBL_MAX, KA_MAX_DECIMALS) ==
+           LDBL_MAX_10_EXP + KA_MAX_DECIMALS + 2);
+
+    // Precisions past the exact divisor go through printf
+    assert(ka_ntoa(buf, 0.00001L, 20) == 22 &&
+           !strcmp(buf, "0.00001000000000000000"));
+    assert(ka_ntoa(buf, 0.5L, 100) == KA_MAX_DECIMALS + 2);
+}
+
+void test_aton()
+{
+    size_t used;
+
+    assert(ka_aton("42", 2, &used) == 42 && used == 2);
+    assert(ka_aton("-3.25", 5, &used) == -3.25 && used == 5);
+    assert(ka_aton("0.1", 3, &used) == 0.1L && used == 3);
+    assert(ka_aton("12 apples", 9, &used) == 12 && used == 2);
+    assert(ka_aton("12.5", 2, &used) == 12 && used == 2);
+    assert(ka_aton("1e3", 3, &used) == 1000 && used == 3);
+    assert(ka_aton("apples", 6, &used) == 0 && used == 0);
+    assert(ka_aton("", 0, NULL) == 0);
+}
+
 void test_children()
 {
     KaNode *list = ka_list(ka_number(1), ka_number(2), NULL);
@@ -440,6 +570,19 @@ void test_bind()
     assert(*result->number == 2);
     ka_free(result);
 
+    // Strings are indexed by byte position
+    result = ka_bind(&ctx, ka_chain(ka_string("John"), ka_number(1), NULL));
+    assert(result->type == KA_STRING && !strcmp(result->string, "o"));
+    ka_free(result);
+
+    result = ka_bind(&ctx, ka_chain(ka_string("John"), ka_number(-1), NULL));
+    assert(!strcmp(result->string, "n"));
+    ka_free(result);
+
+    result = ka_bind(&ctx, ka_chain(ka_string("John"), ka_number(4), NULL));
+    assert(result->type == KA_NONE);
+    ka_free(result);
+
     ka_free(list);
     ka_free(ctx);
 }
@@ -535,6 +678,18 @@ void test_comparison()
     );
     assert(result->type == KA_FALSE);
     ka_free(result);
+
+    result = ka_eq(NULL,
+        ka_chain(ka_stringn("a\0b", 3), ka_stringn("a\0c", 3), NULL)
+    );
+    assert(result->type == KA_FALSE);
+    ka_free(result);
+
+    result = ka_eq(NULL,
+        ka_chain(ka_stringn("a\0b", 3), ka_stringn("a\0b", 3), NULL)
+    );
+    assert(result->type == KA_TRUE);
+    ka_free(result);
     
     result = ka_eq(NULL, ka_chain(
         ka_string("Hello"), ka_string("Hello"), NULL)
@@ -850,6 +1005,70 @@ void test_cat()
     ));
     assert(!strcmp(result->string, "Float10.12"));
     ka_free(result);
+
+    result = ka_cat(NULL, ka_chain(
+        ka_stringn("a\0", 2), ka_stringn("\0b", 2), NULL
+    ));
+    assert(result->length == 4);
+    assert(!memcmp(result->string, "a\0\0b", 5));
+    ka_free(result);
+}
+
+void test_append()
+{
+    KaNode *ctx = ka_new(KA_CTX), *result;
+
+    result = ka_string("ab");
+    ka_append(result, "cd", 2);
+    assert(result->length == 4 && !strcmp(result->string, "abcd"));
+    assert(!(result->flags & KA_INLINE));
+    assert(KA_BUF(result->string)->cap >= 5);
+    ka_free(result);
+
+    // A shared buffer is copied before appending
+    KaNode *text = ka_string("A string longer than sixteen bytes");
+    result = ka_copy(text);
+    ka_append(result, "!", 1);
+    assert(result->string != text->string);
+    assert(text->length == 34 && result->length == 35);
+    ka_free(result);
+
+    // Strings never pass KA_MAX_LENGTH, the length would wrap
+    text->length = KA_MAX_LENGTH;
+    assert(!ka_append(text, "!", 1) && text->length == KA_MAX_LENGTH);
+    result = ka_cat(NULL, ka_chain(text, ka_string("!"), NULL));
+    assert(result->type == KA_NONE);
+    ka_free(result);
+
+    text = ka_string("A string longer than sixteen bytes");
+    text->length = KA_MAX_LENGTH;
+    result = ka_cat(NULL, ka_chain(ka_string("!"), text, NULL));
+    assert(result->type == KA_NONE);
+    ka_free(result);
+
+    // Appending to a variable grows its buffer in place
+    ka_free(ka_def(&ctx, ka_chain(ka_symbol("s"), ka_string(""), NULL)));
+
+    for (int i = 0; i < 1000; i++) {
+        result = ka_get(&ctx, ka_symbol("s"));
+        result->key = ctx->key;
+        ka_free(ka_addset(&ctx, ka_chain(result, ka_string("ab"), NULL)));
+    }
+
+    assert(ctx->length == 2000);
+    assert(!strncmp(ctx->string, "ababab", 6));
+
+    result = ka_get(&ctx, ka_symbol("s"));
+    result->key = ctx->key;
+    result = ka_addset(&ctx, ka_chain(result, ka_number(1), NULL));
+    assert(result->length == 2001 && result->string[2000] == '1');
+#ifndef KA_GC
+    // Without a collector, released copies give the buffer back right away
+    assert(result->string == ctx->string);
+#endif
+    ka_free(result);
+
+    ka_free(ctx);
 }
 
 void test_split()
@@ -876,6 +1095,87 @@ void test_split()
     assert(!strcmp(result->children->next->next->string, "e"));
     assert(!result->children->next->next->next);
     ka_free(result);
+
+    result = ka_split(NULL, ka_chain(
+        ka_stringn("a\0b,,c", 6), ka_string(","), NULL
+    ));
+    assert(result->children->length == 3);
+    assert(!memcmp(result->children->string, "a\0b", 3));
+    assert(!strcmp(result->children->next->string, "c"));
+    assert(!result->children->next->next);
+    ka_free(result);
+
+    // Separators are matched as a whole, empty pieces are kept on request
+    result = ka_split(NULL, ka_chain(
+        ka_string("a::b:c::::d::"), ka_string("::"), ka_true(), NULL
+    ));
+    assert(!strcmp(result->children->string, "a"));
+    assert(!strcmp(result->children->next->string, "b:c"));
+    assert(result->children->next->next->length == 0);
+    assert(!strcmp(result->children->next->next->next->string, "d"));
+    assert(result->children->next->next->next->next->length == 0);
+    assert(!result->children->next->next->next->next->next);
+    ka_free(result);
+
+    result = ka_split(NULL, ka_chain(
+        ka_string("a::b:c::::d::"), ka_string("::"), NULL
+    ));
+    assert(!strcmp(result->children->next->next->string, "d"));
+    assert(!result->children->next->next->next);
+    ka_free(result);
+
+    result = ka_split(NULL, ka_chain(ka_number(1), ka_string(","), NULL));
+    assert(result->type == KA_NONE);
+    ka_free(result);
+}
+
+void test_view()
+{
+    KaNode *ctx = ka_new(KA_CTX), *result;
+    KaNode *line = ka_string(
+        "2024-01-01T00:00:00 INFO a message long enough to share"
+    );
+
+    // Long pieces point into the split string and keep its buffer alive
+    result = ka_split(NULL, ka_chain(ka_copy(line), ka_string(" "), NULL));
+    KaNode *stamp = result->children;
+    KaNode *level = stamp->next;
+
+    assert(stamp->flags & KA_VIEW && stamp->string == line->string);
+    assert(stamp->length == 19 && !memcmp(stamp->string, line->string, 19));
+    assert(level->flags & KA_INLINE && !strcmp(level->string, "INFO"));
+#ifndef KA_GC
+    assert(KA_BUF(line->string)->refs == 2);
+#endif
+
+    KaNode *copy = ka_copy(stamp);
+    assert(copy->flags & KA_VIEW && copy->string == stamp->string);
+
+    // Changing a view gives it a buffer of its own
+    ka_append(copy, "Z", 1);
+    assert(!(copy->flags & KA_VIEW) && copy->string != stamp->string);
+    assert(!strcmp(copy->string, "2024-01-01T00:00:00Z"));
+    ka_free(copy);
+
+    copy = ka_copy(stamp);
+    ka_own(copy);
+    assert(!(copy->flags & KA_VIEW));
+    assert(!strcmp(copy->string, "2024-01-01T00:00:00"));
+    ka_free(copy);
+
+    // Assigning over an existing variable moves the view to its own buffer
+    ka_free(ka_def(&ctx, ka_chain(ka_symbol("t"), ka_copy(stamp), NULL)));
+    assert(ctx->flags & KA_VIEW);
+    ka_free(ka_set(&ctx, ka_chain(ka_symbol("t"), ka_copy(stamp), NULL)));
+    assert(!(ctx->flags & KA_VIEW));
+    assert(!strcmp(ctx->string, "2024-01-01T00:00:00"));
+
+    ka_free(result);
+#ifndef KA_GC
+    assert(KA_BUF(line->string)->refs == 1);
+#endif
+    ka_free(line);
+    ka_free(ctx);
 }
 
 void test_join()
@@ -897,7 +1197,36 @@ void test_join()
         ka_string("-"),
         NULL
     ));
-    assert(!strcmp(result->string, "John-Doe"));
+    assert(!strcmp(result->string, "John-12-Doe"));
+    assert(result->length == 11);
+    ka_free(result);
+
+    result = ka_join(NULL, ka_chain(
+        ka_list(ka_number(1.5), ka_true(), ka_number(-2), NULL),
+        ka_string(", "),
+        NULL
+    ));
+    assert(!strcmp(result->string, "1.50, , -2"));
+    assert(result->length == 10 && result->flags & KA_INLINE);
+    ka_free(result);
+
+    // Numbers are sized by their text, not the widest they could be
+    result = ka_join(NULL, ka_chain(
+        ka_list(ka_number(1), ka_number(22), ka_number(333),
+                ka_number(4444), ka_number(55555), NULL),
+        ka_string(" "),
+        NULL
+    ));
+    assert(!strcmp(result->string, "1 22 333 4444 55555"));
+    assert(KA_BUF(result->string)->cap == result->length + 1);
+    ka_free(result);
+
+    result = ka_join(NULL, ka_chain(
+        ka_list(ka_stringn("a\0", 2), ka_string("b"), NULL),
+        ka_string(""),
+        NULL
+    ));
+    assert(result->length == 3 && !memcmp(result->string, "a\0b", 4));
     ka_free(result);
 
     result = ka_join(NULL, ka_chain(
@@ -909,160 +1238,608 @@ void test_join()
     ka_free(result);
 }
 
-void test_length()
+void test_find()
 {
     KaNode *ctx = ka_new(KA_CTX), *result;
 
-    result = ka_length(&ctx, ka_string(""));
+    ka_free(ka_find(&ctx, NULL));
+    ka_free(ka_startswith(&ctx, NULL));
+    ka_free(ka_endswith(&ctx, NULL));
+
+    result = ka_find(&ctx, ka_chain(
+        ka_string("one two one"), ka_string("one"), NULL
+    ));
     assert(*result->number == 0);
     ka_free(result);
 
-    result = ka_length(&ctx, ka_string("John Doe"));
+    result = ka_find(&ctx, ka_chain(
+        ka_string("one two one"), ka_string("one"), ka_number(1), NULL
+    ));
     assert(*result->number == 8);
     ka_free(result);
 
-    result = ka_length(&ctx, ka_list(NULL));
-    assert(*result->number == 0);
+    result = ka_find(&ctx, ka_chain(
+        ka_string("one two one"), ka_string("three"), NULL
+    ));
+    assert(result->type == KA_NONE);
     ka_free(result);
 
-    result = ka_length(&ctx, ka_list(ka_number(1), ka_string("John"), NULL));
-    assert(*result->number == 2);
+    result = ka_find(&ctx, ka_chain(
+        ka_stringn("a\0b\0c", 5), ka_stringn("\0c", 2), NULL
+    ));
+    assert(*result->number == 3);
     ka_free(result);
 
-    result = ka_length(&ctx, ka_block(ka_number(1), ka_string("John"), NULL));
-    assert(*result->number == 0);
-    ka_free(result);
+    // Long patterns use Two-Way, including periodic ones and near misses
+    char text[300], pattern[60];
+    memset(text, 'a', sizeof(text));
+    memset(pattern, 'a', sizeof(pattern));
+    pattern[sizeof(pattern) - 1] = 'b';
 
-    result = ka_length(&ctx, ka_number(1));
-    assert(*result->number == 0);
+    result = ka_find(&ctx, ka_chain(
+        ka_stringn(text, sizeof(text)),
+        ka_stringn(pattern, sizeof(pattern)), NULL
+    ));
+    assert(result->type == KA_NONE);
     ka_free(result);
 
-    ka_free(ctx);
-}
-
-void test_upperlower()
-{
-    KaNode *ctx = ka_new(KA_CTX), *result;
-
-    ka_free(ka_upper(&ctx, NULL));
-    result = ka_upper(&ctx, ka_string("John Doe"));
-    assert(!strcmp(result->string, "JOHN DOE"));
+    text[250] = 'b';
+    result = ka_find(&ctx, ka_chain(
+        ka_stringn(text, sizeof(text)),
+        ka_stringn(pattern, sizeof(pattern)), NULL
+    ));
+    assert(*result->number == 250 - sizeof(pattern) + 1);
     ka_free(result);
 
-    ka_free(ka_lower(&ctx, NULL));
-    result = ka_lower(&ctx, ka_string("John Doe"));
-    assert(!strcmp(result->string, "john doe"));
+    result = ka_find(&ctx, ka_chain(
+        ka_string("xabcabcabcabcabcabcabd abcabcabcabcabcabcabcabd"),
+        ka_string("abcabcabcabcabcabcabd"), NULL
+    ));
+    assert(*result->number == 1);
     ka_free(result);
 
-    ka_free(ctx);
-}
-
-void test_arithmetic()
-{
-    KaNode *ctx = ka_new(KA_CTX), *result;
-
-    ka_free(ka_add(&ctx, NULL));
-    result = ka_add(NULL, ka_chain(ka_number(3), ka_number(2), NULL));
-    assert(*result->number == 5);
+    result = ka_find(&ctx, ka_chain(
+        ka_string("the quick brown fox jumps over the lazy dog"),
+        ka_string("fox jumps over the lazy cat"), NULL
+    ));
+    assert(result->type == KA_NONE);
     ka_free(result);
 
-    ka_free(ka_sub(&ctx, NULL));
-    result = ka_sub(NULL, ka_chain(ka_number(3), ka_number(2), NULL));
-    assert(*result->number == 1);
+    result = ka_contains(&ctx, ka_chain(
+        ka_string("one two"), ka_string("e t"), NULL
+    ));
+    assert(result->type == KA_TRUE);
     ka_free(result);
 
-    ka_free(ka_mul(&ctx, NULL));
-    result = ka_mul(NULL, ka_chain(ka_number(3), ka_number(2), NULL));
-    assert(*result->number == 6);
+    result = ka_contains(&ctx, ka_chain(
+        ka_string("one two"), ka_string("ot"), NULL
+    ));
+    assert(result->type == KA_FALSE);
     ka_free(result);
 
-    ka_free(ka_div(&ctx, NULL));
-    result = ka_div(NULL, ka_chain(ka_number(3), ka_number(2), NULL));
-    assert(*result->number == 1.5);
+    result = ka_startswith(&ctx, ka_chain(
+        ka_string("one two"), ka_string("one"), NULL
+    ));
+    assert(result->type == KA_TRUE);
     ka_free(result);
 
-    ka_free(ka_mod(&ctx, NULL));
-    result = ka_mod(NULL, ka_chain(ka_number(3), ka_number(2), NULL));
-    assert(*result->number == 1);
+    result = ka_startswith(&ctx, ka_chain(
+        ka_string("one"), ka_string("one two"), NULL
+    ));
+    assert(result->type == KA_FALSE);
     ka_free(result);
 
-    result = ka_add(NULL, ka_chain(
-        ka_number(2), ka_string("Message"), NULL
+    result = ka_endswith(&ctx, ka_chain(
+        ka_string("one two"), ka_string("two"), NULL
     ));
-    assert(!strcmp(result->string, "2Message"));
+    assert(result->type == KA_TRUE);
     ka_free(result);
 
-    result = ka_add(NULL, ka_chain(
-        ka_string("Hello"), ka_string("World"), NULL
+    result = ka_endswith(&ctx, ka_chain(
+        ka_string("one two"), ka_string("one"), NULL
     ));
-    assert(!strcmp(result->string, "HelloWorld"));
+    assert(result->type == KA_FALSE);
     ka_free(result);
 
-    result = ka_add(NULL, ka_chain(
-        ka_string("Ten"), ka_number(10), NULL
+    ka_free(ctx);
+}
+
+void test_replace()
+{
+    KaNode *ctx = ka_new(KA_CTX), *result;
+
+    ka_free(ka_replace(&ctx, NULL));
+
+    result = ka_replace(&ctx, ka_chain(
+        ka_string("a-b-c"), ka_string("-"), ka_string(" + "), NULL
     ));
-    assert(!strcmp(result->string, "Ten10"));
+    assert(!strcmp(result->string, "a + b + c") && result->length == 9);
     ka_free(result);
 
-    result = ka_add(NULL, ka_chain(
-        ka_string("Float"), ka_number(10.123), NULL
+    result = ka_replace(&ctx, ka_chain(
+        ka_string("a-b-c"), ka_string("-"), ka_string(""), ka_number(1), NULL
     ));
-    assert(!strcmp(result->string, "Float10.12"));
+    assert(!strcmp(result->string, "ab-c"));
     ka_free(result);
 
-    result = ka_add(NULL, ka_chain(
-        ka_list(ka_number(1), NULL),
-        ka_list(ka_number(2), NULL),
-        NULL
+    result = ka_replace(&ctx, ka_chain(
+        ka_string("total: N items"), ka_string("N"), ka_number(3), NULL
     ));
-    assert(result->type == KA_LIST);
-    assert(*result->children->number == 1);
-    assert(*result->children->next->number == 2);
+    assert(!strcmp(result->string, "total: 3 items"));
     ka_free(result);
 
-    result = ka_add(NULL, ka_chain(
-        ka_list(ka_number(3), NULL),
-        ka_number(4),
-        NULL
+    result = ka_replace(&ctx, ka_chain(
+        ka_string("aaaa"), ka_string("aa"), ka_string("b"), NULL
     ));
-    assert(result->type == KA_LIST);
-    assert(*result->children->number == 3);
-    assert(*result->children->next->number == 4);
+    assert(!strcmp(result->string, "bb"));
     ka_free(result);
 
-    result = ka_add(NULL, ka_chain(
-        ka_number(4),
-        ka_list(ka_number(3), NULL),
-        NULL
+    result = ka_replace(&ctx, ka_chain(
+        ka_string("abc"), ka_string(""), ka_string("x"), NULL
     ));
-    assert(result->type == KA_LIST);
-    assert(*result->children->number == 4);
-    assert(*result->children->next->number == 3);
+    assert(!strcmp(result->string, "abc"));
     ka_free(result);
 
-    result = ka_mul(NULL, ka_chain(ka_string("John"), ka_number(2), NULL));
+    result = ka_replace(&ctx, ka_chain(
+        ka_string("abc"), ka_string("d"), NULL
+    ));
     assert(result->type == KA_NONE);
     ka_free(result);
 
-    KaNode *list = ka_list(ka_number(1), ka_number(2), NULL);
-    KaNode *block = ka_block(ka_symbol("0"), NULL);
+    ka_free(ctx);
+}
 
-    result = ka_mul(&ctx, ka_chain(list, block, NULL));
-    assert(*result->children->number == 1);
-    assert(*result->children->next->number == 2);
-    ka_free(result);
+void test_length()
+{
+    KaNode *ctx = ka_new(KA_CTX), *result;
 
-    result = ka_mul(NULL, ka_chain(
-        ka_list(ka_string("John"), ka_string("Doe"), NULL),
-        ka_string("-"),
-        NULL
-    ));
-    assert(result->type == KA_STRING);
-    assert(!strcmp(result->string, "John-Doe"));
+    result = ka_length(&ctx, ka_string(""));
+    assert(*result->number == 0);
     ka_free(result);
 
-    result = ka_div(NULL, ka_chain(ka_string("John Doe"), ka_number(2), NULL));
-    assert(result->type == KA_NONE);
+    result = ka_length(&ctx, ka_string("John Doe"));
+    assert(*result->number == 8);
+    ka_free(result);
+
+    result = ka_length(&ctx, ka_stringn("John\0Doe", 8));
+    assert(*result->number == 8);
+    ka_free(result);
+
+    result = ka_length(&ctx, ka_list(NULL));
+    assert(*result->number == 0);
+    ka_free(result);
+
+    result = ka_length(&ctx, ka_list(ka_number(1), ka_string("John"), NULL));
+    assert(*result->number == 2);
+    ka_free(result);
+
+    result = ka_length(&ctx, ka_block(ka_number(1), ka_string("John"), NULL));
+    assert(*result->number == 0);
+    ka_free(result);
+
+    result = ka_length(&ctx, ka_number(1));
+    assert(*result->number == 0);
+    ka_free(result);
+
+    ka_free(ctx);
+}
+
+void test_slice()
+{
+    KaNode *ctx = ka_new(KA_CTX), *result;
+    KaNode *text = ka_string("The quick brown fox jumps over the lazy dog");
+
+    ka_free(ka_slice(&ctx, NULL));
+
+    result = ka_slice(&ctx, ka_chain(ka_copy(text), ka_number(4), NULL));
+    assert(result->flags & KA_VIEW && result->string == text->string + 4);
+    assert(result->length == 39);
+    ka_free(result);
+
+    result = ka_slice(&ctx, ka_chain(
+        ka_copy(text), ka_number(4), ka_number(9), NULL
+    ));
+    assert(result->flags & KA_INLINE && !strcmp(result->string, "quick"));
+    ka_free(result);
+
+    result = ka_slice(&ctx, ka_chain(
+        ka_copy(text), ka_number(-8), ka_number(100), NULL
+    ));
+    assert(!strcmp(result->string, "lazy dog"));
+    ka_free(result);
+
+    result = ka_slice(&ctx, ka_chain(
+        ka_copy(text), ka_number(9), ka_number(4), NULL
+    ));
+    assert(result->type == KA_STRING && result->length == 0);
+    ka_free(result);
+
+    result = ka_slice(&ctx, ka_chain(ka_number(1), ka_number(0), NULL));
+    assert(result->type == KA_NONE);
+    ka_free(result);
+
+    // Views act as strings for the string functions
+    KaNode *view = ka_slice(&ctx, ka_chain(
+        ka_copy(text), ka_number(4), ka_number(25), NULL
+    ));
+    assert(view->flags & KA_VIEW);
+
+    result = ka_length(&ctx, ka_copy(view));
+    assert(*result->number == 21);
+    ka_free(result);
+
+    result = ka_eq(&ctx, ka_chain(
+        ka_copy(view), ka_string("quick brown fox jumps"), NULL
+    ));
+    assert(result->type == KA_TRUE);
+    ka_free(result);
+
+    result = ka_upper(&ctx, ka_copy(view));
+    assert(!strcmp(result->string, "QUICK BROWN FOX JUMPS"));
+    ka_free(result);
+
+    result = ka_add(&ctx, ka_chain(ka_copy(view), ka_string("!"), NULL));
+    assert(!strcmp(result->string, "quick brown fox jumps!"));
+    assert(text->length == 43 && !strncmp(text->string, "The quick", 9));
+    ka_free(result);
+
+    ka_free(view);
+    ka_free(text);
+    ka_free(ctx);
+}
+
+void test_upperlower()
+{
+    KaNode *ctx = ka_new(KA_CTX), *result;
+
+    ka_free(ka_upper(&ctx, NULL));
+    result = ka_upper(&ctx, ka_string("John Doe"));
+    assert(!strcmp(result->string, "JOHN DOE"));
+    ka_free(result);
+
+    ka_free(ka_lower(&ctx, NULL));
+    result = ka_lower(&ctx, ka_string("John Doe"));
+    assert(!strcmp(result->string, "john doe"));
+    ka_free(result);
+
+    // Every byte, through both the word and the byte loop
+    char bytes[256], upper[256], lower[256];
+
+    for (int i = 0; i < 256; i++) {
+        bytes[i] = i;
+        upper[i] = (i >= 'a' && i <= 'z') ? i - 32 : i;
+        lower[i] = (i >= 'A' && i <= 'Z') ? i + 32 : i;
+    }
+
+    for (int offset = 0; offset < 8; offset++) {
+        result = ka_upper(&ctx, ka_stringn(bytes + offset, 256 - offset));
+        assert(!memcmp(result->string, upper + offset, 256 - offset));
+        ka_free(result);
+
+        result = ka_lower(&ctx, ka_stringn(bytes + offset, 256 - offset));
+        assert(!memcmp(result->string, lower + offset, 256 - offset));
+        ka_free(result);
+    }
+
+    // UTF-8 sequences are left as they are
+    result = ka_upper(&ctx, ka_string("a\xc3\xa7\xc3\xa3o ma\xc3\xa7\xc3\xa3"));
+    assert(!strcmp(result->string, "A\xc3\xa7\xc3\xa3O MA\xc3\xa7\xc3\xa3"));
+    ka_free(result);
+
+    ka_free(ctx);
+}
+
+void test_trim()
+{
+    KaNode *ctx = ka_new(KA_CTX), *result;
+
+    ka_free(ka_trim(&ctx, NULL));
+
+    result = ka_trim(&ctx, ka_string(" \t John Doe\r\n"));
+    assert(!strcmp(result->string, "John Doe"));
+    ka_free(result);
+
+    result = ka_trim(&ctx, ka_string("  "));
+    assert(result->type == KA_STRING && result->length == 0);
+    ka_free(result);
+
+    result = ka_trim(&ctx, ka_chain(
+        ka_string("--==John Doe==--"), ka_string("=-"), NULL
+    ));
+    assert(!strcmp(result->string, "John Doe"));
+    ka_free(result);
+
+    ka_free(ctx);
+}
+
+void test_isclass()
+{
+    KaNode *ctx = ka_new(KA_CTX), *result;
+    const char *digits[] = { "0", "0123456789", "12345678901234567" };
+    const char *other[] = { "", "12a", "1234567890123456x", "1.5", "\xb1" };
+
+    for (int i = 0; i < 3; i++) {
+        result = ka_isdigit(&ctx, ka_string(digits[i]));
+        assert(result->type == KA_TRUE);
+        ka_free(result);
+    }
+
+    for (int i = 0; i < 5; i++) {
+        result = ka_isdigit(&ctx, ka_string(other[i]));
+        assert(result->type == KA_FALSE);
+        ka_free(result);
+    }
+
+    result = ka_isalpha(&ctx, ka_string("JohnDoeAZaz"));
+    assert(result->type == KA_TRUE);
+    ka_free(result);
+
+    result = ka_isalpha(&ctx, ka_string("John Doe"));
+    assert(result->type == KA_FALSE);
+    ka_free(result);
+
+    result = ka_isalpha(&ctx, ka_string("@[`{"));
+    assert(result->type == KA_FALSE);
+    ka_free(result);
+
+    result = ka_isspace(&ctx, ka_string(" \t\r\n"));
+    assert(result->type == KA_TRUE);
+    ka_free(result);
+
+    result = ka_isspace(&ctx, ka_string(" x "));
+    assert(result->type == KA_FALSE);
+    ka_free(result);
+
+    result = ka_isdigit(&ctx, ka_number(1));
+    assert(result->type == KA_NONE);
+    ka_free(result);
+
+    ka_free(ctx);
+}
+
+KaNode *match(KaNode **ctx, const char *text, const char *pattern)
+{
+    return ka_match(ctx, ka_chain(ka_string(text), ka_string(pattern), NULL));
+}
+
+void test_match()
+{
+    KaNode *ctx = ka_new(KA_CTX), *result;
+
+    ka_free(ka_match(&ctx, NULL));
+
+    result = match(&ctx, "John Doe, 42 years", "(\\w+) (\\w+), (\\d+)");
+    assert(result->type == KA_LIST);
+    ka_own(result->children);
+    assert(!strcmp(result->children->string, "John Doe, 42"));
+    assert(!strcmp(result->children->next->string, "John"));
+    assert(!strcmp(result->children->next->next->string, "Doe"));
+    assert(!strcmp(result->children->next->next->next->string, "42"));
+    ka_free(result);
+
+    // Leftmost match, alternatives in order, greedy and lazy repetition
+    const char *cases[][3] = {
+        { "xabcabc", "abc", "abc" },
+        { "abcd", "ab|abcd", "ab" },
+        { "<a><b>", "<.*>", "<a><b>" },
+        { "<a><b>", "<.*?>", "<a>" },
+        { "aaa", "a+?", "a" },
+        { "color colour", "colou?r", "color" },
+        { "x=1;y=22", "[a-z]=[^;]+$", "y=22" },
+        { "tab\there", "\\s", "\t" },
+        { "a.b", "\\.", "." },
+        { "A-Z", "[A\\-]+", "A-" },
+        { "]x", "[]]", "]" },
+        { "go gopher", "^go", "go" },
+        { "abc", "(?:a|b)+", "ab" },
+        { "abc", "x*", "" },
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        result = match(&ctx, cases[i][0], cases[i][1]);
+        ka_own(result->children);
+        assert(!strcmp(result->children->string, cases[i][2]));
+        ka_free(result);
+    }
+
+    // Failed matches, unmatched groups and invalid patterns
+    const char *none[][2] = {
+        { "abc", "abd" }, { "abc", "^b" }, { "abc", "a$" },
+        { "abc", "(a" }, { "abc", "a)" }, { "abc", "*a" }, { "abc", "[a" },
+        { "abc", "a\\" },
+    };
+
+    for (size_t i = 0; i < sizeof(none) / sizeof(none[0]); i++) {
+        result = match(&ctx, none[i][0], none[i][1]);
+        assert(result->type == KA_NONE);
+        ka_free(result);
+    }
+
+    result = match(&ctx, "ac", "a(b)?c");
+    assert(result->children->next->type == KA_NONE);
+    ka_free(result);
+
+    // Binary subjects
+    result = ka_match(&ctx, ka_chain(
+        ka_stringn("a\0b", 3), ka_stringn("\0b", 2), NULL
+    ));
+    assert(result->children->length == 2);
+    ka_free(result);
+
+    // Patterns that make backtracking matchers explode stay linear
+    char text[65] = "", pattern[64 * 2 + 65] = "";
+
+    for (int i = 0; i < 64; i++) {
+        strcat(text, "a");
+        strcat(pattern, "a?");
+    }
+
+    strcat(pattern, text);
+    result = match(&ctx, text, pattern);
+    assert(result->children->length == 64);
+    ka_free(result);
+
+    result = match(&ctx, "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaab", "(a*)*c");
+    assert(result->type == KA_NONE);
+    ka_free(result);
+
+    ka_free(ctx);
+}
+
+int count(KaNode *list)
+{
+    int count = 0;
+    for (KaNode *node = list->children; node; node = node->next) count++;
+    return count;
+}
+
+void test_matchall()
+{
+    KaNode *ctx = ka_new(KA_CTX), *result;
+
+    result = ka_matchall(&ctx, ka_chain(
+        ka_string("a=1, b=22, c=333"), ka_string("\\d+"), NULL
+    ));
+    assert(count(result) == 3);
+    assert(!strcmp(result->children->next->next->string, "333"));
+    ka_free(result);
+
+    result = ka_matchall(&ctx, ka_chain(
+        ka_string("a=1, b=22"), ka_string("(\\w)=(\\d+)"), NULL
+    ));
+    assert(result->children->type == KA_LIST);
+    assert(!strcmp(result->children->next->children->next->string, "b"));
+    assert(!strcmp(result->children->next->children->next->next->string,
+                   "22"));
+    ka_free(result);
+
+    result = ka_matchall(&ctx, ka_chain(
+        ka_string("abc"), ka_string("x*"), NULL
+    ));
+    assert(count(result) == 4);
+    ka_free(result);
+
+    result = ka_matchall(&ctx, ka_chain(
+        ka_string("abc"), ka_string("^."), NULL
+    ));
+    assert(count(result) == 1);
+    ka_free(result);
+
+    result = ka_matchall(&ctx, ka_chain(
+        ka_string("abc"), ka_string("("), NULL
+    ));
+    assert(result->type == KA_NONE);
+    ka_free(result);
+
+    ka_free(ctx);
+}
+
+void test_arithmetic()
+{
+    KaNode *ctx = ka_new(KA_CTX), *result;
+
+    ka_free(ka_add(&ctx, NULL));
+    result = ka_add(NULL, ka_chain(ka_number(3), ka_number(2), NULL));
+    assert(*result->number == 5);
+    ka_free(result);
+
+    ka_free(ka_sub(&ctx, NULL));
+    result = ka_sub(NULL, ka_chain(ka_number(3), ka_number(2), NULL));
+    assert(*result->number == 1);
+    ka_free(result);
+
+    ka_free(ka_mul(&ctx, NULL));
+    result = ka_mul(NULL, ka_chain(ka_number(3), ka_number(2), NULL));
+    assert(*result->number == 6);
+    ka_free(result);
+
+    ka_free(ka_div(&ctx, NULL));
+    result = ka_div(NULL, ka_chain(ka_number(3), ka_number(2), NULL));
+    assert(*result->number == 1.5);
+    ka_free(result);
+
+    ka_free(ka_mod(&ctx, NULL));
+    result = ka_mod(NULL, ka_chain(ka_number(3), ka_number(2), NULL));
+    assert(*result->number == 1);
+    ka_free(result);
+
+    result = ka_add(NULL, ka_chain(
+        ka_number(2), ka_string("Message"), NULL
+    ));
+    assert(!strcmp(result->string, "2Message"));
+    ka_free(result);
+
+    result = ka_add(NULL, ka_chain(
+        ka_string("Hello"), ka_string("World"), NULL
+    ));
+    assert(!strcmp(result->string, "HelloWorld"));
+    ka_free(result);
+
+    result = ka_add(NULL, ka_chain(
+        ka_string("Ten"), ka_number(10), NULL
+    ));
+    assert(!strcmp(result->string, "Ten10"));
+    ka_free(result);
+
+    result = ka_add(NULL, ka_chain(
+        ka_string("Float"), ka_number(10.123), NULL
+    ));
+    assert(!strcmp(result->string, "Float10.12"));
+    ka_free(result);
+
+    result = ka_add(NULL, ka_chain(
+        ka_list(ka_number(1), NULL),
+        ka_list(ka_number(2), NULL),
+        NULL
+    ));
+    assert(result->type == KA_LIST);
+    assert(*result->children->number == 1);
+    assert(*result->children->next->number == 2);
+    ka_free(result);
+
+    result = ka_add(NULL, ka_chain(
+        ka_list(ka_number(3), NULL),
+        ka_number(4),
+        NULL
+    ));
+    assert(result->type == KA_LIST);
+    assert(*result->children->number == 3);
+    assert(*result->children->next->number == 4);
+    ka_free(result);
+
+    result = ka_add(NULL, ka_chain(
+        ka_number(4),
+        ka_list(ka_number(3), NULL),
+        NULL
+    ));
+    assert(result->type == KA_LIST);
+    assert(*result->children->number == 4);
+    assert(*result->children->next->number == 3);
+    ka_free(result);
+
+    result = ka_mul(NULL, ka_chain(ka_string("John"), ka_number(2), NULL));
+    assert(result->type == KA_NONE);
+    ka_free(result);
+
+    KaNode *list = ka_list(ka_number(1), ka_number(2), NULL);
+    KaNode *block = ka_block(ka_symbol("0"), NULL);
+
+    result = ka_mul(&ctx, ka_chain(list, block, NULL));
+    assert(*result->children->number == 1);
+    assert(*result->children->next->number == 2);
+    ka_free(result);
+
+    result = ka_mul(NULL, ka_chain(
+        ka_list(ka_string("John"), ka_string("Doe"), NULL),
+        ka_string("-"),
+        NULL
+    ));
+    assert(result->type == KA_STRING);
+    assert(!strcmp(result->string, "John-Doe"));
+    ka_free(result);
+
+    result = ka_div(NULL, ka_chain(ka_string("John Doe"), ka_number(2), NULL));
+    assert(result->type == KA_NONE);
     ka_free(result);
 
     result = ka_div(NULL, ka_chain(
@@ -1221,6 +1998,17 @@ void test_parser()
     );
     ka_free(result);
 
+    pos = 0;
+    result = ka_parser(
+        "'John said \"hi\" to everyone in the room' "
+        "\"and everyone in the room said \\\"hi\\\" back\"", &pos
+    );
+    assert(!strcmp(result->children->string,
+                   "John said \"hi\" to everyone in the room"));
+    assert(!strcmp(result->children->next->string,
+                   "and everyone in the room said \"hi\" back"));
+    ka_free(result);
+
     pos = 0;
     result = ka_parser("age; 42 'John Doe' 21;name", &pos);
     assert(!strcmp(result->children->symbol, "age"));
@@ -1249,40 +2037,210 @@ void test_parser()
     assert(*block->children->next->children->number == 72);
     ka_free(result);
 
-    pos = 0;
-    result = ka_parser("i = 1 * 2; 5 + 6 - 7", &pos);
-    KaNode *expr_set = result->children->children;
-    KaNode *expr_mul = result->children->children->next->next->children;
-    KaNode *expr_sub = result->next->children->children;
-    KaNode *expr_sum = result->next->children->children->next->children;
-    assert(expr_set->type == KA_SYMBOL && !strcmp(expr_set->symbol, "="));
-    assert(!strcmp(expr_set->next->symbol, "i"));
-    assert(expr_mul->type == KA_SYMBOL && !strcmp(expr_mul->symbol, "*"));
-    assert(*expr_mul->next->number == 1 && *expr_mul->next->next->number == 2);
-    assert(expr_sub->type == KA_SYMBOL && !strcmp(expr_sub->symbol, "-"));
-    assert(*expr_sub->next->next->number == 7);
-    assert(expr_sum->type == KA_SYMBOL && !strcmp(expr_sum->symbol, "+"));
-    assert(*expr_sum->next->number == 5 && *expr_sum->next->next->number == 6);
+    pos = 0;
+    result = ka_parser("i = 1 * 2; 5 + 6 - 7", &pos);
+    KaNode *expr_set = result->children->children;
+    KaNode *expr_mul = result->children->children->next->next->children;
+    KaNode *expr_sub = result->next->children->children;
+    KaNode *expr_sum = result->next->children->children->next->children;
+    assert(expr_set->type == KA_SYMBOL && !strcmp(expr_set->symbol, "="));
+    assert(!strcmp(expr_set->next->symbol, "i"));
+    assert(expr_mul->type == KA_SYMBOL && !strcmp(expr_mul->symbol, "*"));
+    assert(*expr_mul->next->number == 1 && *expr_mul->next->next->number == 2);
+    assert(expr_sub->type == KA_SYMBOL && !strcmp(expr_sub->symbol, "-"));
+    assert(*expr_sub->next->next->number == 7);
+    assert(expr_sum->type == KA_SYMBOL && !strcmp(expr_sum->symbol, "+"));
+    assert(*expr_sum->next->number == 5 && *expr_sum->next->next->number == 6);
+    ka_free(result);
+
+    pos = 0;
+    result = ka_parser("!1 && 2", &pos);
+    KaNode *expr_and = result->children->children;
+    KaNode *expr_not = result->children->children->next->children;
+    assert(expr_and->type == KA_SYMBOL && !strcmp(expr_and->symbol, "&&"));
+    assert(expr_not->type == KA_SYMBOL && !strcmp(expr_not->symbol, "!"));
+    assert(*expr_not->next->number == 1);
+    assert(*expr_and->next->next->number == 2);
+    ka_free(result);
+
+    pos = 0;
+    result = ka_parser("+; 2", &pos);
+    assert(*result->children->number == 2);
+    ka_free(result);
+
+    pos = 0;
+    result = ka_parser("?; 2", &pos);
+    assert(*result->next->children->number == 2);
+    ka_free(result);
+
+    pos = 0;
+    result = ka_parser("age # This is a comment\n42 /* **/ 43", &pos);
+    assert(!strcmp(result->children->symbol, "age"));
+    assert(*result->next->children->next->number == 43);
+    ka_free(result);
+
+    pos = 0;
+    result = ka_parser("name 'John", &pos);
+    assert(!strcmp(result->children->next->string, "John"));
+    assert(pos == 10);
+    ka_free(result);
+
+    pos = 0;
+    result = ka_parser("! ! x; a . b + c . d = e", &pos);
+    assert(result->children->type == KA_EXPR);
+    assert(!strcmp(result->children->next->symbol, "x"));
+    KaNode *expr_assign = result->next->children->children;
+    KaNode *expr_add = expr_assign->next->children;
+    assert(!strcmp(expr_assign->symbol, "="));
+    assert(!strcmp(expr_add->symbol, "+"));
+    assert(!strcmp(expr_add->next->children->symbol, "."));
+    assert(!strcmp(expr_add->next->next->children->symbol, "."));
+    ka_free(result);
+
+    assert(ka_defop("plus", KA_OP_INFIX, KA_PREC_KEY));
+    pos = 0;
+    result = ka_parser("1 plus 2 * 3", &pos);
+    assert(!strcmp(result->children->children->symbol, "plus"));
+    assert(!strcmp(result->children->children->next->next->children->symbol,
+                   "*"));
+    ka_free(result);
+
+    size_t at = 0;
+    result = ka_parse("1; 2\0 3; 4", 8, &at);
+    assert(*result->children->number == 1);
+    assert(*result->next->children->number == 2);
+    assert(*result->next->children->next->number == 3);
+    assert(!result->next->next && at == 8);
+    ka_free(result);
+}
+
+int same_tree(KaNode *a, KaNode *b)
+{
+    for (; a && b; a = a->next, b = b->next) {
+        if (a->type != b->type) return 0;
+        if (a->type == KA_NUMBER && *a->number != *b->number) return 0;
+        if (a->type >= KA_STRING && a->type <= KA_SYMBOL &&
+            (a->length != b->length || memcmp(a->string, b->string,
+                                              a->length))) {
+            return 0;
+        }
+        if (a->type >= KA_LIST && !same_tree(a->children, b->children)) {
+            return 0;
+        }
+    }
+
+    return !a && !b;
+}
+
+void test_stream()
+{
+    const char *code =
+        "x := 1.25; y := [1,\n 2] # comment (\n"
+        "/* block\n comment ] */ print 'It\\'s' \"a\\\\\" x.y\n"
+        "def f { $0 + 1 }; f(41)\n"
+        "s = 'long string with a \\' quote that spans\nlines' 12";
+    size_t length = strlen(code), pos = 0;
+    KaNode *expected = ka_parse(code, length, &pos);
+
+    // Every split of the source gives the same statements
+    for (size_t size = 1; size <= 7; size++) {
+        KaStream stream = { 0 };
+        KaNode *result = NULL, **last = &result;
+
+        for (size_t i = 0; i <= length; i += size) {
+            size_t n = (i + size <= length) ? size : length - i;
+            ka_stream_feed(&stream, code + i, n);
+
+            for (KaNode *expr; (expr = ka_stream_next(&stream, !n));) {
+                *last = expr;
+                while (*last) last = &(*last)->next;
+            }
+        }
+
+        for (KaNode *expr; (expr = ka_stream_next(&stream, 1));) {
+            *last = expr;
+            while (*last) last = &(*last)->next;
+        }
+
+        assert(same_tree(result, expected));
+        ka_free(result);
+        ka_stream_free(&stream);
+    }
+
+    ka_free(expected);
+
+    // Statements come out as soon as they end and memory stays bounded
+    KaStream stream = { 0 };
+    KaNode *result;
+
+    for (int i = 0; i < 10000; i++) {
+        const char *line = "x := [1, 2]\n";
+
+        for (const char *c = line; *c; c++) {
+            ka_stream_feed(&stream, c, 1);
+            result = ka_stream_next(&stream, 0);
+            assert(!result == (*c != '\n'));
+            ka_free(result);
+        }
+    }
+
+    assert(stream.cap < 64 && stream.depth == 0);
+
+    // A stray closing bracket does not stop what follows
+    ka_stream_feed(&stream, "1 ) 2\n", 6);
+    result = ka_stream_next(&stream, 0);
+    assert(*result->children->number == 1);
+    ka_free(result);
+    result = ka_stream_next(&stream, 0);
+    assert(*result->children->number == 2);
+    ka_free(result);
+
+    // What is left at the end of the input is parsed as it is
+    ka_stream_feed(&stream, "[1, 2", 5);
+    assert(!ka_stream_next(&stream, 0) && stream.depth == 1);
+    result = ka_stream_next(&stream, 1);
+    assert(result->children->type == KA_LIST && stream.depth == 0);
+    ka_free(result);
+    assert(!ka_stream_next(&stream, 1));
+
+    ka_stream_free(&stream);
+}
+
+void test_precision()
+{
+    KaNode *result;
+
+    result = ka_precision(NULL, ka_number(4));
+    assert(*result->number == 2);
+    ka_free(result);
+
+    result = ka_cat(NULL, ka_chain(ka_string("Pi "), ka_number(3.14159), NULL));
+    assert(!strcmp(result->string, "Pi 3.1416"));
     ka_free(result);
 
-    pos = 0;
-    result = ka_parser("!1 && 2", &pos);
-    KaNode *expr_and = result->children->children;
-    KaNode *expr_not = result->children->children->next->children;
-    assert(expr_and->type == KA_SYMBOL && !strcmp(expr_and->symbol, "&&"));
-    assert(expr_not->type == KA_SYMBOL && !strcmp(expr_not->symbol, "!"));
-    assert(*expr_not->next->number == 1);
-    assert(*expr_and->next->next->number == 2);
+    result = ka_cat(NULL, ka_chain(ka_string("x"), ka_number(1e18L), NULL));
+    assert(!strcmp(result->string, "x1000000000000000000"));
     ka_free(result);
 
-    pos = 0;
-    result = ka_parser("+; 2", &pos);
-    assert(*result->children->number == 2);
+    result = ka_join(NULL, ka_chain(
+        ka_list(ka_number(1e18L), ka_number(ldexpl(1, 62)), NULL),
+        ka_string(" "),
+        NULL
+    ));
+    assert(!strcmp(result->string, "1000000000000000000 4611686018427387904"));
     ka_free(result);
 
-    pos = 0;
-    result = ka_parser("?; 2", &pos);
-    assert(*result->next->children->number == 2);
+    result = ka_precision(NULL, NULL);
+    assert(*result->number == 4);
+    ka_free(result);
+
+    ka_free(ka_precision(NULL, ka_number(100)));
+    result = ka_precision(NULL, ka_number(-5));
+    assert(*result->number == KA_MAX_DECIMALS);
+    ka_free(result);
+
+    result = ka_precision(NULL, ka_number(2));
+    assert(*result->number == -1);
     ka_free(result);
 }
 
@@ -1321,6 +2279,76 @@ void test_write()
     assert(!strncmp(result->string, "content", 7));
     ka_free(result);
 
+    ka_free(
+        ka_write(&ctx, ka_chain(
+            ka_string("tests.out"), ka_stringn("\x7f" "ELF\0\0\1", 7), NULL
+        ))
+    );
+    result = ka_read(&ctx, ka_string("tests.out"));
+    assert(result->length == 7);
+    assert(!memcmp(result->string, "\x7f" "ELF\0\0\1", 7));
+    ka_free(result);
+
+    // Large files are mapped, a size of whole pages still ends with a NUL
+    size_t size = KA_READ_MAP * 2;
+    char *text = (char *)malloc(size);
+
+    for (size_t i = 0; i < size; i++) {
+        text[i] = 'a' + i % 26;
+    }
+
+    ka_free(ka_write(&ctx, ka_chain(
+        ka_string("tests.out"), ka_stringn(text, size), NULL
+    )));
+    result = ka_read(&ctx, ka_string("tests.out"));
+    assert(ka_buf_mapped(result) && result->length == size);
+    assert(!memcmp(result->string, text, size) && !result->string[size]);
+
+    // Views keep the mapping, and changing them makes a copy
+    KaNode *view = ka_substr(result, 1000, 5000);
+    ka_free(result);
+    assert(ka_buf_mapped(view) && !memcmp(view->string, text + 1000, 5000));
+    ka_append(view, "!", 1);
+    assert(!ka_buf_mapped(view) && view->string[5000] == '!');
+    ka_free(view);
+
+    // A mapped file can be written back to itself
+    result = ka_read(&ctx, ka_string("tests.out"));
+    ka_free(ka_write(&ctx, ka_chain(ka_string("tests.out"), result, NULL)));
+    result = ka_read(&ctx, ka_string("tests.out"));
+    assert(result->length == size && !memcmp(result->string, text, size));
+
+    // Strings of a mapped file outlive it being truncated
+    view = ka_substr(result, size - 10, 10);
+    ka_free(ka_write(&ctx, ka_chain(
+        ka_string("tests.out"), ka_string("short"), NULL
+    )));
+    assert(result->length == size && !memcmp(result->string, text, size));
+    assert(!memcmp(view->string, text + size - 10, 10));
+    ka_append(result, "y", 1);
+    assert(result->length == size + 1 && result->string[size] == 'y');
+    ka_free(result);
+    ka_free(view);
+
+    result = ka_read(&ctx, ka_string("tests.out"));
+    assert(result->length == 5 && !strcmp(result->string, "short"));
+    ka_free(result);
+    free(text);
+
+    // Files too long for a string give none instead of a cut length
+    FILE *file = fopen("tests.out", "wb");
+    assert(!fseeko(file, (off_t)KA_MAX_LENGTH + 1, SEEK_SET));
+    fputc('x', file);
+    fclose(file);
+    result = ka_read(&ctx, ka_string("tests.out"));
+    assert(result->type == KA_NONE);
+    ka_free(result);
+
+    // Files without a size are read as streams
+    result = ka_read(&ctx, ka_string("/proc/self/stat"));
+    assert(result->length > 0 && !ka_buf_mapped(result));
+    ka_free(result);
+
     ka_free(ctx);
 }
 
@@ -1349,6 +2377,188 @@ void test_load()
     ka_free(ctx);
 }
 
+KaNode *native_double(KaNode **ctx, KaNode *args)
+{
+    KaNode *result = ka_number(
+        (args && args->type == KA_NUMBER) ? *args->number * 2 : 0
+    );
+
+    ka_free(args);
+    return result;
+}
+
+void test_cache()
+{
+    KaNode *ctx = ka_init(), *result, *tree;
+    const char *code =
+        "n := 1.25; items := [1, 'item', 'a string long enough for a buffer']\n"
+        "def f { $0 + n }; s := 'a string long enough for a buffer'\n"
+        "s += '!'; total := (f 40) + (length s) + (length items)";
+    size_t length = strlen(code), pos = 0;
+
+    ka_free(ka_write(&ctx, ka_chain(
+        ka_string("tests.ka"), ka_string(code), NULL
+    )));
+    tree = ka_parse(code, length, &pos);
+    assert(ka_cache_save("tests.kac", tree, code, length));
+
+    // The image holds the same tree and runs like the source
+    KaNode *image = ka_cache_load("tests.kac", code, length);
+    assert(same_tree(image, tree));
+    ka_free(tree);
+
+    ka_free(ka_load(&ctx, ka_string("tests.kac")));
+    result = ka_get(&ctx, ka_symbol("total"));
+    assert(*result->number == 78.25);
+    ka_free(result);
+
+    ka_free(ka_load(&ctx, ka_string("tests.ka")));
+    result = ka_get(&ctx, ka_symbol("total"));
+    assert(*result->number == 78.25);
+    ka_free(result);
+
+    result = ka_get(&ctx, ka_symbol("s"));
+    assert(!strcmp(result->string, "a string long enough for a buffer!"));
+    ka_free(result);
+
+    // A changed source is parsed again
+    assert(!ka_cache_load("tests.kac", "total := 1", 10));
+    ka_free(ka_write(&ctx, ka_chain(
+        ka_string("tests.ka"), ka_string("total := 1"), NULL
+    )));
+    ka_free(ka_load(&ctx, ka_string("tests.ka")));
+    result = ka_get(&ctx, ka_symbol("total"));
+    assert(*result->number == 1);
+    ka_free(result);
+
+    // A damaged image is refused. Images are replaced, not rewritten, as
+    // the one above is still mapped.
+    result = ka_read(&ctx, ka_string("tests.kac"));
+    result->string[result->length - 2] ^= 1;
+    remove("tests.kac");
+    ka_free(ka_write(&ctx, ka_chain(
+        ka_string("tests.kac"), ka_copy(result), NULL
+    )));
+    assert(!ka_cache_load("tests.kac", NULL, 0));
+
+    result->length--;
+    remove("tests.kac");
+    ka_free(ka_write(&ctx, ka_chain(
+        ka_string("tests.kac"), ka_copy(result), NULL
+    )));
+    ka_free(result);
+    assert(!ka_cache_load("tests.kac", NULL, 0));
+
+    result = ka_load(&ctx, ka_string("tests.kac"));
+    assert(result->type == KA_NONE);
+    ka_free(result);
+
+    // Trees with unregistered functions can not be saved
+    tree = ka_func(native_double);
+    assert(!ka_cache_save("tests.kac", tree, "", 0));
+    ka_free(tree);
+
+    ka_free(ctx);
+}
+
+void test_modules()
+{
+    KaNode *ctx = ka_init(), *result;
+    size_t hits = ka_module_hits, misses = ka_module_misses;
+
+    ka_free(ka_def(&ctx, ka_chain(ka_symbol("n"), ka_number(0), NULL)));
+    ka_free(ka_write(&ctx, ka_chain(
+        ka_string("tests.ka"), ka_string("n = n + 1"), NULL
+    )));
+
+    // Parsed once, run on every load
+    for (int i = 1; i <= 3; i++) {
+        result = ka_load(&ctx, ka_string("tests.ka"));
+        assert(*result->number == i);
+        ka_free(result);
+    }
+
+    assert(ka_module_misses == misses + 1 && ka_module_hits == hits + 2);
+
+    result = ka_modules(&ctx, NULL);
+    assert(!strcmp(result->children->key, "hits"));
+    assert(*result->children->number == hits + 2);
+    assert(*result->children->next->number == misses + 1);
+
+    assert(ka_suffix(result->children->next->next->children, "/tests.ka"));
+    ka_free(result);
+
+    // A changed file is read again
+    ka_free(ka_write(&ctx, ka_chain(
+        ka_string("tests.ka"), ka_string("n = n + 10"), NULL
+    )));
+    result = ka_load(&ctx, ka_string("tests.ka"));
+    assert(*result->number == 13);
+    assert(ka_module_misses == misses + 2);
+    ka_free(result);
+
+    // Even by the module itself while it runs
+    ka_free(ka_write(&ctx, ka_chain(
+        ka_string("tests.ka"),
+        ka_string("write 'tests.ka' 'n = 100'; load 'tests.ka'; n = n + 1"),
+        NULL
+    )));
+    ka_free(ka_load(&ctx, ka_string("tests.ka")));
+    result = ka_get(&ctx, ka_symbol("n"));
+    assert(*result->number == 101);
+    ka_free(result);
+
+    result = ka_load(&ctx, ka_string("tests.ka"));
+    assert(*result->number == 100);
+    ka_free(result);
+
+    result = ka_load(&ctx, ka_string("missing.ka"));
+    assert(result->type == KA_NONE);
+    ka_free(result);
+
+    // A replaced image is unmapped once its strings are no longer used
+    const char *code[] = {
+        "s := 'a string longer than sixteen bytes'",
+        "s = 'another string longer than sixteen bytes'",
+    };
+    KaImage *first = NULL;
+
+    for (int i = 0; i < 2; i++) {
+        size_t pos = 0;
+        KaNode *tree = ka_parse(code[i], strlen(code[i]), &pos);
+        assert(ka_cache_save("tests.kac", tree, NULL, 0));
+        ka_free(tree);
+
+        ka_free(ka_load(&ctx, ka_string("tests.kac")));
+        if (!first) first = ka_images;
+        assert(first->retired == i);
+    }
+
+    // The first image was retired while s still held its string
+    KaImage *image = ka_images;
+    while (image && image != first) image = image->next;
+    assert(image == first);
+
+    result = ka_get(&ctx, ka_symbol("s"));
+    assert(!strcmp(result->string, "another string longer than sixteen bytes"));
+    ka_free(result);
+
+    ka_gc(ctx);
+    ka_module_clear();
+
+    image = ka_images;
+    while (image && image != first) image = image->next;
+    assert(!image);
+
+    // Natives registered again replace the earlier entry
+    size_t natives = ka_natives_count;
+    ka_register("tests_native", ka_get);
+    ka_register("tests_native", ka_get);
+    assert(ka_natives_count == natives + 1);
+
+    ka_free(ctx);
+}
+
 void test_init()
 {
     KaNode *ctx = ka_init(), *last, *prev;
@@ -1378,6 +2588,284 @@ KaNode *eval_code(KaNode **ctx, const char *code)
     return result;
 }
 
+void test_clone()
+{
+    KaNode *base = ka_init(), *ctx, *result;
+    size_t base_count = 0, count = 0;
+
+    ka_free(eval_code(&base,
+        "def twice { $0 * 2 }; total := 10\n"
+        "name := 'a name long enough to need a buffer'"
+    ));
+    ctx = ka_clone(base);
+
+    for (KaNode *node = base; node; node = node->next) {
+        base_count++;
+        if (node->type == KA_CTX && !node->key) break;
+    }
+
+    for (KaNode *node = ctx; node; node = node->next) {
+        count++;
+        if (node->type == KA_CTX && !node->key) break;
+    }
+
+    assert(count == base_count);
+
+    // The clone starts from the prelude of the original
+    result = eval_code(&ctx, "twice total");
+    assert(*result->number == 20);
+    ka_free(result);
+
+    // Then each goes its own way
+    ka_free(eval_code(&ctx, "total = 1; name += '!'; extra := 2"));
+    result = eval_code(&base, "total");
+    assert(*result->number == 10);
+    ka_free(result);
+
+    result = eval_code(&base, "name");
+    assert(!strcmp(result->string, "a name long enough to need a buffer"));
+    ka_free(result);
+
+    result = eval_code(&ctx, "name");
+    assert(!strcmp(result->string, "a name long enough to need a buffer!"));
+    ka_free(result);
+
+    result = eval_code(&base, "extra");
+    assert(result->type == KA_NONE);
+    ka_free(result);
+
+    ka_free(ctx);
+    ka_free(base);
+
+    result = ka_clone(NULL);
+    assert(result->type == KA_NONE);
+    ka_free(result);
+}
+
+void test_checkpoint()
+{
+    KaNode *ctx = ka_init(), *result;
+
+    ka_free(eval_code(&ctx,
+        "def twice { $0 * 2 }; total := 10; items := [1, 2]\n"
+        "name := 'a name long enough to need a buffer'"
+    ));
+    KaCheckpoint *cp = ka_checkpoint(ctx);
+
+    for (int i = 0; i < 3; i++) {
+        ka_free(eval_code(&ctx,
+            "extra := 5; total = total + extra; name += '!'\n"
+            "items = 'none'; del twice; def twice { $0 * 3 }; del print"
+        ));
+        result = eval_code(&ctx, "twice total");
+        assert(*result->number == 45);
+        ka_free(result);
+
+        // Back to the state of the checkpoint, deleted nodes survive
+        // a collection meanwhile
+        ka_gc(ctx);
+        ka_rollback(&ctx, cp);
+
+        result = eval_code(&ctx, "twice total");
+        assert(*result->number == 20);
+        ka_free(result);
+
+        result = eval_code(&ctx, "name");
+        assert(!strcmp(result->string, "a name long enough to need a buffer"));
+        ka_free(result);
+
+        result = eval_code(&ctx, "length items");
+        assert(*result->number == 2);
+        ka_free(result);
+
+        result = eval_code(&ctx, "extra");
+        assert(result->type == KA_NONE);
+        ka_free(result);
+
+        assert(ka_ref(&ctx, ka_symbol("print"))->type == KA_FUNC);
+    }
+
+    // Releasing the checkpoint keeps the context as it is
+    ka_free(eval_code(&ctx, "del name; total = 1"));
+    ka_checkpoint_free(ctx, cp);
+
+    result = eval_code(&ctx, "total");
+    assert(*result->number == 1);
+    ka_free(result);
+
+    assert(!ka_ref(&ctx, ka_symbol("name")));
+    ka_free(ctx);
+}
+
+void test_context_image()
+{
+    KaNode *ctx = ka_init(), *restored, *result;
+
+    ka_free(eval_code(&ctx,
+        "def half { $0 / 2 }; total := 12.5; record := [id: 7, name: 'x']\n"
+        "names := ['a name long enough to need a buffer', 'b']"
+    ));
+    ka_free(ka_def(&ctx, ka_chain(
+        ka_symbol("twice"), ka_func(native_double), NULL
+    )));
+
+    // Native functions are saved by their registered name
+    assert(!ka_context_save("tests.img", ctx));
+    ka_register("double", native_double);
+    assert(ka_context_save("tests.img", ctx));
+    ka_free(ctx);
+
+    restored = ka_context_load("tests.img");
+    assert(restored && (restored->flags & KA_STATIC));
+
+    result = eval_code(&restored, "half total");
+    assert(*result->number == 6.25);
+    ka_free(result);
+
+    result = eval_code(&restored, "twice 4");
+    assert(*result->number == 8);
+    ka_free(result);
+
+    result = eval_code(&restored, "record.id");
+    assert(*result->number == 7);
+    ka_free(result);
+
+    result = eval_code(&restored, "names");
+    assert(!strcmp(result->children->string,
+                   "a name long enough to need a buffer"));
+    ka_free(result);
+
+    // Restored nodes can change like any other
+    ka_free(eval_code(&restored,
+        "total = 'changed'; names = [1, 2, 3]; extra := 3; del half\n"
+        "record.id = 8"
+    ));
+    ka_gc(restored);
+    ka_gc(restored);
+
+    result = eval_code(&restored, "length names");
+    assert(*result->number == 3);
+    ka_free(result);
+
+    result = eval_code(&restored, "half");
+    assert(result->type == KA_NONE);
+    ka_free(result);
+
+    ka_free(restored);
+
+    // Images of another kind are refused
+    assert(!ka_cache_load("tests.img", NULL, 0));
+    assert(ka_cache_save("tests.img", NULL, "", 0));
+    assert(!ka_context_load("tests.img"));
+}
+
+void test_compiled()
+{
+    KaNode *ctx = ka_init(), *local = NULL, *result;
+    char *key = ka_intern("x");
+    KaNode *values[4] = {
+        ka_func(ka_add), NULL, ka_chain(ka_number(1), ka_number(9), NULL),
+        ka_chain(ka_number(2), ka_number(3), NULL)
+    };
+
+    // Values left out are skipped, and only the last keeps its tail
+    result = ka_args(values, 4);
+    assert(!values[0] && !values[3]);
+    assert(*result->next->number == 1 && *result->next->next->number == 2);
+    assert(*result->next->next->next->number == 3);
+    result = ka_apply(&ctx, result);
+    assert(*result->number == 3);
+    ka_free(result);
+
+    ka_free(eval_code(&ctx, "def twice { $0 * 2 }"));
+    values[0] = ka_get(&ctx, ka_symbol("twice"));
+    values[1] = ka_number(21);
+    result = ka_apply(&ctx, ka_args(values, 2));
+    assert(*result->number == 42);
+    ka_free(result);
+
+    values[0] = ka_string("plain");
+    result = ka_apply(&ctx, ka_args(values, 1));
+    assert(result->type == KA_STRING && !result->next);
+    assert(!ka_returned(result));
+    ka_free(result);
+
+    result = ka_return(&ctx, ka_number(1));
+    assert(ka_returned(result));
+    ka_free(result);
+
+    // Locals follow := and =, including = () undefining them
+    result = ka_local_set(&local, key, ka_number(1));
+    assert(local && local->key == key && *result->number == 1);
+    ka_free(result);
+
+    result = ka_local_set(&local, key, ka_string("two"));
+    assert(local->type == KA_STRING && result->type == KA_STRING);
+    ka_free(result);
+
+    result = ka_local_set(&local, key, ka_new(KA_NONE));
+    assert(!local && result->type == KA_NONE);
+    ka_free(result);
+
+    result = ka_local_def(&local, key, ka_block(ka_number(1), NULL));
+    assert(local->type == KA_BLOCK && result->type == KA_NONE);
+    ka_free(result);
+
+    result = ka_local_def(&local, key, NULL);
+    assert(local->type == KA_BLOCK && result->type == KA_NONE);
+    ka_free(result);
+
+    ka_free(local);
+    ka_free(ctx);
+}
+
+void test_jit()
+{
+    KaNode *ctx = ka_init(), *result;
+    long double total = 0;
+    int odd = 0;
+
+    for (int i = 0; i < 1000; i++) {
+        total = i % 3 == 0 ? total + i / 2.0L : total - 0.25L;
+        odd += i % 2 != 0;
+    }
+
+    ka_free(eval_code(&ctx,
+        "i := 0; total := 0; odd := 0\n"
+        "while (i < 1000) {\n"
+        "    if (i % 3 == 0) { total = total + (i / 2) }"
+        " else { total = total - 0.25 }\n"
+        "    if (i % 2 != 0) { odd = odd + 1 }\n"
+        "    i = i + 1\n"
+        "}"
+    ));
+    result = eval_code(&ctx, "total");
+    assert(*result->number == total);
+    ka_free(result);
+    result = eval_code(&ctx, "odd");
+    assert(*result->number == odd);
+    ka_free(result);
+
+    // Loops on anything but numbers stay in the interpreter
+    ka_free(eval_code(&ctx,
+        "p := 'x'; n := 0; s := ''\n"
+        "while (n < 100) { n = n + 1; if (p > 0) { n = n + 1 } }\n"
+        "while (n < 200) { n = n + 1; s = s + 'b' }"
+    ));
+    result = eval_code(&ctx, "n");
+    assert(*result->number == 200);
+    ka_free(result);
+    result = eval_code(&ctx, "s");
+    assert(result->type == KA_STRING && result->length == 100);
+    ka_free(result);
+
+#ifdef KA_JIT
+    assert(ka_jit_loops == 1);
+#endif
+
+    ka_free(ctx);
+}
+
 void test_code_print()
 {
     KaNode *ctx = ka_init();
@@ -1502,6 +2990,12 @@ void test_code_blocks()
     assert(*result->number == 4);
     ka_free(result);
 
+    ka_free(eval_code(&ctx, "def over { $0 / $1 }"));
+    ka_free(eval_code(&ctx, "operator 'over' 3"));
+    result = eval_code(&ctx, "8 over 2 + 2");
+    assert(*result->number == 6);
+    ka_free(result);
+
     ka_free(ctx);
 }
 
@@ -1575,10 +3069,66 @@ void test_code_while()
     ka_free(ctx);
 }
 
+void test_gc()
+{
+    KaNode *ctx = ka_init(), *result;
+
+    ka_free(eval_code(&ctx, "list := [1, 2, 3] * { ($) * 2 }"));
+    ka_free(eval_code(&ctx, "name := 'John' + ' ' + 'Doe'"));
+    ka_free(eval_code(&ctx, "i := 0; while (i < 10) { i += 1 }"));
+
+    size_t freed = ka_gc(ctx);
+#ifdef KA_GC
+    assert(freed > 0);
+    assert(ka_gc(ctx) == 0);
+#else
+    assert(freed == 0);
+#endif
+
+    result = eval_code(&ctx, "name");
+    assert(!strcmp(result->string, "John Doe"));
+    ka_free(result);
+
+    result = eval_code(&ctx, "list");
+    assert(*result->children->next->next->number == 6);
+    ka_free(result);
+
+    result = eval_code(&ctx, "i");
+    assert(*result->number == 10);
+    ka_free(result);
+
+    // With the collector reads share children, stores and changes copy them
+    ka_free(eval_code(&ctx, "a := [[1, 2], 3]; b := a"));
+    ka_free(eval_code(&ctx, "b.{ 1 = 4 }; c := a + [5]"));
+    KaNode *a = ka_ref(&ctx, ka_symbol("a"));
+
+    result = eval_code(&ctx, "a");
+#ifdef KA_GC
+    assert(result->flags & KA_SHARED && result->children == a->children);
+#else
+    assert(result->children != a->children);
+#endif
+    assert(*result->children->next->number == 3);
+    assert(!result->children->next->next);
+    ka_free(result);
+
+    result = eval_code(&ctx, "b");
+    assert(result->children->children != a->children->children);
+    assert(*result->children->next->number == 4);
+    ka_free(result);
+
+    result = eval_code(&ctx, "c");
+    assert(*result->children->next->next->number == 5);
+    ka_free(result);
+
+    ka_free(ctx);
+}
+
 int main()
 {
     printf("\nRunning tests...\n");
     test_new();
+    test_intern();
     test_chain();
     test_ctx();
     test_number();
@@ -1586,6 +3136,9 @@ int main()
     test_symbol();
     test_func();
     test_copy();
+    test_assign();
+    test_ntoa();
+    test_aton();
     test_children();
     test_list();
     test_expr();
@@ -1606,18 +3159,36 @@ int main()
     test_range();
     test_merge();
     test_cat();
+    test_append();
     test_split();
+    test_view();
     test_join();
+    test_find();
+    test_replace();
     test_length();
+    test_slice();
     test_upperlower();
+    test_trim();
+    test_isclass();
+    test_match();
+    test_matchall();
     test_arithmetic();
     test_eval();
     test_parser();
+    test_stream();
+    test_precision();
     test_input();
     test_read();
     test_write();
     test_load();
+    test_cache();
+    test_modules();
     test_init();
+    test_clone();
+    test_checkpoint();
+    test_context_image();
+    test_compiled();
+    test_jit();
     test_code_print();
     test_code_variables();
     test_code_lists();
@@ -1625,6 +3196,10 @@ int main()
     test_code_if();
     test_code_return();
     test_code_while();
+    test_gc();
+
+    // Reclaim everything left in the heap when built with -DKA_GC
+    ka_gc(NULL);
 
     printf("All tests passed!\n");
     return 0;